@@ -0,0 +1,756 @@
+#include "ffmpeg.h"
+#include <Windows.h>
+#include <crtdbg.h>
+#include <cstring>
+#include <algorithm>
+
+#pragma comment(lib, "winmm.lib")
+
+using namespace ffmpeg;
+using namespace std;
+
+// Benchmarks of the circular buffer, the muxer and the capture on local sources, no camera is needed.
+//  bench									count the allocations per packet of push_packet, peek_packet and Muxer::record
+//  bench replay <file> [cameras] [realtime|fast] [seconds] [threads]
+//											soak the whole pipeline: clone cameras replaying the file, captured by a capture engine
+//											into their circular buffers, and recorded by a muxer each, and print the throughput
+//  bench ingest <file>						also count the allocations per packet of reading the file and pushing its packets
+//											into a circular buffer by move
+//  bench mux <file> [packets]				record the packets of the file by a muxer writing in the calling thread and by one
+//											writing in its writer thread, and compare the time record() holds the caller
+//  bench capture <file> [cameras] [threads] [seconds]
+//											replay the video of the file in real time over loopback udp to many cameras,
+//											and compare the cpu and the packet latency of one capture thread per camera
+//											against the capture engine with a few I/O threads
+// Allocations are counted by the debug CRT allocation hook, which sees every CRT heap allocation of the process,
+// including those of the ffmpeg DLL sharing the same debug CRT. Run the Debug build to count them.
+
+int64_t allocations = 0; // the number of CRT heap allocations since the hook is installed
+string prefix_videofile = "C:\\Users\\georges\\Documents\\CopTraxTemp\\";
+
+// a camera of the capture benchmark, receiving the replayed video on its own udp port
+struct BenchCamera
+{
+	Demuxer* demuxer;
+	CircularBuffer* cbuf;
+	int reader; // the reader measuring the latency of the packets in the circular buffer
+	HANDLE thread; // the capture thread in the thread per camera model
+	vector<int64_t> latencies; // in microseconds, from sending the packet to reading it out of the circular buffer
+};
+
+vector<BenchCamera> cameras;
+string source_file; // the file replayed to the cameras
+int port_base = 20000; // the udp port of the first camera
+int64_t bench_start = 0; // the wall clock in microseconds the replayed pts are counted from
+volatile bool stop_sending = false;
+volatile bool stop_capturing = false;
+volatile bool stop_consuming = false;
+volatile bool measuring = false;
+
+#ifdef _DEBUG
+// count the allocations and reallocations, let the CRT go on with every request
+int count_allocation(int allocType, void* userData, size_t size, int blockType, long requestNumber,
+	const unsigned char* filename, int lineNumber)
+{
+	if (allocType == _HOOK_ALLOC || allocType == _HOOK_REALLOC)
+	{
+		allocations++;
+	}
+	return TRUE;
+}
+#endif
+
+// make a synthetic video packet of size bytes, a key frame every 30 packets at 30fps in 1/90000 time base
+void make_packet(AVPacket* pkt, int64_t n, int size)
+{
+	av_new_packet(pkt, size);
+	memset(pkt->data, static_cast<int>(n & 0xFF), size);
+	pkt->stream_index = 0;
+	pkt->pts = (n + 1) * 3000;
+	pkt->dts = pkt->pts;
+	pkt->duration = 3000;
+	pkt->flags = n % 30 ? 0 : AV_PKT_FLAG_KEY;
+}
+
+// count the allocations per packet on the hot paths: push_packet, peek_packet and Muxer::record
+// move is true to hand the packets over to the circular buffer instead of referencing them
+void bench_allocations(AVStream* st, int nb_packets, bool move)
+{
+	CircularBuffer* cbuf = new CircularBuffer();
+	cbuf->open(30, 100 * 1000 * 1000);
+	cbuf->add_stream(st);
+
+	Muxer* muxer = new Muxer();
+	muxer->set_options("format", "nut");
+	muxer->add_stream(st);
+	if (muxer->open(prefix_videofile + "bench.nut") < 0)
+	{
+		fprintf(stderr, "Cannot open the muxer: %s.\n", muxer->get_error_message().c_str());
+		delete muxer;
+		delete cbuf;
+		return;
+	}
+
+	AVPacket pkt;
+	AVPacket out;
+	av_init_packet(&out);
+	out.data = NULL;
+	out.size = 0;
+
+	int64_t push_allocations = 0;
+	int64_t peek_allocations = 0;
+	int64_t record_allocations = 0;
+	int64_t t0 = av_gettime_relative();
+	for (int64_t n = 0; n < nb_packets; n++)
+	{
+		make_packet(&pkt, n, 4096);
+
+		int64_t a = allocations;
+		cbuf->push_packet(&pkt, move);
+		av_packet_unref(&pkt);
+		push_allocations += allocations - a;
+
+		a = allocations;
+		int ret = cbuf->peek_packet(&out, false);
+		peek_allocations += allocations - a;
+
+		a = allocations;
+		if (ret > 0)
+		{
+			muxer->record(&out, 0);
+		}
+		record_allocations += allocations - a;
+	}
+	int64_t t1 = av_gettime_relative();
+	muxer->close();
+
+	fprintf(stderr, "%d packets in %lldms. Allocations per packet: push_packet%s %.3f, peek_packet %.3f, Muxer::record %.3f.\n",
+		nb_packets, (t1 - t0) / 1000, move ? " by move" : "", static_cast<double>(push_allocations) / nb_packets,
+		static_cast<double>(peek_allocations) / nb_packets, static_cast<double>(record_allocations) / nb_packets);
+
+	delete muxer;
+	delete cbuf;
+}
+
+// count the allocations per packet of reading the packets of a file and handing them over to a circular buffer
+// the circular buffer holds 1s so that its packets are evicted soon
+void bench_ingest(string filename, int nb_packets)
+{
+	Demuxer* demuxer = new Demuxer();
+	demuxer->set_options("format", "");
+	demuxer->set_options("wall_clock", "false");
+	if (demuxer->open(filename) < 0)
+	{
+		fprintf(stderr, "Cannot open %s: %s.\n", filename.c_str(), demuxer->get_error_message().c_str());
+		delete demuxer;
+		return;
+	}
+
+	CircularBuffer* cbuf = new CircularBuffer();
+	cbuf->open(1, 10 * 1000 * 1000);
+	cbuf->add_stream(demuxer->get_input_format_context());
+
+	AVPacket pkt;
+	int64_t read_allocations = 0;
+	int64_t push_allocations = 0;
+	int n = 0;
+	int64_t t0 = av_gettime_relative();
+	while (n < nb_packets)
+	{
+		int64_t a = allocations;
+		if (demuxer->read_packet(&pkt) < 0)
+		{
+			break;
+		}
+		read_allocations += allocations - a;
+		n++;
+
+		a = allocations;
+		cbuf->push_packet(&pkt, true);
+		av_packet_unref(&pkt);
+		push_allocations += allocations - a;
+	}
+	int64_t t1 = av_gettime_relative();
+
+	fprintf(stderr, "%d packets of %s in %lldms. Allocations per packet: read_packet %.3f, push_packet by move %.3f.\n",
+		n, filename.c_str(), (t1 - t0) / 1000,
+		n ? static_cast<double>(read_allocations) / n : 0.0, n ? static_cast<double>(push_allocations) / n : 0.0);
+
+	delete cbuf;
+	delete demuxer;
+}
+
+// record the packets of the file, read in advance, by a muxer in sync or async mode
+// the time record() takes is what a synchronous muxer costs the loop reading the circular buffer
+void bench_mux(string filename, bool async, int nb_packets)
+{
+	Demuxer* demuxer = new Demuxer();
+	demuxer->set_options("format", "");
+	demuxer->set_options("wall_clock", "false");
+	if (demuxer->open(filename) < 0)
+	{
+		fprintf(stderr, "Cannot open %s: %s.\n", filename.c_str(), demuxer->get_error_message().c_str());
+		delete demuxer;
+		return;
+	}
+
+	vector<AVPacket*> packets;
+	AVPacket pkt;
+	while (static_cast<int>(packets.size()) < nb_packets && demuxer->read_packet(&pkt) >= 0)
+	{
+		AVPacket* p = av_packet_alloc();
+		av_packet_move_ref(p, &pkt);
+		packets.push_back(p);
+	}
+
+	Muxer* muxer = new Muxer();
+	muxer->add_stream(demuxer->get_input_format_context());
+	muxer->set_options("async", async ? "true" : "false");
+	muxer->set_options("async_queue", to_string(packets.size()));
+	if (muxer->open(prefix_videofile + (async ? "bench-async.mp4" : "bench-sync.mp4")) < 0)
+	{
+		fprintf(stderr, "Cannot open the recording: %s.\n", muxer->get_error_message().c_str());
+	}
+	else
+	{
+		int64_t max_record = 0;
+		int64_t t0 = av_gettime_relative();
+		for (size_t i = 0; i < packets.size(); i++)
+		{
+			int64_t t = av_gettime_relative();
+			if (muxer->record(packets[i], packets[i]->stream_index) < 0)
+			{
+				fprintf(stderr, "Recording failed: %s.\n", muxer->get_error_message().c_str());
+				break;
+			}
+			max_record = max(max_record, av_gettime_relative() - t);
+		}
+		int64_t t1 = av_gettime_relative();
+		muxer->close();
+		int64_t t2 = av_gettime_relative();
+
+		fprintf(stderr, "%s muxer: %zu packets recorded in %lldms, %lldus at most, closed in %lldms. Queued up to %d, written %lldus (%lldus at most) after queued.\n",
+			async ? "Async" : "Sync", packets.size(), (t1 - t0) / 1000, max_record, (t2 - t1) / 1000,
+			muxer->get_max_queue_depth(), muxer->get_write_latency(), muxer->get_max_write_latency());
+	}
+
+	for (size_t i = 0; i < packets.size(); i++)
+	{
+		av_packet_free(&packets[i]);
+	}
+	delete muxer;
+	delete demuxer;
+}
+
+// replay the video of the source file in real time to every camera, looping at its end
+// the pts of each sent packet is the microseconds since bench_start in 1/90000, so the receiver knows when it was sent
+DWORD WINAPI videoSend(LPVOID myPtr)
+{
+	Demuxer* source = NULL;
+	vector<AVFormatContext*> outputs(cameras.size(), NULL);
+	AVPacket pkt;
+	AVPacket copy;
+	int64_t first_pts = AV_NOPTS_VALUE;
+	int64_t loop_start = av_gettime();
+	int64_t last_time = 0;
+
+	while (!stop_sending)
+	{
+		// open the source again on start and at its end
+		if (!source)
+		{
+			source = new Demuxer();
+			source->set_options("format", "");
+			source->set_options("wall_clock", "false");
+			if (source->open(source_file) < 0 || source->get_video_index() < 0)
+			{
+				fprintf(stderr, "Cannot open the source %s: %s.\n", source_file.c_str(), source->get_error_message().c_str());
+				exit(1);
+			}
+			first_pts = AV_NOPTS_VALUE;
+			loop_start += last_time;
+		}
+
+		// open the mpegts outputs to the udp ports of the cameras on the first packet
+		AVStream* st = source->get_stream(source->get_video_index());
+		for (size_t i = 0; i < outputs.size(); i++)
+		{
+			if (outputs[i])
+			{
+				continue;
+			}
+			string url = "udp://127.0.0.1:" + to_string(port_base + i) + "?pkt_size=1316";
+			avformat_alloc_output_context2(&outputs[i], NULL, "mpegts", url.c_str());
+			AVStream* ost = avformat_new_stream(outputs[i], NULL);
+			avcodec_parameters_copy(ost->codecpar, st->codecpar);
+			ost->codecpar->codec_tag = 0;
+			ost->time_base = AVRational{ 1, 90000 };
+			outputs[i]->max_delay = 0; // no mux delay added to the pts
+			avio_open(&outputs[i]->pb, url.c_str(), AVIO_FLAG_WRITE);
+			avformat_write_header(outputs[i], NULL);
+		}
+
+		if (source->read_packet(&pkt) < 0)
+		{
+			delete source;
+			source = NULL;
+			continue;
+		}
+
+		if (pkt.stream_index != source->get_video_index() || pkt.pts == AV_NOPTS_VALUE)
+		{
+			av_packet_unref(&pkt);
+			continue;
+		}
+
+		// wait for the time of the packet
+		if (first_pts == AV_NOPTS_VALUE)
+		{
+			first_pts = pkt.pts;
+		}
+		int64_t offset = av_rescale_q(pkt.pts - first_pts, st->time_base, AVRational{ 1, 1000000 });
+		last_time = offset + 33333; // the next loop starts a frame after the last packet
+		int64_t due = loop_start + offset;
+		int64_t now = av_gettime();
+		if (due > now)
+		{
+			av_usleep(static_cast<unsigned int>(due - now));
+		}
+
+		// stamp the packet with its sending time
+		pkt.pts = (av_gettime() - bench_start) * 9 / 100;
+		pkt.dts = pkt.pts;
+		pkt.duration = 0;
+		pkt.pos = -1;
+		pkt.stream_index = 0;
+		for (size_t i = 0; i < outputs.size(); i++)
+		{
+			av_packet_ref(&copy, &pkt);
+			av_write_frame(outputs[i], &copy);
+			av_packet_unref(&copy);
+		}
+		av_packet_unref(&pkt);
+	}
+
+	for (size_t i = 0; i < outputs.size(); i++)
+	{
+		if (outputs[i])
+		{
+			av_write_trailer(outputs[i]);
+			avio_closep(&outputs[i]->pb);
+			avformat_free_context(outputs[i]);
+		}
+	}
+	delete source;
+	return 0;
+}
+
+// the capture thread of one camera in the thread per camera model, blocking in reading the camera
+DWORD WINAPI videoCapture(LPVOID myPtr)
+{
+	BenchCamera* camera = static_cast<BenchCamera*>(myPtr);
+	AVPacket pkt;
+	int index_video = camera->demuxer->get_video_index();
+
+	while (!stop_capturing)
+	{
+		if (camera->demuxer->read_packet(&pkt) < 0)
+		{
+			continue;
+		}
+
+		if (pkt.stream_index == index_video)
+		{
+			camera->cbuf->push_packet(&pkt, true);
+		}
+		av_packet_unref(&pkt);
+	}
+	return 0;
+}
+
+// read the packets out of the circular buffers of up to MAXIMUM_WAIT_OBJECTS cameras and measure their latency
+DWORD WINAPI videoConsume(LPVOID myPtr)
+{
+	size_t first = reinterpret_cast<size_t>(myPtr);
+	size_t last = min(first + MAXIMUM_WAIT_OBJECTS, cameras.size());
+	HANDLE events[MAXIMUM_WAIT_OBJECTS];
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = NULL;
+	pkt.size = 0;
+
+	for (size_t i = first; i < last; i++)
+	{
+		events[i - first] = cameras[i].cbuf->get_reader_event(cameras[i].reader);
+	}
+
+	while (!stop_consuming)
+	{
+		bool ready = false;
+		for (size_t i = first; i < last; i++)
+		{
+			BenchCamera& camera = cameras[i];
+			while (camera.cbuf->read_packet(camera.reader, &pkt) > 0)
+			{
+				int64_t latency = av_gettime() - bench_start - pkt.pts * 100 / 9;
+				if (measuring)
+				{
+					camera.latencies.push_back(latency);
+				}
+				av_packet_unref(&pkt);
+			}
+
+			if (camera.cbuf->arm_reader(camera.reader) > 0)
+			{
+				ready = true;
+			}
+		}
+
+		if (!ready)
+		{
+			WaitForMultipleObjects(static_cast<DWORD>(last - first), events, FALSE, 100);
+		}
+	}
+	return 0;
+}
+
+// get the cpu time of the process in microseconds
+int64_t get_cpu_time()
+{
+	FILETIME creation, exited, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user);
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return static_cast<int64_t>(k.QuadPart + u.QuadPart) / 10;
+}
+
+// capture nb_cameras replayed cameras for seconds, by a thread per camera when nb_threads is 0,
+// otherwise by a capture engine with nb_threads I/O threads, and print the cpu and the latency
+void bench_capture(int nb_cameras, int nb_threads, int seconds)
+{
+	cameras.clear();
+	cameras.resize(nb_cameras);
+	stop_sending = false;
+	stop_capturing = false;
+	stop_consuming = false;
+	measuring = false;
+
+	// replay the source to the cameras
+	DWORD myThreadID;
+	HANDLE sender = CreateThread(0, 0, videoSend, 0, 0, &myThreadID);
+
+	for (int i = 0; i < nb_cameras; i++)
+	{
+		BenchCamera& camera = cameras[i];
+		camera.demuxer = new Demuxer();
+		camera.demuxer->set_options("format", "mpegts");
+		camera.demuxer->set_options("wall_clock", "false");
+		camera.demuxer->set_options("buffer_size", "1000000");
+		if (nb_threads)
+		{
+			camera.demuxer->set_options("nonblock", "true");
+		}
+		string url = "udp://127.0.0.1:" + to_string(port_base + i);
+		if (camera.demuxer->open(url) < 0 || camera.demuxer->get_video_index() < 0)
+		{
+			fprintf(stderr, "Cannot open camera %s: %s.\n", url.c_str(), camera.demuxer->get_error_message().c_str());
+			exit(1);
+		}
+
+		camera.cbuf = new CircularBuffer();
+		camera.cbuf->open(5, 20 * 1000 * 1000);
+		camera.cbuf->add_stream(camera.demuxer->get_stream(camera.demuxer->get_video_index()));
+		camera.reader = camera.cbuf->add_reader("bench", false);
+		camera.latencies.reserve(static_cast<size_t>(seconds) * 60);
+		camera.thread = NULL;
+	}
+
+	// capture the cameras
+	CaptureEngine* engine = NULL;
+	if (nb_threads)
+	{
+		engine = new CaptureEngine();
+		for (int i = 0; i < nb_cameras; i++)
+		{
+			engine->add_camera(cameras[i].demuxer, cameras[i].cbuf);
+		}
+		engine->open(nb_threads, 1000);
+	}
+	else
+	{
+		for (int i = 0; i < nb_cameras; i++)
+		{
+			cameras[i].thread = CreateThread(0, 0, videoCapture, &cameras[i], 0, &myThreadID);
+		}
+	}
+
+	vector<HANDLE> consumers;
+	for (size_t i = 0; i < cameras.size(); i += MAXIMUM_WAIT_OBJECTS)
+	{
+		consumers.push_back(CreateThread(0, 0, videoConsume, reinterpret_cast<LPVOID>(i), 0, &myThreadID));
+	}
+
+	// measure after a warm up
+	av_usleep(2 * 1000 * 1000);
+	int64_t cpu0 = get_cpu_time();
+	int64_t t0 = av_gettime();
+	measuring = true;
+	av_usleep(seconds * 1000 * 1000);
+	measuring = false;
+	int64_t cpu1 = get_cpu_time();
+	int64_t t1 = av_gettime();
+
+	// stop capturing while the source is still sending, so that no capture thread blocks forever
+	stop_capturing = true;
+	if (engine)
+	{
+		engine->close();
+	}
+	for (int i = 0; i < nb_cameras; i++)
+	{
+		if (cameras[i].thread)
+		{
+			WaitForSingleObject(cameras[i].thread, INFINITE);
+			CloseHandle(cameras[i].thread);
+		}
+	}
+	stop_consuming = true;
+	for (size_t i = 0; i < consumers.size(); i++)
+	{
+		WaitForSingleObject(consumers[i], INFINITE);
+		CloseHandle(consumers[i]);
+	}
+	stop_sending = true;
+	WaitForSingleObject(sender, INFINITE);
+	CloseHandle(sender);
+
+	// the latencies of all the cameras
+	vector<int64_t> latencies;
+	for (int i = 0; i < nb_cameras; i++)
+	{
+		latencies.insert(latencies.end(), cameras[i].latencies.begin(), cameras[i].latencies.end());
+	}
+	sort(latencies.begin(), latencies.end());
+	int64_t sum = 0;
+	for (size_t i = 0; i < latencies.size(); i++)
+	{
+		sum += latencies[i];
+	}
+	size_t n = latencies.size();
+
+	fprintf(stderr, "%s, %d cameras, %d capture threads: cpu %.1f%% of one core, %zd packets, latency average %.2fms, p50 %.2fms, p99 %.2fms, max %.2fms.\n",
+		engine ? "capture engine" : "thread per camera", nb_cameras, engine ? nb_threads : nb_cameras,
+		100.0 * (cpu1 - cpu0) / (t1 - t0), n,
+		n ? sum / 1000.0 / n : 0.0, n ? latencies[n / 2] / 1000.0 : 0.0,
+		n ? latencies[n * 99 / 100] / 1000.0 : 0.0, n ? latencies[n - 1] / 1000.0 : 0.0);
+	if (engine)
+	{
+		fprintf(stderr, "The capture engine slept %lld times for no packet ready.\n", engine->get_idle_polls());
+	}
+
+	delete engine;
+	for (int i = 0; i < nb_cameras; i++)
+	{
+		delete cameras[i].cbuf;
+		delete cameras[i].demuxer;
+	}
+	port_base += nb_cameras; // fresh ports for the next run
+}
+
+// a cloned camera of the replay soak, recorded by its own muxer
+struct ReplayCamera
+{
+	Demuxer* demuxer;
+	CircularBuffer* cbuf;
+	Muxer* muxer;
+	int64_t packets; // the number of packets recorded
+	int64_t bytes; // the number of bytes recorded
+};
+
+vector<ReplayCamera> replays;
+volatile bool stop_recording = false;
+
+// record the packets of all the cloned cameras from the main readers of their circular buffers
+DWORD WINAPI videoRecord(LPVOID myPtr)
+{
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = NULL;
+	pkt.size = 0;
+
+	while (!stop_recording)
+	{
+		bool idle = true;
+		for (size_t i = 0; i < replays.size(); i++)
+		{
+			ReplayCamera& camera = replays[i];
+			while (camera.cbuf->peek_packet(&pkt, false) > 0)
+			{
+				idle = false;
+				camera.packets++;
+				camera.bytes += pkt.size;
+				camera.muxer->record(&pkt, 0); // the packet is unreferenced by the muxer
+			}
+		}
+
+		if (idle)
+		{
+			av_usleep(1000);
+		}
+	}
+	return 0;
+}
+
+// replay the file by nb_cameras cloned cameras through the demuxers, the circular buffers and the muxers for seconds
+// the recordings are written to NUL, so that the pipeline is measured without the disk
+void bench_replay(string filename, int nb_cameras, string mode, int seconds, int nb_threads)
+{
+	replays.clear();
+	replays.resize(nb_cameras);
+	stop_recording = false;
+
+	CaptureEngine* engine = new CaptureEngine();
+	for (int i = 0; i < nb_cameras; i++)
+	{
+		ReplayCamera& camera = replays[i];
+		camera.demuxer = new Demuxer();
+		camera.demuxer->set_options("replay", mode);
+		camera.demuxer->set_options("nonblock", "true");
+		if (camera.demuxer->open(filename) < 0 || camera.demuxer->get_video_index() < 0)
+		{
+			fprintf(stderr, "Cannot replay %s: %s.\n", filename.c_str(), camera.demuxer->get_error_message().c_str());
+			exit(1);
+		}
+		AVStream* st = camera.demuxer->get_stream(camera.demuxer->get_video_index());
+
+		camera.cbuf = new CircularBuffer();
+		camera.cbuf->open(30, 100 * 1000 * 1000);
+		camera.cbuf->add_stream(st);
+
+		camera.muxer = new Muxer();
+		camera.muxer->set_options("format", "nut");
+		camera.muxer->add_stream(st);
+		if (camera.muxer->open("NUL") < 0)
+		{
+			fprintf(stderr, "Cannot open the muxer: %s.\n", camera.muxer->get_error_message().c_str());
+			exit(1);
+		}
+		camera.packets = 0;
+		camera.bytes = 0;
+
+		engine->add_camera(camera.demuxer, camera.cbuf);
+	}
+
+	DWORD myThreadID;
+	HANDLE recorder = CreateThread(0, 0, videoRecord, 0, 0, &myThreadID);
+	int64_t cpu0 = get_cpu_time();
+	int64_t t0 = av_gettime_relative();
+	engine->open(nb_threads, 1000);
+	av_usleep(seconds * 1000 * 1000);
+	engine->close();
+	int64_t t1 = av_gettime_relative();
+	int64_t cpu1 = get_cpu_time();
+	stop_recording = true;
+	WaitForSingleObject(recorder, INFINITE);
+	CloseHandle(recorder);
+
+	int64_t captured = 0;
+	int64_t recorded = 0;
+	int64_t bytes = 0;
+	int64_t dropped = 0;
+	for (int i = 0; i < nb_cameras; i++)
+	{
+		captured += engine->get_packets(i);
+		recorded += replays[i].packets;
+		bytes += replays[i].bytes;
+		dropped += replays[i].cbuf->get_reader_dropped(CIRCULAR_BUFFER_MAIN_READER);
+	}
+
+	double elapsed = (t1 - t0) / 1000000.0;
+	fprintf(stderr, "%s replay of %d cameras in %.1fs: %lld packets captured, %lld recorded (%.0f packets/s, %.1fMB/s), %lld dropped, cpu %.1f%% of one core.\n",
+		mode.c_str(), nb_cameras, elapsed, captured, recorded, recorded / elapsed, bytes / elapsed / 1000000, dropped,
+		100.0 * (cpu1 - cpu0) / (t1 - t0));
+
+	delete engine;
+	for (int i = 0; i < nb_cameras; i++)
+	{
+		replays[i].muxer->close();
+		delete replays[i].muxer;
+		delete replays[i].cbuf;
+		delete replays[i].demuxer;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 2 && string(argv[1]) == "replay")
+	{
+		int nb_cameras = argc > 3 ? atoi(argv[3]) : 16;
+		string mode = argc > 4 ? argv[4] : "fast";
+		int seconds = argc > 5 ? atoi(argv[5]) : 60;
+		int nb_threads = argc > 6 ? atoi(argv[6]) : 2;
+
+		timeBeginPeriod(1);
+		bench_replay(argv[2], nb_cameras, mode, seconds, nb_threads);
+		timeEndPeriod(1);
+		return 0;
+	}
+
+	if (argc > 2 && string(argv[1]) == "mux")
+	{
+		int nb_packets = argc > 3 ? atoi(argv[3]) : 10000;
+		bench_mux(argv[2], false, nb_packets);
+		bench_mux(argv[2], true, nb_packets);
+		return 0;
+	}
+
+	if (argc > 2 && string(argv[1]) == "capture")
+	{
+		source_file = argv[2];
+		int nb_cameras = argc > 3 ? atoi(argv[3]) : 50;
+		int nb_threads = argc > 4 ? atoi(argv[4]) : 2;
+		int seconds = argc > 5 ? atoi(argv[5]) : 20;
+
+		timeBeginPeriod(1); // sleep in 1ms for both the models
+		bench_start = av_gettime();
+		fprintf(stderr, "Capture %d cameras replaying %s for %ds. The latency includes one frame held by the mpegts demuxer.\n",
+			nb_cameras, source_file.c_str(), seconds);
+		bench_capture(nb_cameras, 0, seconds);
+		bench_capture(nb_cameras, nb_threads, seconds);
+		timeEndPeriod(1);
+		return 0;
+	}
+
+	// a synthetic H.264 stream of 1280x720
+	AVFormatContext* ctx = avformat_alloc_context();
+	AVStream* st = avformat_new_stream(ctx, NULL);
+	st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	st->codecpar->codec_id = AV_CODEC_ID_H264;
+	st->codecpar->width = 1280;
+	st->codecpar->height = 720;
+	st->time_base = AVRational{ 1, 90000 };
+	st->start_time = 0;
+	st->index = 0;
+
+#ifdef _DEBUG
+	_CrtSetAllocHook(count_allocation);
+#else
+	fprintf(stderr, "Allocations are counted in the Debug build only.\n");
+#endif
+
+	bench_allocations(st, 1000, false); // warm up, the first messages and pools are allocated here
+	bench_allocations(st, 100000, false);
+	bench_allocations(st, 100000, true);
+
+	// the allocations of ingesting a file, which include those inside the demuxer of FFmpeg
+	if (argc > 2 && string(argv[1]) == "ingest")
+	{
+		bench_ingest(argv[2], 100000);
+	}
+
+	avformat_free_context(ctx);
+	return 0;
+}
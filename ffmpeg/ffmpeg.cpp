@@ -7,6 +7,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <Windows.h>
+#include <thread>
+#include <mutex>
+#include <new>
 //#include <pthread.h>
 
 #include "ffmpeg.h"
@@ -36,7 +39,7 @@ namespace ffmpeg
 int take_picture(AVPacket* pkt, std::string filename)
 {
 	int err = -1;
-	if (pkt && pkt->flags | AV_PKT_FLAG_KEY && !filename.empty())
+	if (pkt && (pkt->flags & AV_PKT_FLAG_KEY) && !filename.empty())
 	{
 		FILE* jpeg_file;
 		err = fopen_s(&jpeg_file, filename.c_str(), "wb");
@@ -353,8 +356,8 @@ int AudioFifo::get_size()
 
 char* av_err(int ret)
 {
-	// buffer to store error messages
-	static char buf[256];
+	// buffer to store error messages, one for each thread
+	thread_local char buf[256];
 	if (ret < 0)
 		av_strerror(ret, buf, sizeof(buf));
 	else
@@ -363,6 +366,64 @@ char* av_err(int ret)
 	return buf;
 }
 
+ErrorMessage::ErrorMessage()
+{
+	m_literal = "";
+	m_code = 0;
+}
+
+// copy a string as the message
+ErrorMessage& ErrorMessage::operator=(const std::string& text)
+{
+	m_text = text;
+	m_literal = NULL;
+	m_code = 0;
+	return *this;
+}
+
+// copy a string as the message
+ErrorMessage& ErrorMessage::assign(const char* text)
+{
+	return *this = std::string(text);
+}
+
+// append a string to the message
+ErrorMessage& ErrorMessage::append(const std::string& text)
+{
+	return *this = str() + text;
+}
+
+// append a string to the message
+ErrorMessage& ErrorMessage::operator+=(const std::string& text)
+{
+	return append(text);
+}
+
+// keep an FFmpeg error code as the message
+// @param code		the FFmpeg error code, negative
+// @param prefix	a string literal put before the text of the error code
+void ErrorMessage::set_error(int code, const char* prefix)
+{
+	m_literal = prefix;
+	m_code = code;
+}
+
+// format the message, the error code is formatted in the buffer of the calling thread
+std::string ErrorMessage::str() const
+{
+	if (!m_literal)
+	{
+		return m_text;
+	}
+
+	return m_code ? std::string(m_literal) + av_err(m_code) : std::string(m_literal);
+}
+
+ErrorMessage::operator std::string() const
+{
+	return str();
+}
+
 const std::string get_date_time()
 {
 	time_t t = std::time(0); // get current time
@@ -374,6 +435,18 @@ const std::string get_date_time()
 	return buf;
 }
 
+// get the date time string of specified time in milliseconds since the epoch, in the format of get_date_time()
+const std::string get_date_time(int64_t time)
+{
+	time_t t = static_cast<time_t>(time / 1000);
+	char buf[50];
+	tm now;
+	localtime_s(&now, &t);
+	strftime(buf, sizeof(buf), "%F-%H%M%S", &now);
+
+	return buf;
+}
+
 AudioDecoder::AudioDecoder()
 {
 	m_err = 0;
@@ -674,15 +747,49 @@ Demuxer::Demuxer()
 	m_message = "";
 	m_err = avformat_network_init();
 	avdevice_register_all();
-	m_ifmt_Ctx = avformat_alloc_context();
+	m_ifmt_Ctx = NULL;
 	m_format = "rtsp";
 	m_start_time = 0;
 	m_wclk_align = true;
+	m_nonblock = false;
+
+	m_deadline = 0;
+	m_read_timeout = 0;
+	m_open_timeout = 0;
+	m_reconnect = false;
+	m_reconnect_timeout = 30000;
+	m_reconnects = 0;
+	m_reconnect_time = 0;
+	m_reconnect_start = 0;
+	m_reconnect_next = 0;
+	m_backoff = 0;
+	m_attempts = 0;
+	m_max_reconnect_time = 0;
+	m_last_read_time = 0;
+	m_probe_cached = false;
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_STREAMS; i++)
+	{
+		m_cache_streams[i].codecpar = NULL;
+		m_cache_streams[i].nal_length_size = -1;
+	}
+
+	m_replay = DEMUXER_REPLAY_OFF;
+	av_init_packet(&m_replay_pkt);
+	m_replay_pkt.data = NULL;
+	m_replay_pkt.size = 0;
+	m_replay_held = false;
+	m_replay_offset = 0;
+	m_replay_begin = AV_NOPTS_VALUE;
+	m_replay_end = AV_NOPTS_VALUE;
+	m_replay_start = AV_NOPTS_VALUE;
+	m_replay_first = 0;
 }
 
 Demuxer::~Demuxer()
 {
-	avformat_free_context(m_ifmt_Ctx);
+	av_packet_unref(&m_replay_pkt);
+	avformat_close_input(&m_ifmt_Ctx); // also closes the connection of an opened camera
+	av_dict_free(&m_options);
 }
 
 // get the error message of last operation
@@ -705,9 +812,10 @@ AVRational Demuxer::get_stream_time_base(int stream_index)
 	m_err = 0;
 	m_message = "";
 
-	if (stream_index >= 0 && static_cast <unsigned int>(stream_index) < m_ifmt_Ctx->nb_streams)
+	// the time bases on first open are kept through reconnects
+	if (stream_index >= 0 && static_cast <size_t>(stream_index) < m_time_bases.size())
 	{
-		return m_ifmt_Ctx->streams[stream_index]->time_base;
+		return m_time_bases[stream_index];
 	}
 
 	m_err = -1;
@@ -719,6 +827,15 @@ AVRational Demuxer::get_stream_time_base(int stream_index)
 // additional options are
 //  -format value, specify the camera format. dshow for a Webcam in windows, v4l2 for a Webcam in linux
 //  -wall_clock value, wall clock alignment. true to get pts in epoch, false to get original pts
+//  -nonblock value, true to read packets without blocking, read_packet returns AVERROR(EAGAIN) when no packet is ready
+//  -read_timeout value, the deadline of a read in milliseconds, 0 for none
+//  -open_timeout value, the deadline of opening the camera in milliseconds, 0 for none
+//  -reconnect value, true to reconnect to the camera on a failed read
+//  -reconnect_timeout value, the maximum milliseconds of one reconnect, 30000 by default
+//  -probe_cache value, the path prefix of the probe cache files, a file for every url. Empty for no probe cache.
+//   a cache is rewritten when the parameter sets in the H.264/H.265 packets differ from its extradata
+//  -replay value, realtime or fast to replay the url as a recorded file in a loop, paced to its timestamps or as fast as possible,
+//   off to read a camera. The timestamps continue through the loops, and are aligned to the wall clock like a live camera
 int Demuxer::set_options(std::string option, std::string value)
 {
 	m_err = 0;
@@ -729,6 +846,98 @@ int Demuxer::set_options(std::string option, std::string value)
 		m_format = value;
 		m_message = "update the camera format to be " + value;
 	}
+	else if (option == "nonblock")
+	{
+		if (value == "true")
+		{
+			m_nonblock = true;
+			m_message = "non-blocking read is on";
+		}
+		else if (value == "false")
+		{
+			m_nonblock = false;
+			m_message = "non-blocking read is off";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'non-blocking read' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+	else if (option == "probe_cache")
+	{
+		m_probe_cache = value;
+		m_message = "the probe cache is " + (value.empty() ? std::string("off") : value);
+		return m_err;
+	}
+	else if (option == "replay")
+	{
+		if (value == "realtime" || value == "fast")
+		{
+			m_replay = value == "realtime" ? DEMUXER_REPLAY_REALTIME : DEMUXER_REPLAY_FAST;
+			if (m_format == "rtsp")
+			{
+				m_format = ""; // the file format is probed
+			}
+			m_message = "replay is " + value;
+		}
+		else if (value == "off")
+		{
+			m_replay = DEMUXER_REPLAY_OFF;
+			m_message = "replay is off";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'replay' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+	else if (option == "reconnect")
+	{
+		if (value == "true")
+		{
+			m_reconnect = true;
+			m_message = "reconnect is on";
+		}
+		else if (value == "false")
+		{
+			m_reconnect = false;
+			m_message = "reconnect is off";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'reconnect' setting";
+			m_err = -1;
+		}
+		return m_err;
+	}
+	else if (option == "read_timeout" || option == "open_timeout" || option == "reconnect_timeout")
+	{
+		int timeout = atoi(value.c_str());
+		if (timeout < 0)
+		{
+			m_message = "'" + option + "' setting shall not be negative";
+			m_err = -1;
+			return m_err;
+		}
+
+		if (option == "read_timeout")
+		{
+			m_read_timeout = timeout;
+		}
+		else if (option == "open_timeout")
+		{
+			m_open_timeout = timeout;
+		}
+		else
+		{
+			m_reconnect_timeout = timeout;
+		}
+		m_message = "'" + option + "' is set to be " + value + "ms";
+		return m_err;
+	}
 	else if (option == "wall_clock")
 	{
 		if (value == "false")
@@ -772,8 +981,70 @@ int Demuxer::open(std::string url)
 		return m_err;
 	}
 	m_url = url;
+	m_reconnect_start = 0;
+
+	m_deadline = m_open_timeout ? av_gettime_relative() + m_open_timeout * 1000LL : 0;
+	open_input();
+	m_deadline = 0;
+	if (!m_ifmt_Ctx)
+	{
+		return m_err;
+	}
+
+	// the timestamps of the streams start without offset, and keep their time bases through reconnects
+	m_time_bases.clear();
+	m_last_dts.clear();
+	m_ts_offsets.clear();
+	m_stitch.clear();
+	for (unsigned int i = 0; i < m_ifmt_Ctx->nb_streams; i++)
+	{
+		m_time_bases.push_back(m_ifmt_Ctx->streams[i]->time_base);
+		m_last_dts.push_back(AV_NOPTS_VALUE);
+		m_ts_offsets.push_back(0);
+		m_stitch.push_back(false);
+	}
+	m_last_read_time = av_gettime_relative();
+	return m_err;
+}
+
+// open the input format context by m_url and m_options, and find the streams
+// m_ifmt_Ctx is NULL when the input cannot be opened
+// return 0 on success
+int Demuxer::open_input()
+{
+	// a fresh context for every open, interruptible by the deadline
+	avformat_close_input(&m_ifmt_Ctx);
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_STREAMS; i++)
+	{
+		m_cache_streams[i].nal_length_size = -1;
+	}
+	m_ifmt_Ctx = avformat_alloc_context();
+	if (!m_ifmt_Ctx)
+	{
+		m_err = AVERROR(ENOMEM);
+		m_message = "cannot allocate the input format context";
+		return m_err;
+	}
+	m_ifmt_Ctx->interrupt_callback.callback = interrupt;
+	m_ifmt_Ctx->interrupt_callback.opaque = this;
+	if (m_nonblock)
+	{
+		m_ifmt_Ctx->flags |= AVFMT_FLAG_NONBLOCK;
+		m_ifmt_Ctx->avio_flags |= AVIO_FLAG_NONBLOCK;
+	}
+	m_index_video = -1;
+	m_index_audio = -1;
+
+	// a replay starts over from the beginning of the file
+	av_packet_unref(&m_replay_pkt);
+	m_replay_held = false;
+	m_replay_offset = 0;
+	m_replay_begin = AV_NOPTS_VALUE;
+	m_replay_end = AV_NOPTS_VALUE;
+	m_replay_start = AV_NOPTS_VALUE;
 
 	// to determine the camera type
+	std::string url = m_url;
 	m_message = "IP Camera: ";
 	AVInputFormat* ifmt = NULL;
 	if (url.find("/dev/") != std::string::npos)
@@ -787,7 +1058,11 @@ int Demuxer::open(std::string url)
 		m_message = m_format + ": "; // "USB (Windows)";
 	}
 
-	m_err = avformat_open_input(&m_ifmt_Ctx, m_url.c_str(), ifmt, &m_options);
+	// the options are kept for reconnecting
+	AVDictionary* options = NULL;
+	av_dict_copy(&options, m_options, 0);
+	m_err = avformat_open_input(&m_ifmt_Ctx, m_url.c_str(), ifmt, &options);
+	av_dict_free(&options);
 	if (m_err < 0)
 	{
 		m_message.append(av_err(m_err));
@@ -795,44 +1070,52 @@ int Demuxer::open(std::string url)
 	}
 	m_start_time = av_gettime();  // hold global start time in microseconds
 
-	m_err = avformat_find_stream_info(m_ifmt_Ctx, 0);
-	if (m_err < 0)
+	// skip probing when the streams opened match the probe cache of the url
+	m_probe_cached = !m_probe_cache.empty() && load_probe_cache() == 0;
+	if (!m_probe_cached)
 	{
-		m_message.append(av_err(m_err));
-		return m_err;
+		int64_t probe_start = av_gettime_relative();
+		m_err = avformat_find_stream_info(m_ifmt_Ctx, 0);
+		if (m_err < 0)
+		{
+			m_message.append(av_err(m_err));
+			avformat_close_input(&m_ifmt_Ctx);
+			return m_err;
+		}
+
+		if (!m_probe_cache.empty())
+		{
+			save_probe_cache(av_gettime_relative() - probe_start);
+		}
 	}
 
 	m_err = 0;
-	m_message += " connected";
+	m_message += m_probe_cached ? " connected without probing" : " connected";
+
+	// the parameter sets in the packets of the cached streams are checked against the cached extradata
+	for (unsigned int i = 0; m_probe_cached && i < m_ifmt_Ctx->nb_streams && i < CIRCULAR_BUFFER_MAX_STREAMS; i++)
+	{
+		CircularBuffer::init_nal_stream(&m_cache_streams[i], m_ifmt_Ctx->streams[i]->codecpar);
+	}
 
 	// find the index of video stream
 	AVStream* st;
+	m_align_pending.assign(m_ifmt_Ctx->nb_streams, false);
 	for (int i = 0; static_cast <unsigned int>(i) < m_ifmt_Ctx->nb_streams; i++)
 	{
 		st = m_ifmt_Ctx->streams[i];
 
 		// modify the start time when required aligning to wall clock
+		// without probing the start time is unknown until the first packet of the stream
 		if (m_wclk_align)
 		{
-			// calculate the correct time stamp for a very large epoch time
-			int64_t den = st->time_base.den;
-			int64_t num = st->time_base.num;
-			num *= 1000000;
-
-			int64_t gcd = av_const av_gcd(den, num);
-			if (gcd)
+			if (st->start_time == AV_NOPTS_VALUE)
 			{
-				den /= gcd;
-				num /= gcd;
-			}
-
-			if (num > den)
-			{
-				st->start_time = m_start_time * den / num - st->start_time;
+				m_align_pending[i] = true;
 			}
 			else
 			{
-				st->start_time = m_start_time / num * den - st->start_time;
+				align_stream(st);
 			}
 		}
 
@@ -860,921 +1143,5731 @@ int Demuxer::open(std::string url)
 	return m_err;
 }
 
-// read a packet from the camera
-// return 0 on success
-int Demuxer::read_packet(AVPacket* pkt)
+// modify the start time of the stream to align its timestamps to the wall clock of opening the camera
+// @param st	the stream, whose start time is the pts of its first packet
+void Demuxer::align_stream(AVStream* st)
 {
-	m_message = "";
-	m_err = av_read_frame(m_ifmt_Ctx, pkt); // read a frame from the camera
+	// calculate the correct time stamp for a very large epoch time
+	int64_t den = st->time_base.den;
+	int64_t num = st->time_base.num;
+	num *= 1000000;
 
-	// handle the timeout
-	if (m_err < 0)
+	int64_t gcd = av_const av_gcd(den, num);
+	if (gcd)
 	{
-		m_message.assign(av_err(m_err));
-		m_message = "Time out while reading " + m_url + " with error " + m_message;
-		pkt = NULL;
-		return m_err;
+		den /= gcd;
+		num /= gcd;
 	}
 
-	if (!m_wclk_align)
+	if (num > den)
 	{
-		return m_err;
+		st->start_time = m_start_time * den / num - st->start_time;
 	}
-
-	// Doing wall clock alignment
-	if (pkt->pts == AV_NOPTS_VALUE)
+	else
 	{
-		m_err = -1;
-		m_message = "no wall clock alignment for packet without pts value";
-		return m_err;
+		st->start_time = m_start_time / num * den - st->start_time;
 	}
+}
 
-	// make pts and pds wall clock aligned
-	AVStream* st = m_ifmt_Ctx->streams[pkt->stream_index];
-	pkt->pts += st->start_time;
-	pkt->dts += st->start_time;
-	if (!pkt->duration)
+// get the probe cache file of the url, named by the hash of the url after the probe cache prefix
+std::string Demuxer::get_probe_cache_file()
+{
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a
+	for (size_t i = 0; i < m_url.size(); i++)
 	{
-		pkt->duration = st->duration; // assign duration to be the default duration
+		hash ^= static_cast<unsigned char>(m_url[i]);
+		hash *= 1099511628211ULL;
 	}
 
-	return m_err;
-};
-
-// get the video stream index of the camera
-// negative return indicates no video stream in the camera
-int Demuxer::get_video_index()
-{
-	return m_index_video;
-}
-
-// get the audio stream index of the camera
-// negative return indicates no audio stream in the camera
-int Demuxer::get_audio_index()
-{
-	return m_index_audio;
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.probe", static_cast<unsigned long long>(hash));
+	return m_probe_cache + name;
 }
 
-// get the specified stream
-// index can be video index or audio index
-AVStream* Demuxer::get_stream(int stream_index)
+// apply the probe cache of the url to the streams just opened
+// the cache is valid when the streams found on opening, for example by the sdp of rtsp, agree with it on
+// the number of streams, their types, codecs, time bases, and the sizes and extradata known already.
+// the parameters only known by probing, like the video size and the extradata not in the sdp, are filled from the cache
+// @return	0 on success, negative when there is no valid cache
+int Demuxer::load_probe_cache()
 {
-	if (stream_index < 0 || static_cast <unsigned int>(stream_index) >= m_ifmt_Ctx->nb_streams)
+	FILE* file;
+	if (fopen_s(&file, get_probe_cache_file().c_str(), "rb"))
 	{
-		m_err = -1;
-		m_message = "In valid stream index specified";
-		return NULL;
+		return -1;
 	}
 
-	m_err = 0;
-	m_message = "get the stream";
-	return m_ifmt_Ctx->streams[stream_index];
-}
+	// read the whole cache, which is small
+	std::vector<uint8_t> cache;
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+	{
+		cache.insert(cache.end(), buf, buf + n);
+	}
+	fclose(file);
 
-CircularBuffer::CircularBuffer()
-{
-	first_pkt = NULL;
-	last_pkt = NULL;
-	bg_pkt = NULL;
-	mn_pkt = NULL;
+	ProbeCacheHeader* header = reinterpret_cast<ProbeCacheHeader*>(cache.data());
+	if (cache.size() < sizeof(ProbeCacheHeader) || memcmp(header->magic, "PRBCACHE", 8) || header->version != DEMUXER_PROBE_CACHE_VERSION
+		|| header->nb_streams != static_cast<int32_t>(m_ifmt_Ctx->nb_streams)
+		|| cache.size() < sizeof(ProbeCacheHeader) + header->nb_streams * sizeof(ProbeCacheStream))
+	{
+		return -2;
+	}
 
-	m_total_packets = 0;
-	m_size = 0;
-	m_time_span = 0;
-	m_MaxSize = 0;
-	m_codecpar = avcodec_parameters_alloc(); //must be allocated with avcodec_parameters_alloc() and freed with avcodec_parameters_free().
-	m_st = (AVStream*)av_mallocz(sizeof(AVStream));
-	m_pts_span = 0;
-	m_stream_index = 0;
-	m_time_base = AVRational{ 1, 2 };
+	// validate all the streams before changing any
+	ProbeCacheStream* streams = reinterpret_cast<ProbeCacheStream*>(cache.data() + sizeof(ProbeCacheHeader));
+	for (int i = 0; i < header->nb_streams; i++)
+	{
+		AVStream* st = m_ifmt_Ctx->streams[i];
+		AVCodecParameters* par = st->codecpar;
+		MappedRingStream* mrs = &streams[i].stream;
+		if (mrs->extradata_offset < 0 || mrs->extradata_size < 0 || static_cast<size_t>(mrs->extradata_offset) + mrs->extradata_size > cache.size()
+			|| mrs->codec_type != par->codec_type || mrs->codec_id != par->codec_id
+			|| mrs->time_base_num != st->time_base.num || mrs->time_base_den != st->time_base.den
+			|| (par->width && mrs->width != par->width) || (par->height && mrs->height != par->height)
+			|| (par->sample_rate && mrs->sample_rate != par->sample_rate)
+			|| (par->extradata_size > 0 && (mrs->extradata_size != par->extradata_size
+				|| memcmp(par->extradata, cache.data() + mrs->extradata_offset, par->extradata_size))))
+		{
+			return -3;
+		}
+	}
 
-	m_err = 0;
-	m_message = "";
-	m_last_pts = 0;
+	// allocate the extradata to be filled before changing any stream, so that the streams are changed all or none
+	std::vector<uint8_t*> extradata(header->nb_streams, NULL);
+	for (int i = 0; i < header->nb_streams; i++)
+	{
+		MappedRingStream* mrs = &streams[i].stream;
+		if (m_ifmt_Ctx->streams[i]->codecpar->extradata_size <= 0 && mrs->extradata_size > 0)
+		{
+			extradata[i] = (uint8_t*)av_mallocz(mrs->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+			if (!extradata[i])
+			{
+				for (int j = 0; j < i; j++)
+				{
+					av_freep(&extradata[j]);
+				}
+				return AVERROR(ENOMEM);
+			}
+			memcpy(extradata[i], cache.data() + mrs->extradata_offset, mrs->extradata_size);
+		}
+	}
 
-	flag_writing = false;
-	flag_reading = false;
+	for (int i = 0; i < header->nb_streams; i++)
+	{
+		AVStream* st = m_ifmt_Ctx->streams[i];
+		AVCodecParameters* par = st->codecpar;
+		ProbeCacheStream* pcs = &streams[i];
+		MappedRingStream* mrs = &pcs->stream;
+		par->format = mrs->format;
+		par->width = mrs->width;
+		par->height = mrs->height;
+		par->sample_rate = mrs->sample_rate;
+		par->channels = mrs->channels;
+		par->channel_layout = mrs->channel_layout;
+		par->bit_rate = mrs->bit_rate;
+		par->profile = mrs->profile;
+		par->level = mrs->level;
+		par->codec_tag = pcs->codec_tag;
+		par->sample_aspect_ratio = AVRational{ pcs->sample_aspect_ratio_num, pcs->sample_aspect_ratio_den };
+		st->sample_aspect_ratio = par->sample_aspect_ratio;
+		st->avg_frame_rate = AVRational{ pcs->avg_frame_rate_num, pcs->avg_frame_rate_den };
+		st->r_frame_rate = AVRational{ pcs->r_frame_rate_num, pcs->r_frame_rate_den };
+		if (extradata[i])
+		{
+			av_freep(&par->extradata);
+			par->extradata = extradata[i];
+			par->extradata_size = mrs->extradata_size;
+		}
+	}
 
-	m_codecpar = avcodec_parameters_alloc(); //must be allocated with avcodec_parameters_alloc() and freed with avcodec_parameters_free().
+	return 0;
 }
 
-void CircularBuffer::open(int time_span, int max_size)
+// save the probed streams into the probe cache of the url
+// @param probe_time	the microseconds the probing took
+// @return				0 on success, negative for error code
+int Demuxer::save_probe_cache(int64_t probe_time)
 {
-	first_pkt = NULL;
-	last_pkt = NULL;
-	bg_pkt = NULL;
-	mn_pkt = NULL;
-
-	//
-	m_total_packets = 0;
-	m_size = 0;
-	m_pts_span = 0;
-	m_time_span = time_span > 0 ? time_span : 0;
-	m_MaxSize = max_size > 0 ? max_size : 0;
-	m_stream_index = 0;
-	m_time_base = AVRational{ 1, 2 };
-
-	m_err = 0;
-	m_message = "";
-
-	flag_writing = false;
-	flag_reading = false;
-}
+	if (m_ifmt_Ctx->nb_streams > CIRCULAR_BUFFER_MAX_STREAMS)
+	{
+		return -1;
+	}
 
-CircularBuffer::~CircularBuffer()
-{
-	while (first_pkt)
+	ProbeCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "PRBCACHE", 8);
+	header.version = DEMUXER_PROBE_CACHE_VERSION;
+	header.nb_streams = m_ifmt_Ctx->nb_streams;
+	header.probe_time = probe_time;
+
+	// the extradata follows the streams
+	ProbeCacheStream streams[CIRCULAR_BUFFER_MAX_STREAMS];
+	memset(streams, 0, sizeof(streams));
+	int32_t offset = static_cast<int32_t>(sizeof(header) + header.nb_streams * sizeof(ProbeCacheStream));
+	for (int i = 0; i < header.nb_streams; i++)
 	{
-		AVPacketList* pktl = first_pkt;
-		av_packet_unref(&pktl->pkt);
-		first_pkt = pktl->next;
-		av_free(pktl);
+		AVStream* st = m_ifmt_Ctx->streams[i];
+		AVCodecParameters* par = st->codecpar;
+		ProbeCacheStream* pcs = &streams[i];
+		MappedRingStream* mrs = &pcs->stream;
+		mrs->index = st->index;
+		mrs->codec_type = par->codec_type;
+		mrs->codec_id = par->codec_id;
+		mrs->format = par->format;
+		mrs->time_base_num = st->time_base.num;
+		mrs->time_base_den = st->time_base.den;
+		mrs->width = par->width;
+		mrs->height = par->height;
+		mrs->sample_rate = par->sample_rate;
+		mrs->channels = par->channels;
+		mrs->channel_layout = par->channel_layout;
+		mrs->bit_rate = par->bit_rate;
+		mrs->profile = par->profile;
+		mrs->level = par->level;
+		mrs->extradata_offset = offset;
+		mrs->extradata_size = par->extradata_size > 0 ? par->extradata_size : 0;
+		offset += mrs->extradata_size;
+		pcs->avg_frame_rate_num = st->avg_frame_rate.num;
+		pcs->avg_frame_rate_den = st->avg_frame_rate.den;
+		pcs->r_frame_rate_num = st->r_frame_rate.num;
+		pcs->r_frame_rate_den = st->r_frame_rate.den;
+		pcs->sample_aspect_ratio_num = par->sample_aspect_ratio.num;
+		pcs->sample_aspect_ratio_den = par->sample_aspect_ratio.den;
+		pcs->codec_tag = par->codec_tag;
 	}
 
-	avcodec_parameters_free(&m_codecpar);
+	FILE* file;
+	if (fopen_s(&file, get_probe_cache_file().c_str(), "wb"))
+	{
+		return -2;
+	}
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(streams, sizeof(ProbeCacheStream), header.nb_streams, file);
+	for (int i = 0; i < header.nb_streams; i++)
+	{
+		if (streams[i].stream.extradata_size)
+		{
+			fwrite(m_ifmt_Ctx->streams[i]->codecpar->extradata, 1, streams[i].stream.extradata_size, file);
+		}
+	}
+	fclose(file);
+	return 0;
 }
 
-// set the stream info
-// stream id is to indentify the stream index when push packet
-// stream time base is used to calculate the time span
-// stream codec parameters are also saved for furture usage
-int CircularBuffer::add_stream(AVStream* stream)
+// check the parameter sets of a packet against the probe cache
+// the first parameter sets of a stream in its packets confirm the cache. When they differ from the cached extradata,
+// as for a camera changing its parameter sets without sending new extradata, the stream takes them as its extradata
+// and the cache is rewritten with them, or removed when they cannot be taken so that the next open probes again.
+// @param pkt	the packet read
+void Demuxer::check_probe_cache(AVPacket* pkt)
 {
-	// check the stream
-	if (!stream)
+	if (pkt->stream_index < 0 || pkt->stream_index >= CIRCULAR_BUFFER_MAX_STREAMS || m_cache_streams[pkt->stream_index].nal_length_size < 0)
 	{
-		m_err = -1;
-		m_message = "Empty stream is not allowed.";
-		return m_err;
+		return;
 	}
 
-	// copy the codec parameters to local
-	m_err = avcodec_parameters_copy(m_codecpar, stream->codecpar);
-	if (m_err < 0)
+	CircularBufferStream* stream = &m_cache_streams[pkt->stream_index];
+	int tags = CircularBuffer::inspect_packet(pkt, stream);
+	if (!(tags & CIRCULAR_BUFFER_FLAG_PARAM_SETS))
 	{
-		m_message.assign(av_err(m_err));
-		return m_err;
+		return;
 	}
 
-	// copy a couple of important parameters to local stream
-	m_st->codecpar = m_codecpar; // store the same codec parameters in the local stream
-	m_st->time_base = stream->time_base;
-	m_st->start_time = stream->start_time;
-	m_st->r_frame_rate = stream->r_frame_rate;
-	m_st->avg_frame_rate = stream->avg_frame_rate;
-	m_st->sample_aspect_ratio = stream->sample_aspect_ratio;
-
-	m_time_base = stream->time_base;
-	m_stream_index = stream->index;
-	m_pts_span = m_time_span * m_time_base.den / m_time_base.num;
+	if (!(tags & CIRCULAR_BUFFER_FLAG_PARAM_CHANGE))
+	{
+		stream->nal_length_size = -1; // the cache is confirmed
+		return;
+	}
 
-	// clear the circular buffer in case the stream is changed
-	while (first_pkt)
+	std::vector<uint8_t> sets;
+	uint8_t* extradata = NULL;
+	if (CircularBuffer::get_parameter_sets(pkt, stream, sets) > 0)
 	{
-		AVPacketList* pktl = first_pkt;
-		av_packet_unref(&pktl->pkt);
-		first_pkt = pktl->next;
-		av_free(pktl);
+		extradata = (uint8_t*)av_mallocz(sets.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+	}
+	stream->nal_length_size = -1;
+	m_probe_cached = false;
+	if (!extradata)
+	{
+		remove(get_probe_cache_file().c_str());
+		return;
 	}
 
-	m_err = 0;
-	m_message = "";
-	return m_err;
-};
+	AVCodecParameters* par = stream->codecpar;
+	memcpy(extradata, sets.data(), sets.size());
+	av_freep(&par->extradata);
+	par->extradata = extradata;
+	par->extradata_size = static_cast<int>(sets.size());
+	if (save_probe_cache(0) < 0)
+	{
+		remove(get_probe_cache_file().c_str());
+	}
+}
 
-// push a video or audio packet to the circular buffer
-// 0 or positive return indicates the packet is added successfully. The number returned is the number of packets disposed from the circular buffer.
-// negative return indicates no packet is added due to an error. 
-int CircularBuffer::push_packet(AVPacket* pkt)
+// get whether the last open or reconnect skipped probing by the probe cache
+bool Demuxer::get_probe_cached()
 {
-	// empty packet is not allowed in the circular buffer
-	if (!pkt)
+	return m_probe_cached;
+}
+
+// read a frame from the input
+// in replay, the file starts over at its end, with the timestamps continuing a span of the file later,
+// and in realtime replay a packet is read at its time since the first one. A non-blocking read holds the packet
+// until its time and returns AVERROR(EAGAIN) before, otherwise the read sleeps until then.
+// @param pkt	the packet read
+// @return		0 on success, negative for error code
+int Demuxer::read_frame(AVPacket* pkt)
+{
+	if (m_replay == DEMUXER_REPLAY_OFF)
 	{
-		m_err = -1;
-		m_message = "packet unacceptable: empty";
-		return -1; // return number directly for multithread safe pupose, m_err is not safe
+		return av_read_frame(m_ifmt_Ctx, pkt);
 	}
 
-	// packet with different stream index is not accepted
-	if (pkt->stream_index != m_stream_index)
+	if (!m_replay_held)
 	{
-		m_err = -2;
-		m_message = "packet unacceptable: stream index is different";
-		return -2; // return number directly for multithread safe pupose, m_err is not safe
+		int ret = av_read_frame(m_ifmt_Ctx, &m_replay_pkt);
+		if (ret == AVERROR_EOF && m_replay_end != AV_NOPTS_VALUE)
+		{
+			m_replay_offset += m_replay_end - m_replay_begin;
+			ret = av_seek_frame(m_ifmt_Ctx, -1, m_ifmt_Ctx->start_time != AV_NOPTS_VALUE ? m_ifmt_Ctx->start_time : 0, AVSEEK_FLAG_BACKWARD);
+			if (ret >= 0)
+			{
+				ret = av_read_frame(m_ifmt_Ctx, &m_replay_pkt);
+			}
+		}
+		if (ret < 0)
+		{
+			return ret;
+		}
+
+		// the span of the file counts the packets of all the streams in the first loop
+		AVStream* st = m_ifmt_Ctx->streams[m_replay_pkt.stream_index];
+		int64_t ts = m_replay_pkt.dts != AV_NOPTS_VALUE ? m_replay_pkt.dts : m_replay_pkt.pts;
+		if (ts != AV_NOPTS_VALUE)
+		{
+			int64_t t = av_rescale_q(ts, st->time_base, AVRational{ 1, 1000000 });
+			int64_t end = t + av_rescale_q(m_replay_pkt.duration ? m_replay_pkt.duration : st->duration, st->time_base, AVRational{ 1, 1000000 });
+			if (!m_replay_offset)
+			{
+				m_replay_begin = m_replay_begin == AV_NOPTS_VALUE || t < m_replay_begin ? t : m_replay_begin;
+				m_replay_end = m_replay_end == AV_NOPTS_VALUE || end > m_replay_end ? end : m_replay_end;
+			}
+		}
+
+		// the timestamps of later loops continue after the earlier ones
+		if (m_replay_offset)
+		{
+			int64_t offset = av_rescale_q(m_replay_offset, AVRational{ 1, 1000000 }, st->time_base);
+			m_replay_pkt.pts += m_replay_pkt.pts != AV_NOPTS_VALUE ? offset : 0;
+			m_replay_pkt.dts += m_replay_pkt.dts != AV_NOPTS_VALUE ? offset : 0;
+		}
+		m_replay_held = true;
 	}
 
-	// packet that cannot be reference is not allowed
-	if (av_packet_make_refcounted(pkt) < 0)
+	// pace the packet to its time since the first packet
+	int64_t ts = m_replay_pkt.dts != AV_NOPTS_VALUE ? m_replay_pkt.dts : m_replay_pkt.pts;
+	if (m_replay == DEMUXER_REPLAY_REALTIME && ts != AV_NOPTS_VALUE)
 	{
-		m_err = -3;
-		m_message = "packet unacceptable: cannot be referenced";
-		return -3;  // return number directly for multithread safe pupose, m_err is not safe
+		int64_t t = av_rescale_q(ts, m_ifmt_Ctx->streams[m_replay_pkt.stream_index]->time_base, AVRational{ 1, 1000000 });
+		int64_t now = av_gettime_relative();
+		if (m_replay_start == AV_NOPTS_VALUE)
+		{
+			m_replay_start = now;
+			m_replay_first = t;
+		}
+
+		int64_t due = m_replay_start + t - m_replay_first;
+		if (due > now)
+		{
+			if (m_nonblock)
+			{
+				return AVERROR(EAGAIN);
+			}
+			av_usleep(static_cast<unsigned int>(due - now));
+		}
 	}
 
-	// packet that has no pts is not allowed
-	if (pkt->pts == AV_NOPTS_VALUE)
+	av_packet_move_ref(pkt, &m_replay_pkt);
+	m_replay_held = false;
+	return 0;
+}
+
+// read a packet from the camera
+// a failed read, including one past the read timeout, reconnects to the camera and reads again when the "reconnect" option is on
+// the timestamps are in the time bases of the streams on first open, and continue after reconnects
+// return 0 on success, AVERROR(EAGAIN) when no packet is ready for a non-blocking read
+int Demuxer::read_packet(AVPacket* pkt)
+{
+	m_message = "";
+	if (!m_ifmt_Ctx || m_reconnect_start)
 	{
-		m_err = -4;
-		m_message = "packet unacceptable: has no valid pts";
-		return -4;  // return number directly for multithread safe pupose, m_err is not safe
+		m_err = m_reconnect ? reconnect() : -1;
+		if (m_err == AVERROR(EAGAIN))
+		{
+			m_message = "Reconnecting to the camera";
+			return m_err;
+		}
+		if (m_err < 0)
+		{
+			m_message = "the camera is not open";
+			return m_err;
+		}
 	}
 
-	// new a packet list, which is going to be freed when getting staled later
-	AVPacketList* pktl = (AVPacketList*)av_mallocz(sizeof(AVPacketList));
-	if (!pktl)
+	m_deadline.store(m_read_timeout ? av_gettime_relative() + m_read_timeout * 1000LL : 0, std::memory_order_relaxed);
+	m_err = read_frame(pkt); // read a frame from the camera
+	if (m_err < 0 && m_err != AVERROR(EAGAIN) && m_reconnect)
 	{
-		//av_packet_unref(pkt);
-		av_free(pktl);
-		m_err = -5;
-		m_message = "cannot allocate new packet list";
-		return m_err;
+		int err = m_err;
+		if (reconnect() < 0)
+		{
+			if (m_err == AVERROR(EAGAIN))
+			{
+				m_message = "Reconnecting to the camera";
+			}
+			return m_err;
+		}
+
+		m_deadline.store(m_read_timeout ? av_gettime_relative() + m_read_timeout * 1000LL : 0, std::memory_order_relaxed);
+		m_err = read_frame(pkt);
+		if (m_err < 0 && m_err != AVERROR(EAGAIN))
+		{
+			m_message.set_error(err, "Reconnected after the read error ");
+		}
 	}
+	m_deadline.store(0, std::memory_order_relaxed);
 
-	// packet that is non monotonically increasing
-	if (m_last_pts == 0)
+	// no packet is ready for a non-blocking read
+	if (m_err == AVERROR(EAGAIN))
 	{
-		m_last_pts = pkt->pts;
+		m_message = "No packet is ready";
+		return m_err;
 	}
 
-	if (pkt->pts < m_last_pts)
+	// handle the timeout
+	if (m_err < 0)
 	{
-		m_err = -6;
-		m_message = "packet unacceptable: non monotonically increasing";
-		return -6; // return number directly for multithread safe pupose, m_err is not safe
+		m_message.set_error(m_err, "Time out while reading the camera with error ");
+		pkt = NULL;
+		return m_err;
 	}
+	m_last_read_time = av_gettime_relative();
 
-	// add the packet to the queue
-	//av_packet_move_ref(&pktl->pkt, pkt);  // this makes the pkt unref
-	av_packet_ref(&pktl->pkt, pkt);  // leave the pkt alone
-	pktl->next = NULL;
-
-	// set the writing flag to block unsafe reading in other process
-	flag_writing = true;
-
-	// modify the pointers
-	if (!last_pkt)
-		first_pkt = pktl; // handle the first adding
-	else
-		last_pkt->next = pktl;
-	last_pkt = pktl; // the new added packet is always the last packet in the circular buffer
-
-	m_total_packets++;
-	m_size += pktl->pkt.size + sizeof(*pktl);
+	AVStream* st = m_ifmt_Ctx->streams[pkt->stream_index];
 
-	// make sure it is multithread safe before modifing any critical variables
-	if (flag_reading)
+	// the probe cache is outdated when the stream parameters change, the next open probes again
+	if (m_probe_cached && av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, NULL))
 	{
-		//m_message = "Warning: not modify the pointer for others are reading";  // it is unsafe to modify m_message now
-		flag_writing = false; // clear the writing flag at the very end
-		return 0; // return number directly for multithread safe pupose, m_err is not safe
+		m_probe_cached = false;
+		remove(get_probe_cache_file().c_str());
 	}
-
-	// update the background reader when a new packet is added
-	if (!bg_pkt)
+	else if (m_probe_cached)
 	{
-		bg_pkt = last_pkt;
+		check_probe_cache(pkt);
 	}
 
-	// update the main reader when a new packet is added
-	if (!mn_pkt)
+	if (m_wclk_align)
 	{
-		mn_pkt = last_pkt;
+		// the stream opened without probing is aligned on its first packet
+		if (static_cast<size_t>(pkt->stream_index) < m_align_pending.size() && m_align_pending[pkt->stream_index]
+			&& pkt->pts != AV_NOPTS_VALUE)
+		{
+			m_align_pending[pkt->stream_index] = false;
+			st->start_time = pkt->pts;
+			align_stream(st);
+		}
+
+		// Doing wall clock alignment
+		if (pkt->pts == AV_NOPTS_VALUE)
+		{
+			m_err = -1;
+			m_message = "no wall clock alignment for packet without pts value";
+			return m_err;
+		}
+
+		// make pts and pds wall clock aligned
+		pkt->pts += st->start_time;
+		pkt->dts += st->start_time;
+		if (!pkt->duration)
+		{
+			pkt->duration = st->duration; // assign duration to be the default duration
+		}
 	}
 
-	// maintain the circular buffer by kicking out those overflowed packets
-	int64_t pts_bg = bg_pkt->pkt.pts;
-	int64_t pts_mn = mn_pkt->pkt.pts;
-	int64_t allowed_pts = last_pkt->pkt.pts - m_pts_span;
-	m_err = m_total_packets; // used to store original number of packets
-	while ((first_pkt->pkt.pts < allowed_pts) || (m_size > m_MaxSize))
+	// stitch the timestamps continuously across reconnects
+	size_t i = static_cast<size_t>(pkt->stream_index);
+	if (i >= m_time_bases.size() || pkt->dts == AV_NOPTS_VALUE)
 	{
-		pktl = first_pkt;
-		m_total_packets--; // update the number of total packets
-		m_size -= first_pkt->pkt.size + sizeof(*first_pkt);  // update the size of the circular buffer
+		return m_err;
+	}
 
-		av_packet_unref(&first_pkt->pkt); // unref the first packet
-		first_pkt = first_pkt->next; // update the first packet list
-		av_freep(&pktl);  // free the unsed packet list
+	// a stream opened again with another time base is rescaled to the time base on first open
+	AVRational tb = m_time_bases[i];
+	if (av_cmp_q(st->time_base, tb))
+	{
+		av_packet_rescale_ts(pkt, st->time_base, tb);
 	}
 
-	// update the background reader in case it is behind the first packet
-	if (pts_bg < first_pkt->pkt.pts)
+	// the first packet after a reconnect continues from the last one, the gap is kept unless it is aligned to the wall clock already
+	if (m_stitch[i])
 	{
-		bg_pkt = first_pkt;
+		m_stitch[i] = false;
+		m_ts_offsets[i] = 0;
+		if (m_last_dts[i] != AV_NOPTS_VALUE)
+		{
+			int64_t next = m_last_dts[i] + 1;
+			if (!m_wclk_align)
+			{
+				int64_t gap = av_rescale_q(m_reconnect_time, AVRational{ 1, 1000000 }, tb);
+				next = m_last_dts[i] + FFMAX(gap, FFMAX(pkt->duration, 1));
+			}
+			if (!m_wclk_align || pkt->dts < next)
+			{
+				m_ts_offsets[i] = next - pkt->dts;
+			}
+		}
 	}
 
-	// update the mn reader in case it is behind the first packet changed
-	if (pts_mn < first_pkt->pkt.pts)
+	if (m_ts_offsets[i])
 	{
-		mn_pkt = first_pkt;
+		pkt->dts += m_ts_offsets[i];
+		if (pkt->pts != AV_NOPTS_VALUE)
+		{
+			pkt->pts += m_ts_offsets[i];
+		}
 	}
+	m_last_dts[i] = pkt->dts;
 
-	m_err -= m_total_packets; // calculate how many packets are disposed
-	m_message = "Packet added";
-	flag_writing = false; // clear the writting flag at the very end of pushing
 	return m_err;
-}
+};
 
-// read a packet out of the circular buffer.
-// read a packet using the background reader when isBackground is true
-// read a packet using the main reader when isBackground is false
-// return (0 or 1) indicates the number of packet is read. 
-int CircularBuffer::peek_packet(AVPacket* pkt, bool isBackground)
+// close the camera and open it again
+// the attempts are apart by a backoff doubled from DEMUXER_BACKOFF_MIN to DEMUXER_BACKOFF_MAX milliseconds,
+// randomized by +/-50% so that many cameras dropped together do not reconnect together.
+// an attempt is interrupted at the open timeout, and all of them at the reconnect timeout
+// a camera opened with the "nonblock" option makes at most one attempt per call, and returns AVERROR(EAGAIN)
+// while the reconnect goes on, so that a dead camera does not hold up the thread reading it.
+// return 0 on success, AVERROR(EAGAIN) for a reconnect going on, negative for error code
+int Demuxer::reconnect()
 {
-	// no reading while others are reading or writing to keep multithread operations safe
-	if (flag_writing || flag_reading)
+	while (true)
 	{
-		pkt = NULL;
-		return 0;
+		m_err = reconnect_attempt();
+		if (m_err != AVERROR(EAGAIN) || m_nonblock)
+		{
+			return m_err;
+		}
+
+		int64_t delay = m_reconnect_next - av_gettime_relative();
+		if (delay > 0)
+		{
+			av_usleep(static_cast<unsigned int>(delay));
+		}
 	}
+}
 
-	flag_reading = true; // set the reading flag to stop the modify of packet list
+// make a reconnect attempt once its backoff has expired
+// return 0 on success, AVERROR(EAGAIN) for the backoff not expired or another attempt to come, negative for error code
+int Demuxer::reconnect_attempt()
+{
+	if (m_url.empty())
+	{
+		m_err = -1;
+		m_message = "Error. Camera path is empty";
+		return m_err;
+	}
 
-	if (isBackground && bg_pkt)
+	// the first attempt of a reconnect closes the camera, and is made at once
+	int64_t now = av_gettime_relative();
+	if (!m_reconnect_start)
 	{
-		av_packet_ref(pkt, &bg_pkt->pkt); // expose to the outside a copy of the packet
-		bg_pkt = bg_pkt->next; // update the reader packet
-		flag_reading = false;
-		m_err = 1;
-		m_message = "packet read for background recording";
-		return m_err; // return the number of packets read
+		avformat_close_input(&m_ifmt_Ctx);
+		m_reconnect_start = now;
+		m_reconnect_next = now;
+		m_backoff = DEMUXER_BACKOFF_MIN * 1000LL;
+		m_attempts = 0;
 	}
 
-	if (!isBackground && mn_pkt)
+	if (now < m_reconnect_next)
 	{
-		av_packet_ref(pkt, &mn_pkt->pkt); // expose to the outside a copy of the packet
-		mn_pkt = mn_pkt->next; // update the reader packet
-		flag_reading = false;
-		m_err = 1;
-		m_message = "packet read for main recording";
+		m_err = AVERROR(EAGAIN);
+		m_message = "Waiting for the next reconnect attempt";
 		return m_err;
 	}
 
-	pkt = NULL;
-	m_err = 0;
-	m_message = "no packet available to read at this moment";
-	flag_reading = false;
-	return 0;
-};
+	int64_t start = m_reconnect_start;
+	int64_t end = start + m_reconnect_timeout * 1000LL;
+	int64_t deadline = m_open_timeout ? FFMIN(now + m_open_timeout * 1000LL, end) : end;
+	m_deadline.store(deadline, std::memory_order_relaxed);
+	open_input();
+	m_deadline.store(0, std::memory_order_relaxed);
+	m_attempts++;
 
-// get the time base of the circular buffer
-AVRational CircularBuffer::get_time_base()
-{
-	m_err = 0;
-	m_message = "";
+	// a camera answering without a video or audio stream is not reconnected, the backoff goes on
+	if (m_ifmt_Ctx && m_err == -2)
+	{
+		avformat_close_input(&m_ifmt_Ctx);
+	}
+	if (!m_ifmt_Ctx)
+	{
+		now = av_gettime_relative();
+		int64_t delay = m_backoff / 2 + av_get_random_seed() % m_backoff;
+		if (now + delay >= end)
+		{
+			m_reconnect_start = 0;
+			m_err = m_err == AVERROR(EAGAIN) || m_err >= 0 ? AVERROR(ETIMEDOUT) : m_err;
+			m_message = "Could not reconnect to " + m_url + " in " + std::to_string(m_attempts) + " attempts: " + m_message.str();
+			return m_err;
+		}
 
-	return m_time_base;
-};
+		m_reconnect_next = now + delay;
+		m_backoff = FFMIN(m_backoff * 2, DEMUXER_BACKOFF_MAX * 1000LL);
+		m_err = AVERROR(EAGAIN);
+		return m_err;
+	}
+	m_reconnect_start = 0;
+
+	// the streams found on reconnect are stitched to those before on their next packets
+	for (unsigned int i = 0; i < m_ifmt_Ctx->nb_streams; i++)
+	{
+		if (i < m_time_bases.size())
+		{
+			m_stitch[i] = true;
+		}
+		else
+		{
+			m_time_bases.push_back(m_ifmt_Ctx->streams[i]->time_base);
+			m_last_dts.push_back(AV_NOPTS_VALUE);
+			m_ts_offsets.push_back(0);
+			m_stitch.push_back(false);
+		}
+	}
+
+	// the reconnect time counts from the last packet read
+	m_reconnect_time = av_gettime_relative() - FFMIN(start, m_last_read_time);
+	m_max_reconnect_time = FFMAX(m_max_reconnect_time, m_reconnect_time);
+	m_reconnects++;
 
-// get the size of the circular buffer
-int CircularBuffer::get_size()
-{
 	m_err = 0;
-	m_message = "";
+	m_message = "Reconnected to " + m_url + " in " + std::to_string(m_attempts) + " attempts";
+	return m_err;
+}
 
-	return m_size;
-};
+// get the number of successful reconnects
+int Demuxer::get_reconnects()
+{
+	return m_reconnects;
+}
 
-// get the number of packets in the circular buffer
-int CircularBuffer::get_total_packets()
+// get the milliseconds the last successful reconnect took
+int64_t Demuxer::get_reconnect_time()
 {
-	return m_total_packets;
+	return m_reconnect_time / 1000;
 }
 
-// get the codec parameters of the circular buffer
-AVCodecParameters* CircularBuffer::get_stream_codecpar()
+// get the maximum milliseconds a successful reconnect took
+int64_t Demuxer::get_max_reconnect_time()
 {
-	m_err = 0;
-	m_message = "";
+	return m_max_reconnect_time / 1000;
+}
 
-	return m_codecpar;
-};
+// interrupt a blocking operation of the input past the deadline of the demuxer
+int Demuxer::interrupt(void* opaque)
+{
+	Demuxer* demuxer = static_cast<Demuxer*>(opaque);
+	int64_t deadline = demuxer->m_deadline.load(std::memory_order_relaxed);
+	return deadline && av_gettime_relative() > deadline ? 1 : 0;
+}
 
-// get the stream assigned to the circular buffer
-AVStream* CircularBuffer::get_stream()
+// get the video stream index of the camera
+// negative return indicates no video stream in the camera
+int Demuxer::get_video_index()
 {
-	return m_st;
+	return m_index_video;
 }
 
-// get the error message of last operation
-std::string CircularBuffer::get_error_message()
+// get the audio stream index of the camera
+// negative return indicates no audio stream in the camera
+int Demuxer::get_audio_index()
 {
-	return m_message;
+	return m_index_audio;
 }
 
-// reset the main reader to the very beginning of the circular buffer
-void CircularBuffer::reset_main_reader()
+// get the specified stream
+// index can be video index or audio index
+AVStream* Demuxer::get_stream(int stream_index)
 {
-	m_err = 0;
-	m_message = "";
+	if (!m_ifmt_Ctx || stream_index < 0 || static_cast <unsigned int>(stream_index) >= m_ifmt_Ctx->nb_streams)
+	{
+		m_err = -1;
+		m_message = "In valid stream index specified";
+		return NULL;
+	}
 
-	mn_pkt = first_pkt;
+	m_err = 0;
+	m_message = "get the stream";
+	return m_ifmt_Ctx->streams[stream_index];
 }
 
-Muxer::Muxer()
+CaptureEngine::CaptureEngine()
 {
-	m_url = "";
-	m_ofmt_Ctx = NULL;
-	m_options = NULL;
-	m_index_video = -1;
-	m_index_audio = -1;
-	m_flag_interleaved = true;
-	m_flag_wclk = true;
-	m_tbf_video = AVRational{ 1,2 };
-	m_tbf_audio = AVRational{ 1,3 };
-	m_time_base_audio = AVRational{ 1,4 };
-	m_time_base_video = AVRational{ 1,5 };
-	m_pts_offset_video = 0;
-	m_pts_offset_audio = 0;
-	m_defalt_duration_audio = 0;
-	m_defalt_duration_video = 0;
+	m_abort = false;
+	m_idle_polls = 0;
+	m_poll_interval = 1000;
 	m_err = 0;
 	m_message = "";
-	m_chunk_time = 0; // chunk indicator
-	m_chunk_interval = 0;
-	m_chunk_prefix = "";
-	m_format = "mp4";
 }
 
-Muxer::~Muxer()
+CaptureEngine::~CaptureEngine()
 {
-	avformat_free_context(m_ofmt_Ctx);
-	av_dict_free(&m_options);
+	close();
+
+	for (size_t i = 0; i < m_threads.size(); i++)
+	{
+		delete m_threads[i];
+	}
+	for (size_t i = 0; i < m_cameras.size(); i++)
+	{
+		delete m_cameras[i];
+	}
 }
 
-int Muxer::set_options(std::string option, std::string value)
+// start the I/O threads
+// @param nb_threads	the number of I/O threads, [1, CAPTURE_ENGINE_MAX_THREADS]
+// @param poll_interval	the microseconds an idle thread sleeps before polling its cameras again
+// @return				0 on success, negative for error code
+int CaptureEngine::open(int nb_threads, int poll_interval)
 {
-	m_err = 0;
-	m_message = "";
-
-	if (option == "wall_clock")
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_threads.empty())
 	{
-		if (value == "false")
-		{
-			m_flag_wclk = false;
+		m_err = -1;
+		m_message = "the capture engine is already open";
+		return m_err;
+	}
 
-			m_err = 0;
-			m_message = "'wall clock alignment' flag is set to false";
-		}
-		else if (value == "true")
-		{
-			m_flag_wclk = true;
+	if (nb_threads < 1 || nb_threads > CAPTURE_ENGINE_MAX_THREADS || poll_interval < 0)
+	{
+		m_err = -2;
+		m_message = "invalid number of threads or poll interval";
+		return m_err;
+	}
 
-			m_err = 0;
-			m_message = "'wall clock alignment' flag is set to true";
-		}
-		else
+	m_poll_interval = poll_interval;
+	m_abort = false;
+	for (int i = 0; i < nb_threads; i++)
+	{
+		m_threads.push_back(new CaptureThread());
+	}
+
+	// the cameras added before open are handed out to the threads
+	for (size_t i = 0; i < m_cameras.size(); i++)
+	{
+		if (m_cameras[i])
 		{
-			m_message = "unkown value of '" + value + "' for 'wall clock alignment' flag setting.";
-			m_err = -1;
+			m_cameras[i]->thread = static_cast<int>(i % m_threads.size());
+			m_threads[m_cameras[i]->thread]->cameras.push_back(m_cameras[i]);
 		}
-		return m_err;
 	}
 
-	if (option == "interleaved_write")
+	for (int i = 0; i < nb_threads; i++)
 	{
-		if (value == "false")
-		{
-			m_flag_interleaved = false;
+		m_threads[i]->worker = std::thread(&CaptureEngine::poll, this, i);
+	}
 
-			m_err = 0;
-			m_message = "'interleaved writting' flag is set to false";
-		}
-		else if (value == "true")
-		{
-			m_flag_interleaved = true;
+	m_err = 0;
+	m_message = "the capture engine is open with " + std::to_string(nb_threads) + " threads";
+	return m_err;
+}
 
-			m_err = 0;
-			m_message = "'interleaved writting' flag is set to true";
-		}
-		else
-		{
-			m_message = "unkown value of '" + value + "' for 'interleaved writting' flag setting.";
-			m_err = -1;
-		}
+// add an opened camera to be serviced by the I/O threads
+// @param camera	the camera, opened with the "nonblock" option to not hold up the other cameras of its thread
+// @param cbuf		the circular buffer the video and audio packets of the camera are pushed into
+// @return			the camera id (0 or positive) on success, negative for error code
+int CaptureEngine::add_camera(Demuxer* camera, CircularBuffer* cbuf)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!camera || !cbuf)
+	{
+		m_err = -1;
+		m_message = "invalid camera or circular buffer";
 		return m_err;
 	}
 
-	if (option == "format")
+	CaptureCamera* c = new CaptureCamera();
+	c->demuxer = camera;
+	c->cbuf = cbuf;
+	c->index_video = camera->get_video_index() >= 0 && cbuf->get_stream(camera->get_video_index()) ? camera->get_video_index() : -1;
+	c->index_audio = camera->get_audio_index() >= 0 && cbuf->get_stream(camera->get_audio_index()) ? camera->get_audio_index() : -1;
+	c->packets = 0;
+	c->errors = 0;
+	c->thread = -1;
+
+	// reuse the id of a removed camera
+	int id = 0;
+	while (static_cast<size_t>(id) < m_cameras.size() && m_cameras[id])
 	{
-		if (value.length() < 1 || value.length() > 10)
-		{
-			m_format = "mp4";
+		id++;
+	}
+	if (static_cast<size_t>(id) == m_cameras.size())
+	{
+		m_cameras.push_back(c);
+	}
+	else
+	{
+		m_cameras[id] = c;
+	}
 
-			m_err = -1;
-			m_message = value + " is invalid for 'file format' option setting";
-		}
-		else
+	// assign it to the thread with the fewest cameras
+	if (!m_threads.empty())
+	{
+		int t = 0;
+		for (size_t i = 1; i < m_threads.size(); i++)
 		{
-			m_format = value;
-			m_message = "'file format' option is set to be " + value;
-			m_err = 0;
+			if (m_threads[i]->cameras.size() < m_threads[t]->cameras.size())
+			{
+				t = static_cast<int>(i);
+			}
 		}
 
-		return m_err;
+		std::lock_guard<std::mutex> thread_lock(m_threads[t]->mutex);
+		c->thread = t;
+		m_threads[t]->cameras.push_back(c);
 	}
-	return av_dict_set(&m_options, option.c_str(), value.c_str(), 0);
-}
 
-// add a stream to the muxer
-// @param stream	stream to be added. The time base, codec parameters are used
-// @return			stream id in muxer. 0 or positive on success, negative for error code
-int Muxer::add_stream(AVStream* stream)
-{
 	m_err = 0;
-	m_message = "";
+	m_message = "camera is added";
+	return id;
+}
 
-	// return an error code when no stream can be found
-	if (!stream)
+// remove a camera, which is not read any more once it returns
+// @param camera	the camera id
+// @return			0 on success, negative for error code
+int CaptureEngine::remove_camera(int camera)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (camera < 0 || static_cast<size_t>(camera) >= m_cameras.size() || !m_cameras[camera])
 	{
 		m_err = -1;
-		m_message = "Error. Empty stream cannot be added";
+		m_message = "invalid camera";
 		return m_err;
 	}
 
-	// Create a new format context for the output container format if it is empty
-	if (!m_ofmt_Ctx)
+	CaptureCamera* c = m_cameras[camera];
+	if (c->thread >= 0)
 	{
-		//m_err = avformat_alloc_output_context2(&m_ofmt_Ctx, NULL, "mp4", NULL);
-		m_err = avformat_alloc_output_context2(&m_ofmt_Ctx, NULL, m_format.c_str(), NULL);
-		if (m_err < 0)
+		// the thread holds its mutex through a poll, the camera is not in use once it is locked
+		std::lock_guard<std::mutex> thread_lock(m_threads[c->thread]->mutex);
+		std::vector<CaptureCamera*>& cameras = m_threads[c->thread]->cameras;
+		for (size_t i = 0; i < cameras.size(); i++)
 		{
-			//m_message = "Error. Could not allocate output format context.";
-			m_message.assign(av_err(m_err));
-			return m_err;
+			if (cameras[i] == c)
+			{
+				cameras.erase(cameras.begin() + i);
+				break;
+			}
 		}
 	}
 
-	//m_ifmt_Ctx = ifmt_Ctx;
-	AVStream* out_stream = avformat_new_stream(m_ofmt_Ctx, NULL);
-	if (!out_stream)
+	m_cameras[camera] = NULL;
+	delete c;
+
+	m_err = 0;
+	m_message = "camera is removed";
+	return m_err;
+}
+
+// stop the I/O threads, the cameras stay open and added
+void CaptureEngine::close()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_abort = true;
+	for (size_t i = 0; i < m_threads.size(); i++)
 	{
-		m_err = -2;
-		m_message = "Error. Failed allocating output stream.";
-		return m_err;
+		if (m_threads[i]->worker.joinable())
+		{
+			m_threads[i]->worker.join();
+		}
+		delete m_threads[i];
 	}
+	m_threads.clear();
 
-	m_err = avcodec_parameters_copy(out_stream->codecpar, stream->codecpar);
-	if (m_err < 0)
+	for (size_t i = 0; i < m_cameras.size(); i++)
 	{
-		m_err = -3;
-		//m_message = "Error. Failed to copy the stream codec parameters.";
-		m_message.assign(av_err(m_err));
-		return m_err;
+		if (m_cameras[i])
+		{
+			m_cameras[i]->thread = -1;
+		}
 	}
 
-	out_stream->id = m_ofmt_Ctx->nb_streams - 1;
-	out_stream->codecpar->codec_tag = 0;
+	m_err = 0;
+	m_message = "the capture engine is closed";
+}
 
-	if (out_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+// poll the cameras of specified I/O thread until the engine is closed
+// every camera is read until it has no packet ready, or up to CAPTURE_ENGINE_BURST packets to be fair to the others
+void CaptureEngine::poll(int thread)
+{
+	CaptureThread* t = m_threads[thread];
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = NULL;
+	pkt.size = 0;
+
+	while (!m_abort.load(std::memory_order_relaxed))
 	{
-		m_index_video = out_stream->id;
-		m_time_base_video = stream->time_base;
-		m_video_stream = out_stream;
+		bool idle = true;
+		{
+			std::lock_guard<std::mutex> lock(t->mutex);
+			for (size_t i = 0; i < t->cameras.size(); i++)
+			{
+				CaptureCamera* c = t->cameras[i];
+				for (int n = 0; n < CAPTURE_ENGINE_BURST; n++)
+				{
+					int ret = c->demuxer->read_packet(&pkt);
+					if (ret == AVERROR(EAGAIN))
+					{
+						break;
+					}
+
+					if (ret < 0)
+					{
+						c->errors.fetch_add(1, std::memory_order_relaxed);
+						break;
+					}
+
+					idle = false;
+					if (pkt.stream_index == c->index_video || pkt.stream_index == c->index_audio)
+					{
+						if (c->cbuf->push_packet(&pkt, true) >= 0)
+						{
+							c->packets.fetch_add(1, std::memory_order_relaxed);
+						}
+					}
+					av_packet_unref(&pkt);
+				}
+			}
+		}
+
+		// sleep only when none of the cameras has a packet ready
+		if (idle)
+		{
+			m_idle_polls.fetch_add(1, std::memory_order_relaxed);
+			av_usleep(m_poll_interval);
+		}
 	}
-	else if (out_stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+}
+
+// get the number of packets pushed of specified camera
+int64_t CaptureEngine::get_packets(int camera)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (camera < 0 || static_cast<size_t>(camera) >= m_cameras.size() || !m_cameras[camera])
 	{
-		m_index_audio = out_stream->id;
-		m_time_base_audio = stream->time_base;
-		m_audio_stream = out_stream;
+		return -1;
 	}
+	return m_cameras[camera]->packets.load(std::memory_order_relaxed);
+}
 
-	m_message = "stream is added to the recorder";
-	return out_stream->id;
+// get the number of failed reads of specified camera
+int64_t CaptureEngine::get_errors(int camera)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (camera < 0 || static_cast<size_t>(camera) >= m_cameras.size() || !m_cameras[camera])
+	{
+		return -1;
+	}
+	return m_cameras[camera]->errors.load(std::memory_order_relaxed);
 }
 
-// add a stream from the circular buffer
-// @param circular_buffer	the circular buffer whose embedded stream will be added.
-// @return					stream id in muxer. 0 or positive on success, negative for error code
-int Muxer::add_stream(CircularBuffer* circular_buffer)
+// get the number of polls that found no packet ready and slept
+int64_t CaptureEngine::get_idle_polls()
 {
-	return add_stream(circular_buffer->get_stream());
+	return m_idle_polls.load(std::memory_order_relaxed);
 }
 
-// add streams from the input format context
-// @param fmt_ctx	the input format context whose embedded streams will be added.
-// @return			stream id in muxer. 0 or positive on success, negative for error code
-int Muxer::add_stream(AVFormatContext* fmt_ctx)
+// get the number of I/O threads
+int CaptureEngine::get_nb_threads()
 {
-	unsigned int i;
-	for (i = 0; i < fmt_ctx->nb_streams; i++)
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return static_cast<int>(m_threads.size());
+}
+
+// get the error message of last operation
+std::string CaptureEngine::get_error_message()
+{
+	return m_message;
+}
+
+MappedRing::MappedRing()
+{
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = NULL;
+	m_view = NULL;
+	m_header = NULL;
+	m_records = NULL;
+	m_data = NULL;
+	m_records_mask = 0;
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_STREAMS; i++)
 	{
-		m_err = add_stream(fmt_ctx->streams[i]);
-		if (m_err < 0)
-		{
-			m_message = "Not able to add stream [" + std::to_string(i) + "]";
-			return m_err;
-		}
+		m_streams[i] = NULL;
 	}
 
-	return m_err;
+	m_err = 0;
+	m_message = "";
 }
 
-// open a new muxer
-// @param url				can be a filename, rtsp, rtp, or other valid url
-// @param chunk_interval	the muxer (video file) will be automatically chunked every chunk_interval seconds
-// @return					0 on success, negative for error code
-int Muxer::open(std::string url, int chunk_interval)
+MappedRing::~MappedRing()
 {
-	if (url.empty())
+	close();
+}
+
+// create a mapped ring in the file
+// the file is preallocated and mapped as a whole, the payloads take what is left after the header and the records
+// @param filename	the file to be created, an existing one is overwritten
+// @param size		the size of the file in bytes
+// @return			0 on success, negative for error code
+int MappedRing::open(std::string filename, int64_t size)
+{
+	return create(filename, size, false);
+}
+
+// create a mapped ring in the named shared memory, backed by the paging file
+// other processes attach to it by the name, and read the packets without the writer knowing them
+// @param name	the name of the shared memory, such as "Local\\ipcam_1"
+// @param size	the size of the shared memory in bytes
+// @return		0 on success, negative for error code
+int MappedRing::share(std::string name, int64_t size)
+{
+	return create(name, size, true);
+}
+
+// create a mapped ring in a file or in the named shared memory
+// @param name		the file or the name of the shared memory
+// @param size		the size in bytes
+// @param shared	true for the named shared memory, false for the file
+// @return			0 on success, negative for error code
+int MappedRing::create(std::string name, int64_t size, bool shared)
+{
+	close();
+
+	// one record for every MAPPED_RING_BYTES_PER_RECORD bytes, rounded up to power of 2
+	int64_t nb_records = 1024;
+	while (nb_records < size / MAPPED_RING_BYTES_PER_RECORD)
+	{
+		nb_records <<= 1;
+	}
+
+	int64_t data_offset = MAPPED_RING_HEADER_SIZE + nb_records * static_cast<int64_t>(sizeof(MappedRingRecord));
+	if (size < data_offset * 2)
 	{
 		m_err = -1;
-		m_message = "url cannot be empty";
+		m_message = "the size of the mapped ring is too small";
 		return m_err;
 	}
 
-	// validate the input chunk interval
-	if (chunk_interval < 0 || chunk_interval > 3600)
+	m_err = map(name, size, false, shared);
+	if (m_err < 0)
 	{
-		m_err = -1;
-		m_message = "'chunk interval' setting shall be [0-3600]";
 		return m_err;
 	}
 
-	// positive chunk interval indicates segmentally recording, url is considered to be the file prefix of segmental files
-	if (chunk_interval > 0)
+	// the magic is the last to be set, so that a reader attaching in between sees no valid header
+	m_header = new (m_view) MappedRingHeader;
+	memset(m_header->magic, 0, 8);
+	m_header->version = 2;
+	m_header->header_size = MAPPED_RING_HEADER_SIZE;
+	m_header->file_size = size;
+	m_header->nb_records = nb_records;
+	m_header->data_offset = data_offset;
+	m_header->data_size = size - data_offset;
+	m_header->head.store(0);
+	m_header->tail.store(0);
+	m_header->data_head.store(0);
+	m_header->nb_streams = 0;
+	m_header->extradata_end = sizeof(MappedRingHeader);
+
+	m_records = (MappedRingRecord*)(m_view + MAPPED_RING_HEADER_SIZE);
+	m_data = m_view + data_offset;
+	m_records_mask = nb_records - 1;
+
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(m_header->magic, "PKTRING", 8);
+
+	m_err = 0;
+	m_message = name + " is mapped";
+	return m_err;
+}
+
+// map the view of the whole file or the named shared memory
+// @param name		the file or the name of the shared memory
+// @param size		the size to be created, ignored when readonly
+// @param readonly	true to map an existing one read only, otherwise a new one is created or an existing file is overwritten
+// @param shared	true for the named shared memory, false for the file
+// @return			0 on success, negative for error code
+int MappedRing::map(std::string name, int64_t size, bool readonly, bool shared)
+{
+	LARGE_INTEGER li;
+	li.QuadPart = size;
+	if (shared)
 	{
-		m_chunk_prefix = url;
-		m_chunk_interval = chunk_interval * 1000;  // convert the interval into miliseconds
-		m_message = "chunked recording is set to be " + m_chunk_prefix + "yyyy-MM-dd-hhmmss" + m_chunk_prefix;
+		// the shared memory is committed from the paging file on creation, no file is involved
+		m_mapping = readonly ? OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str()) :
+			CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE | SEC_COMMIT, li.HighPart, li.LowPart, name.c_str());
+		if (m_mapping && !readonly && GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			// another writer owns the name, its readers must not see a second ring in the same memory
+			m_err = -2;
+			m_message = name + " is already shared by another writer";
+			close();
+			return m_err;
+		}
 	}
 	else
 	{
-		m_url = url;  // url is the full path of the recording video file
-		m_chunk_interval = 0;
-		m_chunk_prefix = "";
-		m_message = "normal recording";
+		m_file = CreateFileA(name.c_str(), readonly ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+			NULL, readonly ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_file == INVALID_HANDLE_VALUE)
+		{
+			m_err = -2;
+			m_message = "cannot open " + name + " with error " + std::to_string(GetLastError());
+			return m_err;
+		}
+
+		// preallocate the file so that appending never extends it
+		if (readonly ? !GetFileSizeEx(m_file, &li) : !SetFilePointerEx(m_file, li, NULL, FILE_BEGIN) || !SetEndOfFile(m_file))
+		{
+			m_err = -3;
+			m_message = "cannot preallocate " + name + " with error " + std::to_string(GetLastError());
+			close();
+			return m_err;
+		}
+
+		m_mapping = CreateFileMappingA(m_file, NULL, readonly ? PAGE_READONLY : PAGE_READWRITE, li.HighPart, li.LowPart, NULL);
 	}
 
-	m_chunk_time = 0;
-	return chunk();
+	m_view = m_mapping ? (uint8_t*)MapViewOfFile(m_mapping, readonly ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL;
+	if (!m_view)
+	{
+		m_err = -4;
+		m_message = "cannot map " + name + " with error " + std::to_string(GetLastError());
+		close();
+		return m_err;
+	}
+
+	// the size of an existing shared memory is that of the mapped view, rounded up to pages
+	MEMORY_BASIC_INFORMATION mbi;
+	if (readonly && shared)
+	{
+		li.QuadPart = VirtualQuery(m_view, &mbi, sizeof(mbi)) ? static_cast<int64_t>(mbi.RegionSize) : 0;
+	}
+
+	// the header of an existing file has to be validated before use
+	if (readonly && (li.QuadPart < MAPPED_RING_HEADER_SIZE || memcmp(m_view, "PKTRING", 8) ||
+		((MappedRingHeader*)m_view)->version != 2 || ((MappedRingHeader*)m_view)->file_size > li.QuadPart ||
+		(!shared && ((MappedRingHeader*)m_view)->file_size != li.QuadPart)))
+	{
+		m_err = -5;
+		m_message = name + " is not a valid mapped ring";
+		close();
+		return m_err;
+	}
+
+	m_err = 0;
+	return m_err;
 }
 
-// make another chunked recording
-// first stop current recording in case there is one. Then start another recording by chunk prefix.
-// @return 0 on success, negative for error code
-int Muxer::chunk()
+// map an existing mapped ring file read only
+// the packets in [tail, head) are those completely written before the writer stopped
+// @param filename	the file written by a mapped ring before
+// @return			0 on success, negative for error code
+int MappedRing::recover(std::string filename)
+{
+	return attach(filename, false);
+}
+
+// attach to the named shared memory of a mapped ring read only
+// the writer keeps appending while the packets are read, it never waits for the readers of other processes
+// @param name	the name of the shared memory given to share
+// @return		0 on success, negative for error code
+int MappedRing::attach(std::string name)
+{
+	return attach(name, true);
+}
+
+// map an existing mapped ring read only
+// @param name		the file or the name of the shared memory
+// @param shared	true for the named shared memory, false for the file
+// @return			0 on success, negative for error code
+int MappedRing::attach(std::string name, bool shared)
+{
+	close();
+
+	m_err = map(name, 0, true, shared);
+	if (m_err < 0)
+	{
+		return m_err;
+	}
+
+	m_header = (MappedRingHeader*)m_view;
+	if (m_header->nb_records <= 0 || (m_header->nb_records & (m_header->nb_records - 1)) ||
+		m_header->data_offset != MAPPED_RING_HEADER_SIZE + m_header->nb_records * static_cast<int64_t>(sizeof(MappedRingRecord)) ||
+		m_header->data_offset + m_header->data_size != m_header->file_size ||
+		m_header->nb_streams < 0 || m_header->nb_streams > CIRCULAR_BUFFER_MAX_STREAMS)
+	{
+		close();
+		m_err = -5;
+		m_message = name + " is not a valid mapped ring";
+		return m_err;
+	}
+
+	m_records = (MappedRingRecord*)(m_view + MAPPED_RING_HEADER_SIZE);
+	m_data = m_view + m_header->data_offset;
+	m_records_mask = m_header->nb_records - 1;
+
+	m_err = 0;
+	m_message = name + " is attached with " + std::to_string(get_head() - get_tail()) + " packets";
+	return m_err;
+}
+
+// unmap and close the file
+void MappedRing::close()
+{
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_STREAMS; i++)
+	{
+		if (m_streams[i])
+		{
+			avcodec_parameters_free(&m_streams[i]->codecpar);
+			av_freep(&m_streams[i]);
+		}
+	}
+
+	if (m_view)
+	{
+		UnmapViewOfFile(m_view);
+	}
+
+	if (m_mapping)
+	{
+		CloseHandle(m_mapping);
+	}
+
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_file);
+	}
+
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = NULL;
+	m_view = NULL;
+	m_header = NULL;
+	m_records = NULL;
+	m_data = NULL;
+	m_records_mask = 0;
+}
+
+// append a packet to the mapped ring
+// only the writer calls it
+// @param seq		the sequence number of the packet
+// @param pkt		the packet, whose payload is copied into the mapped ring
+// @param time		the pts in microseconds
+// @param stream	the order of the stream in the circular buffer
+// @param flags		the flags of the packet in the circular buffer, AV_PKT_FLAG_* and CIRCULAR_BUFFER_FLAG_*
+// @return			0 on success, negative for error code
+int MappedRing::append(int64_t seq, const AVPacket* pkt, int64_t time, int stream, int flags)
+{
+	if (!m_header)
+	{
+		return -1;
+	}
+
+	int64_t data_size = m_header->data_size;
+	int64_t size = (static_cast<int64_t>(pkt->size) + 7) & ~static_cast<int64_t>(7);
+	if (size > data_size)
+	{
+		return -2;
+	}
+
+	int64_t head = m_header->head.load(std::memory_order_relaxed);
+	int64_t tail = m_header->tail.load(std::memory_order_relaxed);
+
+	// the records have to be of consecutive sequence numbers
+	if (seq != head || head == tail)
+	{
+		head = seq;
+		tail = seq;
+		m_header->tail.store(tail);
+		m_header->head.store(head);
+	}
+
+	// a payload never wraps around the end of the payload area
+	int64_t start = m_header->data_head.load(std::memory_order_relaxed);
+	if (start % data_size + size > data_size)
+	{
+		start += data_size - start % data_size;
+	}
+
+	// overwrite the oldest records to make room for the new one
+	int64_t new_tail = tail;
+	while (new_tail < head && (head - new_tail > m_records_mask || start + size - m_records[new_tail & m_records_mask].pos > data_size))
+	{
+		new_tail++;
+	}
+
+	// the readers that copied any overwritten bytes are sure to see the new tail afterwards
+	if (new_tail != tail)
+	{
+		m_header->tail.store(new_tail, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	MappedRingRecord* rec = &m_records[head & m_records_mask];
+	rec->seq = seq;
+	rec->pts = pkt->pts;
+	rec->dts = pkt->dts;
+	rec->duration = pkt->duration;
+	rec->time = time;
+	rec->pos = start;
+	rec->size = pkt->size;
+	rec->flags = flags;
+	rec->stream_index = pkt->stream_index;
+	rec->stream = stream;
+	if (pkt->size > 0)
+	{
+		memcpy(m_data + start % data_size, pkt->data, pkt->size);
+	}
+
+	// publish the record
+	m_header->data_head.store(start + size, std::memory_order_relaxed);
+	m_header->head.store(head + 1, std::memory_order_release);
+	return 0;
+}
+
+// read the packet of sequence number seq
+// it can be called by any reader while the writer is appending
+// @param seq		the sequence number of the packet
+// @param pkt		the packet that gets a copy of the record, with the AV_PKT_FLAG_* of the record only
+// @param flags	gets all the flags of the record when it is not NULL
+// @return		1 when the packet is read, 0 when it is not appended yet, negative when it has been overwritten
+int MappedRing::read(int64_t seq, AVPacket* pkt, int* flags)
+{
+	if (!m_header)
+	{
+		return -1;
+	}
+
+	if (seq < m_header->tail.load(std::memory_order_acquire))
+	{
+		return -1;
+	}
+
+	if (seq >= m_header->head.load(std::memory_order_acquire))
+	{
+		return 0;
+	}
+
+	MappedRingRecord rec = m_records[seq & m_records_mask];
+	if (rec.seq != seq || rec.size < 0 || rec.size > m_header->data_size || av_new_packet(pkt, rec.size) < 0)
+	{
+		return -1;
+	}
+	memcpy(pkt->data, m_data + rec.pos % m_header->data_size, rec.size);
+
+	// the record and the payload are valid unless the writer has overwritten them while copying
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (seq < m_header->tail.load(std::memory_order_relaxed))
+	{
+		av_packet_unref(pkt);
+		return -1;
+	}
+
+	pkt->pts = rec.pts;
+	pkt->dts = rec.dts;
+	pkt->duration = rec.duration;
+	pkt->flags = rec.flags & CIRCULAR_BUFFER_PACKET_FLAGS;
+	pkt->stream_index = rec.stream_index;
+	pkt->pos = -1;
+	if (flags)
+	{
+		*flags = rec.flags;
+	}
+	return 1;
+}
+
+// get the packet of sequence number seq without copying the payload
+// the data of the packet points into the mapping, and is not reference counted.
+// the payload is valid only if get_tail() is still not beyond seq after it has been used,
+// otherwise the writer may have overwritten it in between and the result has to be discarded.
+// @param seq	the sequence number of the packet
+// @param pkt	the packet that refers to the record
+// @return		1 when the packet is got, 0 when it is not appended yet, negative when it has been overwritten
+int MappedRing::peek(int64_t seq, AVPacket* pkt)
+{
+	if (!m_header)
+	{
+		return -1;
+	}
+
+	if (seq < m_header->tail.load(std::memory_order_acquire))
+	{
+		return -1;
+	}
+
+	if (seq >= m_header->head.load(std::memory_order_acquire))
+	{
+		return 0;
+	}
+
+	MappedRingRecord rec = m_records[seq & m_records_mask];
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (seq < m_header->tail.load(std::memory_order_relaxed) || rec.seq != seq || rec.size < 0 || rec.size > m_header->data_size)
+	{
+		return -1;
+	}
+
+	pkt->buf = NULL;
+	pkt->data = m_data + rec.pos % m_header->data_size;
+	pkt->size = rec.size;
+	pkt->pts = rec.pts;
+	pkt->dts = rec.dts;
+	pkt->duration = rec.duration;
+	pkt->flags = rec.flags & CIRCULAR_BUFFER_PACKET_FLAGS;
+	pkt->stream_index = rec.stream_index;
+	pkt->pos = -1;
+	return 1;
+}
+
+// find the sequence number of the last key frame of specified stream at or before time
+// it can be called by any reader while the writer is appending
+// @param time		the time in microseconds
+// @param stream	the order of the stream in the circular buffer
+// @return			the sequence number of the key frame, negative when there is no such key frame
+int64_t MappedRing::find_key_frame(int64_t time, int stream)
+{
+	if (!m_header)
+	{
+		return -1;
+	}
+
+	while (true)
+	{
+		int64_t lo = m_header->tail.load(std::memory_order_acquire);
+		int64_t hi = m_header->head.load(std::memory_order_acquire);
+		if (lo >= hi)
+		{
+			return -1;
+		}
+
+		// binary search for the first record after time
+		int64_t first = lo;
+		int64_t count = hi - lo;
+		while (count > 0)
+		{
+			int64_t step = count / 2;
+			if (m_records[(first + step) & m_records_mask].time <= time)
+			{
+				first += step + 1;
+				count -= step + 1;
+			}
+			else
+			{
+				count = step;
+			}
+		}
+
+		// step back to the key frame, which is at most a GOP away
+		int64_t seq = -1;
+		for (int64_t i = first - 1; i >= lo; i--)
+		{
+			MappedRingRecord* rec = &m_records[i & m_records_mask];
+			if (rec->stream == stream && (rec->flags & AV_PKT_FLAG_KEY))
+			{
+				seq = rec->seq;
+				break;
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_header->tail.load(std::memory_order_relaxed) <= lo)
+		{
+			return seq;
+		}
+	}
+}
+
+// save the codec parameters of the n-th stream
+// only the writer calls it, the extradata of a replaced stream is not reclaimed
+// @param n			the order of the stream in the circular buffer
+// @param stream	the stream whose codec parameters and time base are saved
+// @return			0 on success, negative for error code
+int MappedRing::set_stream(int n, AVStream* stream)
+{
+	if (!m_header || n < 0 || n >= CIRCULAR_BUFFER_MAX_STREAMS || n > m_header->nb_streams || !stream)
+	{
+		return -1;
+	}
+
+	AVCodecParameters* par = stream->codecpar;
+	MappedRingStream* mrs = &m_header->streams[n];
+	if (par->extradata_size > MAPPED_RING_HEADER_SIZE - m_header->extradata_end)
+	{
+		return -2;
+	}
+
+	mrs->index = stream->index;
+	mrs->codec_type = par->codec_type;
+	mrs->codec_id = par->codec_id;
+	mrs->format = par->format;
+	mrs->time_base_num = stream->time_base.num;
+	mrs->time_base_den = stream->time_base.den;
+	mrs->width = par->width;
+	mrs->height = par->height;
+	mrs->sample_rate = par->sample_rate;
+	mrs->channels = par->channels;
+	mrs->channel_layout = par->channel_layout;
+	mrs->bit_rate = par->bit_rate;
+	mrs->profile = par->profile;
+	mrs->level = par->level;
+	mrs->extradata_offset = m_header->extradata_end;
+	mrs->extradata_size = par->extradata_size > 0 ? par->extradata_size : 0;
+	if (mrs->extradata_size)
+	{
+		memcpy(m_view + mrs->extradata_offset, par->extradata, mrs->extradata_size);
+		m_header->extradata_end += mrs->extradata_size;
+	}
+
+	if (n == m_header->nb_streams)
+	{
+		m_header->nb_streams++;
+	}
+	return 0;
+}
+
+// get the n-th stream saved in the mapped ring
+// the stream is built from the header on first request, and kept until the mapped ring is closed
+// @param n	the order of the stream
+// @return	the stream, NULL when there is no such stream
+AVStream* MappedRing::get_stream(int n)
+{
+	if (!m_header || n < 0 || n >= m_header->nb_streams)
+	{
+		return NULL;
+	}
+
+	if (m_streams[n])
+	{
+		return m_streams[n];
+	}
+
+	MappedRingStream* mrs = &m_header->streams[n];
+	AVStream* st = (AVStream*)av_mallocz(sizeof(AVStream));
+	AVCodecParameters* par = avcodec_parameters_alloc();
+	if (!st || !par || mrs->extradata_size < 0 || mrs->extradata_offset + mrs->extradata_size > MAPPED_RING_HEADER_SIZE)
+	{
+		av_freep(&st);
+		avcodec_parameters_free(&par);
+		return NULL;
+	}
+
+	par->codec_type = static_cast<enum AVMediaType>(mrs->codec_type);
+	par->codec_id = static_cast<enum AVCodecID>(mrs->codec_id);
+	par->format = mrs->format;
+	par->width = mrs->width;
+	par->height = mrs->height;
+	par->sample_rate = mrs->sample_rate;
+	par->channels = mrs->channels;
+	par->channel_layout = mrs->channel_layout;
+	par->bit_rate = mrs->bit_rate;
+	par->profile = mrs->profile;
+	par->level = mrs->level;
+	if (mrs->extradata_size > 0)
+	{
+		par->extradata = (uint8_t*)av_mallocz(mrs->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (par->extradata)
+		{
+			memcpy(par->extradata, m_view + mrs->extradata_offset, mrs->extradata_size);
+			par->extradata_size = mrs->extradata_size;
+		}
+	}
+
+	st->index = mrs->index;
+	st->codecpar = par;
+	st->time_base = AVRational{ mrs->time_base_num, mrs->time_base_den };
+	st->start_time = AV_NOPTS_VALUE;
+	m_streams[n] = st;
+	return st;
+}
+
+// get the number of streams saved in the mapped ring
+int MappedRing::get_nb_streams()
+{
+	return m_header ? m_header->nb_streams : 0;
+}
+
+// save the packets of the last seconds to a file by Muxer
+// the packets start from the last key frame of the first video stream at or before the newest packet minus seconds
+// @param filename	the file to be saved, in mp4 format
+// @param seconds	the number of seconds before the newest packet
+// @return			the number of packets saved, negative for error code
+int MappedRing::dump(std::string filename, int seconds)
+{
+	int nb_streams = get_nb_streams();
+	if (!nb_streams || get_head() <= get_tail())
+	{
+		m_err = -1;
+		m_message = "no packet to dump";
+		return m_err;
+	}
+
+	// the first video stream is the primary one, the same as the circular buffer
+	Muxer muxer;
+	int index[CIRCULAR_BUFFER_MAX_STREAMS];
+	int primary = 0;
+	for (int n = nb_streams - 1; n >= 0; n--)
+	{
+		if (get_stream(n) && get_stream(n)->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+		{
+			primary = n;
+		}
+	}
+
+	for (int n = 0; n < nb_streams; n++)
+	{
+		index[n] = muxer.add_stream(get_stream(n));
+		if (index[n] < 0)
+		{
+			m_err = index[n];
+			m_message = muxer.get_error_message();
+			return m_err;
+		}
+	}
+
+	m_err = muxer.open(filename);
+	if (m_err < 0)
+	{
+		m_message = muxer.get_error_message();
+		return m_err;
+	}
+
+	int64_t seq = find_key_frame(get_newest_time() - static_cast<int64_t>(seconds) * 1000000, primary);
+	if (seq < 0)
+	{
+		seq = get_tail();
+	}
+
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = NULL;
+	pkt.size = 0;
+
+	int count = 0;
+	for (; read(seq, &pkt) > 0; seq++)
+	{
+		// packets are recorded in the order of the streams in the circular buffer
+		int n = m_records[seq & m_records_mask].stream;
+		if (n < 0 || n >= nb_streams || muxer.record(&pkt, index[n]) < 0)
+		{
+			av_packet_unref(&pkt);
+			continue;
+		}
+		count++;
+	}
+
+	m_err = muxer.close();
+	if (m_err < 0)
+	{
+		m_message = muxer.get_error_message();
+		return m_err;
+	}
+
+	m_err = count;
+	m_message = std::to_string(count) + " packets are saved to " + filename;
+	return count;
+}
+
+// get the sequence number of the next record
+int64_t MappedRing::get_head()
+{
+	return m_header ? m_header->head.load(std::memory_order_acquire) : 0;
+}
+
+// get the sequence number of the oldest record
+int64_t MappedRing::get_tail()
+{
+	return m_header ? m_header->tail.load(std::memory_order_acquire) : 0;
+}
+
+// get the time in microseconds of the newest record
+int64_t MappedRing::get_newest_time()
+{
+	int64_t head = get_head();
+	if (head <= get_tail())
+	{
+		return AV_NOPTS_VALUE;
+	}
+
+	return m_records[(head - 1) & m_records_mask].time;
+}
+
+// get the error message of last operation
+std::string MappedRing::get_error_message()
+{
+	return m_message;
+}
+
+CircularBuffer::CircularBuffer()
+{
+	m_ring = NULL;
+	m_ring_mask = 0;
+	m_nodes = NULL;
+	m_free_nodes = NULL;
+	m_nb_nodes = 0;
+	m_pool_hits = 0;
+	m_pool_misses = 0;
+	m_arena = NULL;
+	m_arena_size = 0;
+	m_arena_head = 0;
+	m_arena_tail = 0;
+	m_regions = NULL;
+	m_regions_mask = 0;
+	m_region_head = 0;
+	m_region_tail = 0;
+	m_arena_hits = 0;
+	m_arena_misses = 0;
+	m_keys = NULL;
+	m_key_head = 0;
+	m_key_tail = 0;
+	m_newest_time = AV_NOPTS_VALUE;
+	m_spill = NULL;
+	m_black_box = false;
+	m_info = NULL;
+	m_nb_streams = 0;
+	m_primary = -1;
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_STREAMS; i++)
+	{
+		m_streams[i].st = NULL;
+		m_streams[i].codecpar = NULL;
+		m_streams[i].first_pts = 0;
+		m_streams[i].packets = 0;
+		m_streams[i].size = 0;
+		m_streams[i].nal_length_size = -1;
+	}
+	m_head = 0;
+	m_tail = 0;
+	m_nb_pending = 0;
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		m_readers[i].pos = 0;
+		m_readers[i].hazard = -1;
+		m_readers[i].state = 0;
+		m_readers[i].waiting = 0;
+		m_readers[i].event = NULL;
+		m_readers[i].policy = CIRCULAR_BUFFER_POLICY_DROP;
+		m_readers[i].backpressure = 0;
+		m_readers[i].resync = false;
+		m_readers[i].dropped = 0;
+		m_readers[i].stalled = 0;
+		m_readers[i].max_lag = 0;
+		m_readers[i].flags = 0;
+	}
+	m_hold_start = 0;
+	m_thin_age = 0;
+	m_thin_pos = 0;
+	m_thinned = 0;
+
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_EXPORTS; i++)
+	{
+		m_exports[i].state = 0;
+		m_exports[i].abort = false;
+		m_exports[i].reader = -1;
+	}
+
+	m_total_packets = 0;
+	m_size = 0;
+	m_time_span = 0;
+	m_MaxSize = 0;
+	m_size_limit = 0;
+	m_bitrate = 0;
+	m_manager = NULL;
+	m_rebalance_time = 0;
+	m_time_base = AVRational{ 1, 2 };
+
+	m_err = 0;
+	m_message = "";
+}
+
+// open the circular buffer
+// @param time_span	the maximum time span in seconds of packets kept in the circular buffer
+// @param max_size	the maximum size in bytes of packets kept in the circular buffer
+// the ring is sized to hold time_span seconds of packets at CIRCULAR_BUFFER_PACKET_RATE
+// the pool of packet lists is sized to the ring, so that no packet list is allocated on pushing
+// @param arena		true to copy the packet payloads into one preallocated arena of max_size bytes.
+//					All the packets read out of the circular buffer shall be unreferenced before it is closed or deleted.
+void CircularBuffer::open(int time_span, int max_size, bool arena)
+{
+	clear();
+	av_freep(&m_ring);
+	av_freep(&m_nodes);
+	av_freep(&m_arena);
+	av_freep(&m_regions);
+	av_freep(&m_keys);
+	av_freep(&m_info);
+	delete m_spill;
+	m_spill = NULL;
+	m_black_box = false;
+	m_free_nodes = NULL;
+	m_nb_nodes = 0;
+	m_arena_size = 0;
+	m_regions_mask = 0;
+
+	m_time_span = time_span > 0 ? time_span : 0;
+	m_MaxSize = max_size > 0 ? max_size : 0;
+	m_size_limit = m_MaxSize;
+	m_bitrate = 0;
+
+	// the number of slots is rounded up to power of 2 so that the slot index is simply masked from the sequence number
+	int64_t slots = CIRCULAR_BUFFER_MIN_SLOTS;
+	while (slots < static_cast<int64_t>(m_time_span) * CIRCULAR_BUFFER_PACKET_RATE)
+	{
+		slots <<= 1;
+	}
+	m_ring = (AVPacketList**)av_mallocz_array(slots, sizeof(AVPacketList*));
+	m_keys = (CircularBufferKey*)av_mallocz_array(slots, sizeof(CircularBufferKey));
+	m_info = (CircularBufferPacketInfo*)av_mallocz_array(slots, sizeof(CircularBufferPacketInfo));
+	if (!m_keys || !m_info)
+	{
+		av_freep(&m_ring);
+	}
+	m_ring_mask = m_ring ? slots - 1 : 0;
+	m_key_head = 0;
+	m_key_tail = 0;
+	m_newest_time = AV_NOPTS_VALUE;
+
+	// every slot holds one packet list, and every reader may defer the release of one more
+	m_nodes = (AVPacketList*)av_mallocz_array(slots + CIRCULAR_BUFFER_MAX_READERS, sizeof(AVPacketList));
+	if (m_nodes)
+	{
+		m_nb_nodes = slots + CIRCULAR_BUFFER_MAX_READERS;
+		for (int64_t i = m_nb_nodes - 1; i >= 0; i--)
+		{
+			m_nodes[i].next = m_free_nodes;
+			m_free_nodes = &m_nodes[i];
+		}
+	}
+	m_pool_hits = 0;
+	m_pool_misses = 0;
+
+	// the arena has a region for every packet in the ring, and as many more for the payloads still referenced by readers.
+	// it is sized over max_size, so that a buffer full up to max_size still copies the next packet into the arena
+	if (arena && m_MaxSize > 0)
+	{
+		int64_t arena_size = static_cast<int64_t>(m_MaxSize) + m_MaxSize / CIRCULAR_BUFFER_ARENA_HEADROOM
+			+ slots * (AV_INPUT_BUFFER_PADDING_SIZE + 63);
+		m_arena = arena_size <= INT_MAX ? (uint8_t*)av_malloc(static_cast<size_t>(arena_size)) : NULL;
+		m_regions = (CircularBufferRegion*)av_mallocz_array(slots * 2, sizeof(CircularBufferRegion));
+		if (m_arena && m_regions)
+		{
+			m_arena_size = arena_size;
+			m_regions_mask = slots * 2 - 1;
+		}
+		else
+		{
+			av_freep(&m_arena);
+			av_freep(&m_regions);
+		}
+	}
+	m_arena_head = 0;
+	m_arena_tail = 0;
+	m_region_head = 0;
+	m_region_tail = 0;
+	m_arena_hits = 0;
+	m_arena_misses = 0;
+
+	m_head = 0;
+	m_tail = 0;
+	m_nb_pending = 0;
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		m_readers[i].pos = 0;
+		m_readers[i].hazard = -1;
+		m_readers[i].state = 0;
+	}
+	add_reader("background");
+	add_reader("main");
+
+	// the streams have to be added again after opening
+	m_total_packets = 0;
+	m_size = 0;
+	m_nb_streams = 0;
+	m_primary = -1;
+	m_time_base = AVRational{ 1, 2 };
+
+	m_err = m_ring ? 0 : -1;
+	m_message = m_ring ? "" : "cannot allocate the ring of the circular buffer";
+	if (m_ring && arena && !m_arena)
+	{
+		m_err = -2;
+		m_message = "cannot allocate the arena of the circular buffer, packet payloads are referenced";
+	}
+}
+
+CircularBuffer::~CircularBuffer()
+{
+	BufferManager* manager = m_manager.load();
+	if (manager)
+	{
+		manager->remove_buffer(this);
+	}
+
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_EXPORTS; i++)
+	{
+		join_export(i, true);
+	}
+
+	clear();
+	av_freep(&m_ring);
+	av_freep(&m_nodes);
+	av_freep(&m_arena);
+	av_freep(&m_regions);
+	av_freep(&m_keys);
+	av_freep(&m_info);
+	delete m_spill;
+
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		if (m_readers[i].event)
+		{
+			CloseHandle(m_readers[i].event);
+		}
+	}
+
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_STREAMS; i++)
+	{
+		av_freep(&m_streams[i].st);
+		avcodec_parameters_free(&m_streams[i].codecpar); //must be allocated with avcodec_parameters_alloc() and freed with avcodec_parameters_free().
+	}
+}
+
+// release the packet list of specified sequence number unless it is being read by any reader
+// only the writer calls it
+// @param seq	the sequence number of the packet, which has been evicted or thinned out
+// @return		true when the packet is released, false when it is deferred
+bool CircularBuffer::release_packet(int64_t seq)
+{
+	// m_tail has been moved beyond seq, or the packet has been flagged thinned, with sequential consistency before
+	// checking the hazards. a reader either sees it and gives up, or its hazard is seen here.
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		if (m_readers[i].hazard.load() == seq)
+		{
+			return false;
+		}
+	}
+
+	AVPacketList* pktl = m_ring[seq & m_ring_mask];
+	m_ring[seq & m_ring_mask] = NULL;
+	if (pktl)
+	{
+		av_packet_unref(&pktl->pkt);
+		free_node(pktl);
+	}
+	return true;
+}
+
+// take a packet list from the pool
+// only the writer calls it
+// @return	an empty packet list, NULL when neither the pool nor the heap has one
+AVPacketList* CircularBuffer::alloc_node()
+{
+	AVPacketList* pktl = m_free_nodes;
+	if (pktl)
+	{
+		m_free_nodes = pktl->next;
+		pktl->next = NULL;
+		m_pool_hits.store(m_pool_hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return pktl;
+	}
+
+	m_pool_misses.store(m_pool_misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	return (AVPacketList*)av_mallocz(sizeof(AVPacketList));
+}
+
+// return a packet list to where it was taken from
+// only the writer calls it
+// @param pktl	the packet list whose packet has been unreferenced
+void CircularBuffer::free_node(AVPacketList* pktl)
+{
+	if (pktl >= m_nodes && pktl < m_nodes + m_nb_nodes)
+	{
+		pktl->next = m_free_nodes;
+		m_free_nodes = pktl;
+		return;
+	}
+
+	av_free(pktl);
+}
+
+// called by the last reference of a payload in the arena, which can be in any thread
+// @param opaque	the region of the payload, whose payload stays in the arena
+void CircularBuffer::release_region(void* opaque, uint8_t*)
+{
+	static_cast<CircularBufferRegion*>(opaque)->released.store(1, std::memory_order_release);
+}
+
+// copy up to size bytes of the NAL unit without its emulation prevention bytes, 0x000003
+// @return	the number of bytes copied
+static int unescape_nal(const uint8_t* nal, int nal_size, uint8_t* buf, int size)
+{
+	int n = 0;
+	for (int i = 0; i < nal_size && n < size; i++)
+	{
+		if (nal[i] == 3 && i >= 2 && nal[i - 1] == 0 && nal[i - 2] == 0)
+		{
+			continue;
+		}
+		buf[n++] = nal[i];
+	}
+	return n;
+}
+
+// read n bits at the bit position pos, -1 when it runs out of data
+static int read_bits(const uint8_t* data, int size, int* pos, int n)
+{
+	int value = 0;
+	for (int i = 0; i < n; i++, (*pos)++)
+	{
+		if (*pos >= size * 8)
+		{
+			return -1;
+		}
+		value = (value << 1) | ((data[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+	}
+	return value;
+}
+
+// read an unsigned exp-Golomb code at the bit position pos, -1 when it runs out of data or is too long
+static int read_golomb(const uint8_t* data, int size, int* pos)
+{
+	int zeros = 0;
+	while (read_bits(data, size, pos, 1) == 0)
+	{
+		if (++zeros > 16)
+		{
+			return -1;
+		}
+	}
+
+	int value = read_bits(data, size, pos, zeros);
+	return *pos > size * 8 || value < 0 ? -1 : (1 << zeros) - 1 + value;
+}
+
+// find the next start code 0x000001 in [p, end)
+// @return	the start code, end when there is none
+static const uint8_t* find_start_code(const uint8_t* p, const uint8_t* end)
+{
+	for (; p + 2 < end; p++)
+	{
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+		{
+			return p;
+		}
+	}
+	return end;
+}
+
+// set up the NAL unit parsing of an H.264/H.265 stream
+// the NAL units of the packets are prefixed by their lengths when the extradata is avcC/hvcC, by start codes otherwise.
+// the parameter sets of Annex-B extradata are hashed as the ones before the first packet.
+// @param stream	the stream whose nal_length_size, param_sets and extra_slice_header_bits are set
+// @param par		the codec parameters of the stream
+void CircularBuffer::init_nal_stream(CircularBufferStream* stream, AVCodecParameters* par)
+{
+	stream->codecpar = par;
+	stream->nal_length_size = -1;
+	if (par->codec_id == AV_CODEC_ID_H264)
+	{
+		stream->nal_length_size = par->extradata_size >= 7 && par->extradata[0] == 1 ? (par->extradata[4] & 3) + 1 : 0;
+	}
+	else if (par->codec_id == AV_CODEC_ID_HEVC)
+	{
+		stream->nal_length_size = par->extradata_size >= 23 && par->extradata[0] == 1 ? (par->extradata[21] & 3) + 1 : 0;
+	}
+	memset(stream->param_sets, 0, sizeof(stream->param_sets));
+	stream->extra_slice_header_bits = 0;
+
+	if (stream->nal_length_size == 0 && par->extradata_size > 0)
+	{
+		AVPacket pkt;
+		av_init_packet(&pkt);
+		pkt.data = par->extradata;
+		pkt.size = par->extradata_size;
+		inspect_packet(&pkt, stream);
+	}
+}
+
+// get the parameter sets of an Annex-B packet, which come before its first slice
+// @param pkt		the packet carrying the parameter sets
+// @param stream	the stream of the packet
+// @param sets		gets the parameter sets, each with a 4 bytes start code
+// @return			the number of bytes of the parameter sets, negative for error code
+int CircularBuffer::get_parameter_sets(const AVPacket* pkt, CircularBufferStream* stream, std::vector<uint8_t>& sets)
+{
+	sets.clear();
+	if (stream->nal_length_size != 0 || !pkt->data)
+	{
+		return -1;
+	}
+
+	bool hevc = stream->codecpar->codec_id == AV_CODEC_ID_HEVC;
+	const uint8_t* end = pkt->data + pkt->size;
+	const uint8_t* nal = find_start_code(pkt->data, end);
+	while (nal < end)
+	{
+		nal += 3;
+		const uint8_t* next = find_start_code(nal, end);
+		int size = static_cast<int>(next - nal);
+		while (size > 0 && nal[size - 1] == 0)
+		{
+			size--;
+		}
+
+		if (size > 0)
+		{
+			int type = hevc ? (nal[0] >> 1) & 0x3F : nal[0] & 0x1F;
+			if (hevc ? type < 32 : type >= 1 && type <= 5)
+			{
+				break;
+			}
+			if (hevc ? type >= 32 && type <= 34 : type == 7 || type == 8)
+			{
+				static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+				sets.insert(sets.end(), start_code, start_code + 4);
+				sets.insert(sets.end(), nal, nal + size);
+			}
+		}
+		nal = next;
+	}
+
+	return static_cast<int>(sets.size());
+}
+
+// parse the NAL units of an H.264/H.265 packet, in Annex-B or AVCC/HVCC, without decoding
+// the parameter sets and the SEI come before the slices of a picture, so the parsing stops at the first slice,
+// whose header tells the frame type. The parameter sets are hashed per type to find their changes in the stream.
+// an IDR picture sets AV_PKT_FLAG_KEY too, for the cameras not flagging their key frames.
+// @param pkt		the packet to be inspected
+// @param stream	the stream of the packet, which keeps the hashes of its parameter sets
+// @return			the CIRCULAR_BUFFER_FLAG_* and CIRCULAR_BUFFER_FRAME_* tags of the packet, and AV_PKT_FLAG_KEY for an IDR
+int CircularBuffer::inspect_packet(const AVPacket* pkt, CircularBufferStream* stream)
+{
+	bool hevc = stream->codecpar->codec_id == AV_CODEC_ID_HEVC;
+	int header_size = hevc ? 2 : 1;
+	int flags = 0;
+	uint8_t buf[128];
+	const uint8_t* p = pkt->data;
+	const uint8_t* end = pkt->data + pkt->size;
+	while (p && p < end)
+	{
+		// locate the next NAL unit
+		const uint8_t* nal;
+		int size;
+		if (stream->nal_length_size > 0)
+		{
+			if (end - p < stream->nal_length_size)
+			{
+				break;
+			}
+			int64_t length = 0;
+			for (int i = 0; i < stream->nal_length_size; i++)
+			{
+				length = (length << 8) | p[i];
+			}
+			nal = p + stream->nal_length_size;
+			if (length > end - nal)
+			{
+				break;
+			}
+			size = static_cast<int>(length);
+			p = nal + size;
+		}
+		else
+		{
+			nal = find_start_code(p, end);
+			if (nal == end)
+			{
+				break;
+			}
+			nal += 3;
+			p = find_start_code(nal, end);
+			size = static_cast<int>(p - nal);
+			while (size > 0 && nal[size - 1] == 0)
+			{
+				size--; // the leading zero of the next 4 bytes start code
+			}
+		}
+
+		if (size <= header_size)
+		{
+			continue;
+		}
+
+		int type = hevc ? (nal[0] >> 1) & 0x3F : nal[0] & 0x1F;
+
+		// the parameter sets, hashed to be compared with the last ones of the same type
+		int ps = hevc ? (type >= 32 && type <= 34 ? type - 32 : -1) : (type == 7 || type == 8 ? type - 6 : -1);
+		if (ps >= 0)
+		{
+			uint32_t hash = 2166136261u; // FNV-1a
+			for (int i = 0; i < size; i++)
+			{
+				hash ^= nal[i];
+				hash *= 16777619u;
+			}
+			hash = hash ? hash : 1;
+
+			flags |= CIRCULAR_BUFFER_FLAG_PARAM_SETS;
+			if (stream->param_sets[ps] && stream->param_sets[ps] != hash)
+			{
+				flags |= CIRCULAR_BUFFER_FLAG_PARAM_CHANGE;
+			}
+			stream->param_sets[ps] = hash;
+
+			// the H.265 slice headers skip num_extra_slice_header_bits given by the PPS
+			if (hevc && type == 34)
+			{
+				int n = unescape_nal(nal + header_size, size - header_size, buf, sizeof(buf));
+				int pos = 0;
+				read_golomb(buf, n, &pos); // pps_pic_parameter_set_id
+				read_golomb(buf, n, &pos); // pps_seq_parameter_set_id
+				read_bits(buf, n, &pos, 2); // dependent_slice_segments_enabled_flag, output_flag_present_flag
+				int bits = read_bits(buf, n, &pos, 3);
+				stream->extra_slice_header_bits = bits > 0 ? bits : 0;
+			}
+			continue;
+		}
+
+		// the SEI messages, looking for a recovery point
+		if ((!hevc && type == 6) || (hevc && type == 39))
+		{
+			int n = unescape_nal(nal + header_size, size - header_size, buf, sizeof(buf));
+			int i = 0;
+			while (i < n && buf[i] != 0x80) // rbsp trailing bits
+			{
+				int payload_type = 0;
+				while (i < n && buf[i] == 0xFF)
+				{
+					payload_type += buf[i++];
+				}
+				int payload_size = 0;
+				if (i + 1 >= n)
+				{
+					break;
+				}
+				payload_type += buf[i++];
+				while (i < n && buf[i] == 0xFF)
+				{
+					payload_size += buf[i++];
+				}
+				if (i >= n)
+				{
+					break;
+				}
+				payload_size += buf[i++];
+
+				if (payload_type == 6)
+				{
+					flags |= CIRCULAR_BUFFER_FLAG_RECOVERY;
+					break;
+				}
+				i += payload_size;
+			}
+			continue;
+		}
+
+		// the first slice tells the picture
+		bool vcl = hevc ? type < 32 : type >= 1 && type <= 5;
+		if (!vcl)
+		{
+			continue;
+		}
+
+		int n = unescape_nal(nal + header_size, size - header_size, buf, 32);
+		int pos = 0;
+		int slice_type = -1;
+		if (hevc)
+		{
+			if (type >= 19 && type <= 20)
+			{
+				flags |= CIRCULAR_BUFFER_FLAG_IDR | AV_PKT_FLAG_KEY;
+			}
+			else if (type >= 16 && type <= 21)
+			{
+				flags |= CIRCULAR_BUFFER_FLAG_RECOVERY; // BLA or CRA
+			}
+
+			// slice_type is known only in the first slice segment of a picture
+			int first_slice = read_bits(buf, n, &pos, 1);
+			if (type >= 16 && type <= 23)
+			{
+				read_bits(buf, n, &pos, 1); // no_output_of_prior_pics_flag
+			}
+			read_golomb(buf, n, &pos); // slice_pic_parameter_set_id
+			if (first_slice == 1)
+			{
+				read_bits(buf, n, &pos, stream->extra_slice_header_bits);
+				slice_type = read_golomb(buf, n, &pos);
+				slice_type = slice_type == 2 ? 2 : slice_type == 1 ? 0 : slice_type == 0 ? 1 : -1; // to the order of H.264, P B I
+			}
+		}
+		else
+		{
+			if (type == 5)
+			{
+				flags |= CIRCULAR_BUFFER_FLAG_IDR | AV_PKT_FLAG_KEY;
+			}
+
+			read_golomb(buf, n, &pos); // first_mb_in_slice
+			slice_type = read_golomb(buf, n, &pos);
+			slice_type = slice_type < 0 ? -1 : slice_type % 5;
+			slice_type = slice_type == 3 ? 0 : slice_type == 4 ? 2 : slice_type; // SP as P, SI as I
+		}
+
+		if (slice_type == 0)
+		{
+			flags |= CIRCULAR_BUFFER_FRAME_P;
+		}
+		else if (slice_type == 1)
+		{
+			flags |= CIRCULAR_BUFFER_FRAME_B;
+		}
+		else if (slice_type == 2)
+		{
+			flags |= CIRCULAR_BUFFER_FRAME_I;
+		}
+		break;
+	}
+
+	return flags;
+}
+
+// store a packet in the packet list
+// only the writer calls it
+// the payload is copied into the arena when there is room, otherwise it is referenced
+// @param pktl	the empty packet list
+// @param pkt	the packet to be stored, it is left alone unless move is true
+// @param move	true to take over the packet, which is left blank
+// @return		0 on success, negative for error code
+int CircularBuffer::store_packet(AVPacketList* pktl, AVPacket* pkt, bool move)
+{
+	if (!m_arena)
+	{
+		if (move)
+		{
+			av_packet_move_ref(&pktl->pkt, pkt); // no new reference to allocate
+			return 0;
+		}
+		return av_packet_ref(&pktl->pkt, pkt);  // leave the pkt alone
+	}
+
+	// reclaim the regions whose payloads are no longer referenced, in the order they were written
+	while (m_region_tail < m_region_head && m_regions[m_region_tail & m_regions_mask].released.load(std::memory_order_acquire))
+	{
+		m_arena_tail = m_regions[m_region_tail & m_regions_mask].end;
+		m_region_tail++;
+	}
+
+	// the region is cache line aligned and padded as required by the decoders, and never wraps around the arena end
+	int64_t size = (static_cast<int64_t>(pkt->size) + AV_INPUT_BUFFER_PADDING_SIZE + 63) & ~static_cast<int64_t>(63);
+	int64_t start = m_arena_head;
+	if (start % m_arena_size + size > m_arena_size)
+	{
+		start += m_arena_size - start % m_arena_size;
+	}
+
+	if (m_region_head - m_region_tail > m_regions_mask || start + size - m_arena_tail > m_arena_size)
+	{
+		m_arena_misses.store(m_arena_misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (move)
+		{
+			av_packet_move_ref(&pktl->pkt, pkt);
+			return 0;
+		}
+		return av_packet_ref(&pktl->pkt, pkt);
+	}
+
+	CircularBufferRegion* region = &m_regions[m_region_head & m_regions_mask];
+	uint8_t* data = m_arena + start % m_arena_size;
+	AVBufferRef* buf = av_buffer_create(data, static_cast<int>(size), release_region, region, 0);
+	if (!buf)
+	{
+		return AVERROR(ENOMEM);
+	}
+
+	int ret = av_packet_copy_props(&pktl->pkt, pkt);
+	if (ret < 0)
+	{
+		av_buffer_unref(&buf);
+		return ret;
+	}
+
+	region->end = start + size;
+	region->released.store(0, std::memory_order_relaxed);
+	m_region_head++;
+	m_arena_head = start + size;
+
+	if (pkt->size > 0)
+	{
+		memcpy(data, pkt->data, pkt->size);
+	}
+	memset(data + pkt->size, 0, static_cast<size_t>(size - pkt->size));
+	pktl->pkt.buf = buf;
+	pktl->pkt.data = data;
+	pktl->pkt.size = pkt->size;
+	if (move)
+	{
+		av_packet_unref(pkt); // the payload is copied, the source is released at once
+	}
+
+	m_arena_hits.store(m_arena_hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	return 0;
+}
+
+// retry to release those packets that were deferred by readers
+void CircularBuffer::release_pending_packets()
+{
+	int n = 0;
+	for (int i = 0; i < m_nb_pending; i++)
+	{
+		if (!release_packet(m_pending[i]))
+		{
+			m_pending[n++] = m_pending[i];
+		}
+	}
+	m_nb_pending = n;
+}
+
+// evict the oldest packet from the circular buffer
+// only the writer calls it
+void CircularBuffer::evict_packet()
+{
+	int64_t seq = m_tail.load(std::memory_order_relaxed);
+	hold_back(seq);
+	CircularBufferPacketInfo* info = &m_info[seq & m_ring_mask];
+	bool thinned = (info->flags.load(std::memory_order_relaxed) & CIRCULAR_BUFFER_FLAG_THINNED) != 0;
+	AVPacketList* pktl = m_ring[seq & m_ring_mask];
+	if (!thinned)
+	{
+		CircularBufferStream* stream = &m_streams[info->stream];
+		m_total_packets--; // update the number of total packets
+		m_size -= pktl->pkt.size + static_cast<int>(sizeof(*pktl));  // update the size of the circular buffer
+		stream->packets.store(stream->packets.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		stream->size.store(stream->size.load(std::memory_order_relaxed) - pktl->pkt.size, std::memory_order_relaxed);
+	}
+
+	// spill the packet before evicting it, so that the readers find it in the file once it is gone from memory.
+	// a thinned packet is spilled as an empty record, the sequence numbers in the file have to be consecutive
+	if (m_spill && !m_black_box)
+	{
+		AVPacket hole;
+		av_init_packet(&hole);
+		hole.data = NULL;
+		hole.size = 0;
+		m_spill->append(seq, thinned ? &hole : &pktl->pkt, info->time, info->stream, info->flags.load(std::memory_order_relaxed));
+	}
+	m_tail.store(seq + 1); // sequential consistency pairs with the hazard of readers
+
+	// drop the key frame from the index, the entry may be overwritten afterwards
+	int64_t key_tail = m_key_tail.load(std::memory_order_relaxed);
+	if (key_tail < m_key_head.load(std::memory_order_relaxed) && m_keys[key_tail & m_ring_mask].seq.load(std::memory_order_relaxed) <= seq)
+	{
+		m_key_tail.store(key_tail + 1, std::memory_order_release);
+	}
+
+	// a thinned packet has been disposed on thinning
+	if (!thinned)
+	{
+		dispose_packet(seq);
+	}
+}
+
+// thin a packet out of the circular buffer
+// only the writer calls it. the slot stays in the ring until evicted, and the readers skip it.
+// @param seq	the sequence number of the packet, which is not evicted yet
+void CircularBuffer::thin_packet(int64_t seq)
+{
+	CircularBufferPacketInfo* info = &m_info[seq & m_ring_mask];
+	AVPacketList* pktl = m_ring[seq & m_ring_mask];
+	CircularBufferStream* stream = &m_streams[info->stream];
+
+	m_total_packets--;
+	m_size -= pktl->pkt.size + static_cast<int>(sizeof(*pktl));
+	stream->packets.store(stream->packets.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+	stream->size.store(stream->size.load(std::memory_order_relaxed) - pktl->pkt.size, std::memory_order_relaxed);
+	m_thinned.store(m_thinned.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	info->flags.store(info->flags.load(std::memory_order_relaxed) | CIRCULAR_BUFFER_FLAG_THINNED); // sequential consistency pairs with the hazard of readers
+	dispose_packet(seq);
+}
+
+// release the packet of specified sequence number, or defer it when it is being read
+// only the writer calls it
+// @param seq	the sequence number of the packet, which has been evicted or thinned out
+void CircularBuffer::dispose_packet(int64_t seq)
+{
+	// a reader holds at most one hazard, so there are hardly more pending packets than readers
+	while (!release_packet(seq))
+	{
+		if (m_nb_pending < CIRCULAR_BUFFER_MAX_READERS)
+		{
+			m_pending[m_nb_pending++] = seq;
+			break;
+		}
+		release_pending_packets();
+	}
+}
+
+// wait for the readers applying backpressure to read the packet of seq
+// only the writer calls it before evicting the packet.
+// the wait is bounded by the backpressure of each reader counted from the start of the wait in current push,
+// after which the reader falls behind and skips to the next key frame.
+// @param seq	the sequence number of the packet to be evicted
+void CircularBuffer::hold_back(int64_t seq)
+{
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		CircularBufferReader* reader = &m_readers[i];
+		if (reader->policy.load(std::memory_order_acquire) != CIRCULAR_BUFFER_POLICY_BACKPRESSURE || reader->state.load(std::memory_order_acquire) != 2 ||
+			reader->pos.load(std::memory_order_acquire) > seq)
+		{
+			continue;
+		}
+
+		int64_t now = av_gettime_relative();
+		if (!m_hold_start)
+		{
+			m_hold_start = now;
+		}
+
+		int64_t start = now;
+		int64_t deadline = m_hold_start + static_cast<int64_t>(reader->backpressure.load(std::memory_order_relaxed)) * 1000;
+		while (now < deadline && reader->pos.load(std::memory_order_acquire) <= seq && reader->state.load(std::memory_order_acquire) == 2)
+		{
+			Sleep(1);
+			now = av_gettime_relative();
+		}
+		reader->stalled.store(reader->stalled.load(std::memory_order_relaxed) + now - start, std::memory_order_relaxed);
+	}
+}
+
+// signal the events of those readers waiting for new packets
+// only the writer calls it after publishing new packets
+void CircularBuffer::notify_readers()
+{
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		// m_head has been published with sequential consistency before checking the flags.
+		// a reader either sees the new packet before sleeping, or its flag is seen here.
+		if (m_readers[i].waiting.load() && m_readers[i].waiting.exchange(0))
+		{
+			SetEvent(m_readers[i].event);
+		}
+	}
+}
+
+// release all the packets in the circular buffer
+void CircularBuffer::clear()
+{
+	if (!m_ring)
+	{
+		return;
+	}
+
+	for (int64_t seq = m_tail; seq < m_head; seq++)
+	{
+		AVPacketList* pktl = m_ring[seq & m_ring_mask];
+		m_ring[seq & m_ring_mask] = NULL;
+		if (pktl)
+		{
+			av_packet_unref(&pktl->pkt);
+			free_node(pktl);
+		}
+	}
+
+	for (int i = 0; i < m_nb_pending; i++)
+	{
+		AVPacketList* pktl = m_ring[m_pending[i] & m_ring_mask];
+		m_ring[m_pending[i] & m_ring_mask] = NULL;
+		if (pktl)
+		{
+			av_packet_unref(&pktl->pkt);
+			free_node(pktl);
+		}
+	}
+	m_nb_pending = 0;
+
+	m_tail = m_head.load();
+	m_key_tail = m_key_head.load();
+	m_total_packets = 0;
+	m_size = 0;
+	for (int i = 0; i < m_nb_streams; i++)
+	{
+		m_streams[i].packets = 0;
+		m_streams[i].size = 0;
+	}
+}
+
+// set the stream info
+// stream id is to indentify the stream index when push packet
+// stream time base is used to calculate the time span
+// stream codec parameters are also saved for furture usage
+// the circular buffer is cleared when a stream of the same index is added again
+// @param stream	the source stream
+// @return			0 on success, negative for error code
+int CircularBuffer::add_stream(AVStream* stream)
+{
+	// check the stream
+	if (!stream)
+	{
+		m_err = -1;
+		m_message = "Empty stream is not allowed.";
+		return m_err;
+	}
+
+	// a stream of the same index replaces the old one, otherwise it is appended
+	int n = 0;
+	while (n < m_nb_streams && m_streams[n].st->index != stream->index)
+	{
+		n++;
+	}
+
+	if (n >= CIRCULAR_BUFFER_MAX_STREAMS)
+	{
+		m_err = -2;
+		m_message = "no more than " + std::to_string(CIRCULAR_BUFFER_MAX_STREAMS) + " streams are allowed";
+		return m_err;
+	}
+
+	CircularBufferStream* cbs = &m_streams[n];
+	if (!cbs->st)
+	{
+		cbs->st = (AVStream*)av_mallocz(sizeof(AVStream));
+		cbs->codecpar = avcodec_parameters_alloc(); //must be allocated with avcodec_parameters_alloc() and freed with avcodec_parameters_free().
+		if (!cbs->st || !cbs->codecpar)
+		{
+			av_freep(&cbs->st);
+			avcodec_parameters_free(&cbs->codecpar);
+			m_err = -3;
+			m_message = "cannot allocate the stream";
+			return m_err;
+		}
+	}
+
+	// copy the codec parameters to local
+	m_err = avcodec_parameters_copy(cbs->codecpar, stream->codecpar);
+	if (m_err < 0)
+	{
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+
+	// copy a couple of important parameters to local stream
+	cbs->st->codecpar = cbs->codecpar; // store the same codec parameters in the local stream
+	cbs->st->index = stream->index;
+	cbs->st->time_base = stream->time_base;
+	cbs->st->start_time = stream->start_time;
+	cbs->st->r_frame_rate = stream->r_frame_rate;
+	cbs->st->avg_frame_rate = stream->avg_frame_rate;
+	cbs->st->sample_aspect_ratio = stream->sample_aspect_ratio;
+	cbs->first_pts = 0;
+
+	init_nal_stream(cbs, cbs->codecpar);
+
+	// clear the circular buffer in case the stream is changed
+	if (n < m_nb_streams)
+	{
+		clear();
+	}
+	else
+	{
+		cbs->packets = 0;
+		cbs->size = 0;
+		m_nb_streams++;
+	}
+
+	if (m_spill)
+	{
+		m_spill->set_stream(n, cbs->st);
+	}
+
+	// the first video stream is the primary one, whose key frames are indexed
+	if (m_primary < 0 || n == m_primary ||
+		(stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && m_streams[m_primary].codecpar->codec_type != AVMEDIA_TYPE_VIDEO))
+	{
+		if (m_primary != n)
+		{
+			clear(); // the key frame index is for the primary stream only
+		}
+		m_primary = n;
+		m_time_base = stream->time_base;
+	}
+
+	m_err = 0;
+	m_message = "";
+	return m_err;
+};
+
+// add all the video and audio streams of the input format context
+// @param fmt_ctx	the input format context whose embedded streams will be added
+// @return			0 on success, negative for error code
+int CircularBuffer::add_stream(AVFormatContext* fmt_ctx)
+{
+	for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++)
+	{
+		enum AVMediaType type = fmt_ctx->streams[i]->codecpar->codec_type;
+		if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+		{
+			continue;
+		}
+
+		if (add_stream(fmt_ctx->streams[i]) < 0)
+		{
+			m_message = "Not able to add stream [" + std::to_string(i) + "], " + m_message.str();
+			return m_err;
+		}
+	}
+
+	return m_err;
+}
+
+// get the order of the stream in the circular buffer
+// @param stream_index	the index of the source stream, -1 for the primary stream
+// @return				the order of the stream, negative when there is no such stream
+int CircularBuffer::find_stream(int stream_index)
+{
+	if (stream_index < 0)
+	{
+		return m_primary;
+	}
+
+	for (int i = 0; i < m_nb_streams; i++)
+	{
+		if (m_streams[i].st->index == stream_index)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// push a video or audio packet to the circular buffer
+// only one thread shall push packets to the circular buffer
+// 0 or positive return indicates the packet is added successfully. The number returned is the number of packets disposed from the circular buffer.
+// negative return indicates no packet is added due to an error. 
+// @param pkt	the packet to be pushed
+// @param move	true to take over the packet, which is left blank, instead of referencing it. A packet not added is left alone.
+int CircularBuffer::push_packet(AVPacket* pkt, bool move)
+{
+	int64_t head = m_head.load(std::memory_order_relaxed);
+	int disposed = m_total_packets;  // used to store original number of packets
+	m_hold_start = 0;
+
+	int ret = stage_packet(pkt, head, move);
+	if (ret < 0)
+	{
+		return ret;
+	}
+	publish_packets(head, head + 1);
+
+	disposed -= m_total_packets - 1; // calculate how many packets are disposed
+	m_err = disposed;
+	m_message = "Packet added";
+	return disposed;
+}
+
+// push many video or audio packets to the circular buffer
+// they are published to the readers together, with one notification, and the circular buffer is maintained once.
+// a packet that cannot be added is skipped, m_err and m_message tell the last failure.
+// @param pkts		the array of packets
+// @param nb_pkts	the number of packets in the array
+// @param move		true to take over the packets added, which are left blank, instead of referencing them
+// @return			the number of packets added, negative for error code when none is added
+int CircularBuffer::push_packets(AVPacket* pkts, int nb_pkts, bool move)
+{
+	int64_t head = m_head.load(std::memory_order_relaxed);
+	int64_t seq = head;
+	int added = 0;
+	int ret = -1;
+	m_hold_start = 0;
+	for (int i = 0; i < nb_pkts; i++)
+	{
+		ret = stage_packet(&pkts[i], seq, move);
+		if (ret < 0)
+		{
+			continue;
+		}
+		seq++;
+		added++;
+
+		// the ring is made room for a new packet by evicting published packets only, so publish every half ring
+		if (seq - head > m_ring_mask / 2)
+		{
+			publish_packets(head, seq);
+			head = seq;
+		}
+	}
+
+	if (seq > head)
+	{
+		publish_packets(head, seq);
+	}
+
+	if (!added)
+	{
+		return ret;
+	}
+
+	m_err = added;
+	m_message = "Packets added";
+	return added;
+}
+
+// stage a packet in the slot of sequence number seq, which is not visible to the readers until published
+// only the writer calls it
+// @param pkt	the packet to be referenced, or copied into the arena
+// @param seq	the sequence number of the packet
+// @param move	true to take over the packet instead of referencing it
+// @return		0 on success, negative for error code
+int CircularBuffer::stage_packet(AVPacket* pkt, int64_t seq, bool move)
+{
+	// empty packet is not allowed in the circular buffer
+	if (!pkt)
+	{
+		m_err = -1;
+		m_message = "packet unacceptable: empty";
+		return -1; // return number directly for multithread safe pupose, m_err is not safe
+	}
+
+	// packet of the stream not added is not accepted
+	int n = find_stream(pkt->stream_index);
+	if (n < 0 || pkt->stream_index < 0)
+	{
+		m_err = -2;
+		m_message = "packet unacceptable: stream index is different";
+		return -2; // return number directly for multithread safe pupose, m_err is not safe
+	}
+
+	// packet that cannot be reference is not allowed
+	if (av_packet_make_refcounted(pkt) < 0)
+	{
+		m_err = -3;
+		m_message = "packet unacceptable: cannot be referenced";
+		return -3;  // return number directly for multithread safe pupose, m_err is not safe
+	}
+
+	// packet that has no pts is not allowed
+	if (pkt->pts == AV_NOPTS_VALUE)
+	{
+		m_err = -4;
+		m_message = "packet unacceptable: has no valid pts";
+		return -4;  // return number directly for multithread safe pupose, m_err is not safe
+	}
+
+	// no packet can be added before the circular buffer is opened
+	if (!m_ring)
+	{
+		m_err = -7;
+		m_message = "circular buffer is not opened";
+		return -7;
+	}
+
+	// take a packet list from the pool, which is going to be returned when getting staled later
+	AVPacketList* pktl = alloc_node();
+	if (!pktl)
+	{
+		m_err = -5;
+		m_message = "cannot allocate new packet list";
+		return m_err;
+	}
+
+	// packet that is non monotonically increasing
+	CircularBufferStream* stream = &m_streams[n];
+	if (stream->first_pts == 0)
+	{
+		stream->first_pts = pkt->pts;
+	}
+
+	if (pkt->pts < stream->first_pts)
+	{
+		free_node(pktl);
+		m_err = -6;
+		m_message = "packet unacceptable: non monotonically increasing";
+		return -6; // return number directly for multithread safe pupose, m_err is not safe
+	}
+
+	// the payloads released by readers since are reclaimed before the arena is looked for room
+	release_pending_packets();
+
+	// add the packet to the queue
+	if (store_packet(pktl, pkt, move) < 0)
+	{
+		free_node(pktl);
+		m_err = -5;
+		m_message = "cannot store the packet";
+		return -5;
+	}
+	pktl->next = NULL;
+
+	// make room in the ring when it is full
+	release_pending_packets();
+	while (seq - m_tail.load(std::memory_order_relaxed) > m_ring_mask)
+	{
+		evict_packet();
+	}
+
+	// the slot may still be hold by a slow reader that is copying a packet evicted a whole ring ago
+	while (m_ring[seq & m_ring_mask])
+	{
+		std::this_thread::yield();
+		release_pending_packets();
+	}
+
+	// tag the packet by its NAL units, so that the key frame decisions downstream need no decoder.
+	// the tags are kept in the packet info, only an IDR marks the packet itself as a key frame
+	int tags = 0;
+	if (stream->nal_length_size >= 0)
+	{
+		tags = inspect_packet(&pktl->pkt, stream);
+		pktl->pkt.flags |= tags & AV_PKT_FLAG_KEY;
+	}
+
+	// the time of all streams is counted in microseconds as the common clock
+	CircularBufferPacketInfo* info = &m_info[seq & m_ring_mask];
+	info->time = av_rescale_q(pktl->pkt.pts, stream->st->time_base, AVRational{ 1, 1000000 });
+	info->stream = n;
+	info->flags = (pktl->pkt.flags & CIRCULAR_BUFFER_PACKET_FLAGS) | (tags & ~CIRCULAR_BUFFER_PACKET_FLAGS);
+
+	m_ring[seq & m_ring_mask] = pktl;
+	m_total_packets++;
+	m_size += pktl->pkt.size + static_cast<int>(sizeof(*pktl));
+	stream->packets.store(stream->packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	stream->size.store(stream->size.load(std::memory_order_relaxed) + pktl->pkt.size, std::memory_order_relaxed);
+	return 0;
+}
+
+// publish the staged packets of sequence number in [head, new_head) to the readers, and maintain the circular buffer
+// only the writer calls it
+// @param head		the sequence number of the first staged packet
+// @param new_head	the sequence number after the last staged packet
+void CircularBuffer::publish_packets(int64_t head, int64_t new_head)
+{
+	m_head.store(new_head); // sequential consistency pairs with the waiting flags of readers
+	for (int64_t seq = head; seq < new_head; seq++)
+	{
+		CircularBufferPacketInfo* info = &m_info[seq & m_ring_mask];
+		if (m_black_box)
+		{
+			m_spill->append(seq, &m_ring[seq & m_ring_mask]->pkt, info->time, info->stream, info->flags.load(std::memory_order_relaxed));
+		}
+		if (info->time > m_newest_time.load(std::memory_order_relaxed) || m_newest_time.load(std::memory_order_relaxed) == AV_NOPTS_VALUE)
+		{
+			m_newest_time.store(info->time, std::memory_order_relaxed);
+		}
+
+		// index the key frame of the primary stream, the index never overflows since it has as many entries as the ring
+		if (info->stream == m_primary && (info->flags.load(std::memory_order_relaxed) & AV_PKT_FLAG_KEY))
+		{
+			int64_t key_head = m_key_head.load(std::memory_order_relaxed);
+			m_keys[key_head & m_ring_mask].time.store(info->time, std::memory_order_relaxed);
+			m_keys[key_head & m_ring_mask].seq.store(seq, std::memory_order_release);
+			m_key_head.store(key_head + 1, std::memory_order_release);
+		}
+	}
+
+	// a buffer short of size asks the buffer manager to reclaim memory from the others, at most once a second
+	int64_t newest_time = m_newest_time.load(std::memory_order_relaxed);
+	BufferManager* manager = m_manager.load(std::memory_order_acquire);
+	if (manager && m_size > m_MaxSize && newest_time - m_rebalance_time >= 1000000)
+	{
+		m_rebalance_time = newest_time;
+		manager->rebalance(false);
+	}
+
+	int64_t newest = new_head - 1;
+
+	// maintain the circular buffer by kicking out those overflowed packets, the newest packet is always kept
+	int64_t allowed_time = m_newest_time.load(std::memory_order_relaxed) - static_cast<int64_t>(m_time_span) * 1000000;
+	if (m_tail.load(std::memory_order_relaxed) < newest &&
+		(m_info[m_tail.load(std::memory_order_relaxed) & m_ring_mask].time < allowed_time || m_size > m_MaxSize))
+	{
+		while (m_tail.load(std::memory_order_relaxed) < newest &&
+			(m_info[m_tail.load(std::memory_order_relaxed) & m_ring_mask].time < allowed_time || m_size > m_MaxSize))
+		{
+			evict_packet();
+		}
+
+		// evict the rest of the group of pictures, so that the oldest packet is a key frame again
+		int64_t key_tail = m_key_tail.load(std::memory_order_relaxed);
+		if (key_tail < m_key_head.load(std::memory_order_relaxed))
+		{
+			int64_t key = m_keys[key_tail & m_ring_mask].seq.load(std::memory_order_relaxed);
+			while (m_tail.load(std::memory_order_relaxed) < key)
+			{
+				evict_packet();
+			}
+		}
+	}
+
+	// thin out the packets older than the thinning age except the key frames of the primary stream
+	if (m_thin_age > 0)
+	{
+		int64_t thin_time = m_newest_time.load(std::memory_order_relaxed) - static_cast<int64_t>(m_thin_age) * 1000000;
+		if (m_thin_pos < m_tail.load(std::memory_order_relaxed))
+		{
+			m_thin_pos = m_tail.load(std::memory_order_relaxed);
+		}
+
+		while (m_thin_pos < newest && m_info[m_thin_pos & m_ring_mask].time < thin_time)
+		{
+			CircularBufferPacketInfo* thin = &m_info[m_thin_pos & m_ring_mask];
+			if (thin->stream != m_primary || !(thin->flags.load(std::memory_order_relaxed) & AV_PKT_FLAG_KEY))
+			{
+				thin_packet(m_thin_pos);
+			}
+			m_thin_pos++;
+		}
+	}
+
+	// the bitrate observed over the packets in the circular buffer
+	int64_t span = m_newest_time.load(std::memory_order_relaxed) - m_info[m_tail.load(std::memory_order_relaxed) & m_ring_mask].time;
+	if (span > 0)
+	{
+		m_bitrate.store(static_cast<int64_t>(m_size) * 1000000 / span, std::memory_order_relaxed);
+	}
+
+	// the readers behind the oldest packet catch up by themselves on next reading
+	notify_readers();
+}
+
+// read a packet using specified reader
+// a reader that fell behind under a policy other than CIRCULAR_BUFFER_POLICY_DROP skips to the next key frame,
+// so that what it reads afterwards can be decoded
+// @param reader	the reader whose position is going to be moved on success
+// @param pkt		the packet that gets a reference of the buffered packet
+// @return			(0 or 1) the number of packet is read
+int CircularBuffer::read_packet(CircularBufferReader* reader, AVPacket* pkt)
+{
+	while (true)
+	{
+		int ret = fetch_packet(reader, pkt);
+		if (ret <= 0 || !reader->resync)
+		{
+			return ret;
+		}
+
+		if (find_stream(pkt->stream_index) == m_primary && (pkt->flags & AV_PKT_FLAG_KEY))
+		{
+			reader->resync = false;
+			return ret;
+		}
+
+		av_packet_unref(pkt);
+		reader->dropped.store(reader->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+}
+
+// read the next packet using specified reader
+// @param reader	the reader whose position is going to be moved on success
+// @param pkt		the packet that gets a reference of the buffered packet
+// @return			(0 or 1) the number of packet is read
+int CircularBuffer::fetch_packet(CircularBufferReader* reader, AVPacket* pkt)
+{
+	int64_t pos = reader->pos.load(std::memory_order_relaxed);
+	while (true)
+	{
+		// the packets behind the oldest one have been evicted, read them from the spill file when they are still there
+		int64_t tail = m_tail.load(std::memory_order_acquire);
+		if (pos < tail && m_spill)
+		{
+			int flags = 0;
+			int ret = m_spill->read(pos, pkt, &flags);
+			if (ret > 0 && (flags & CIRCULAR_BUFFER_FLAG_THINNED))
+			{
+				av_packet_unref(pkt);
+				pos++;
+				continue;
+			}
+
+			if (ret > 0)
+			{
+				reader->flags.store(flags, std::memory_order_relaxed);
+				reader->pos.store(pos + 1, std::memory_order_relaxed);
+				return 1;
+			}
+
+			int64_t spill_tail = m_spill->get_tail();
+			int64_t next = spill_tail > pos && spill_tail < tail ? spill_tail : tail;
+			reader->dropped.store(reader->dropped.load(std::memory_order_relaxed) + next - pos, std::memory_order_relaxed);
+			reader->resync = reader->policy.load(std::memory_order_relaxed) != CIRCULAR_BUFFER_POLICY_DROP;
+			pos = next;
+			continue;
+		}
+
+		// jump to the oldest one, the packets in between are lost
+		if (pos < tail)
+		{
+			reader->dropped.store(reader->dropped.load(std::memory_order_relaxed) + tail - pos, std::memory_order_relaxed);
+			reader->resync = reader->policy.load(std::memory_order_relaxed) != CIRCULAR_BUFFER_POLICY_DROP;
+			pos = tail;
+		}
+
+		int64_t head = m_head.load(std::memory_order_acquire);
+		if (pos >= head)
+		{
+			reader->pos.store(pos, std::memory_order_relaxed);
+			return 0;
+		}
+
+		if (head - pos > reader->max_lag.load(std::memory_order_relaxed))
+		{
+			reader->max_lag.store(head - pos, std::memory_order_relaxed);
+		}
+
+		// claim the packet before touching it, then confirm it has not been evicted nor thinned out in between
+		reader->hazard.store(pos);
+		if (m_tail.load() <= pos)
+		{
+			if (!(m_info[pos & m_ring_mask].flags.load() & CIRCULAR_BUFFER_FLAG_THINNED))
+			{
+				break;
+			}
+			pos++;
+		}
+		reader->hazard.store(-1, std::memory_order_release);
+	}
+
+	av_packet_ref(pkt, &m_ring[pos & m_ring_mask]->pkt); // expose to the outside a copy of the packet
+	reader->flags.store(m_info[pos & m_ring_mask].flags.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	reader->hazard.store(-1, std::memory_order_release);
+	reader->pos.store(pos + 1, std::memory_order_relaxed);
+	return 1;
+}
+
+// read a packet out of the circular buffer.
+// read a packet using the background reader when isBackground is true
+// read a packet using the main reader when isBackground is false
+// return (0 or 1) indicates the number of packet is read. 
+int CircularBuffer::peek_packet(AVPacket* pkt, bool isBackground)
+{
+	m_err = read_packet(&m_readers[isBackground ? CIRCULAR_BUFFER_BACKGROUND_READER : CIRCULAR_BUFFER_MAIN_READER], pkt);
+	if (m_err > 0)
+	{
+		if (isBackground)
+		{
+			m_message = "packet read for background recording";
+		}
+		else
+		{
+			m_message = "packet read for main recording";
+		}
+		return m_err; // return the number of packets read
+	}
+
+	m_message = "no packet available to read at this moment";
+	return 0;
+};
+
+// get the time base of the circular buffer
+// @param stream_index	the index of the source stream, -1 for the primary stream
+AVRational CircularBuffer::get_time_base(int stream_index)
+{
+	m_err = 0;
+	m_message = "";
+
+	int n = find_stream(stream_index);
+	return n < 0 ? m_time_base : m_streams[n].st->time_base;
+};
+
+// get the size of the circular buffer
+int CircularBuffer::get_size()
+{
+	m_err = 0;
+	m_message = "";
+
+	return m_size;
+};
+
+// set the maximum size of the circular buffer
+// @param max_size	the maximum size in bytes, no more than the max_size on open
+void CircularBuffer::set_max_size(int max_size)
+{
+	m_MaxSize.store(max_size < 0 ? 0 : max_size > m_size_limit ? m_size_limit : max_size, std::memory_order_relaxed);
+}
+
+// get the maximum size of the circular buffer currently allowed
+int CircularBuffer::get_max_size()
+{
+	return m_MaxSize.load(std::memory_order_relaxed);
+}
+
+// get the bytes per second of the packets in the circular buffer
+int64_t CircularBuffer::get_bitrate()
+{
+	return m_bitrate.load(std::memory_order_relaxed);
+}
+
+// get the number of packets in the circular buffer
+int CircularBuffer::get_total_packets()
+{
+	return m_total_packets;
+}
+
+// get the codec parameters of the circular buffer
+// @param stream_index	the index of the source stream, -1 for the primary stream
+AVCodecParameters* CircularBuffer::get_stream_codecpar(int stream_index)
+{
+	m_err = 0;
+	m_message = "";
+
+	int n = find_stream(stream_index);
+	return n < 0 ? NULL : m_streams[n].codecpar;
+};
+
+// get the stream assigned to the circular buffer
+// @param stream_index	the index of the source stream, -1 for the primary stream
+AVStream* CircularBuffer::get_stream(int stream_index)
+{
+	int n = find_stream(stream_index);
+	return n < 0 ? NULL : m_streams[n].st;
+}
+
+// get the n-th stream added to the circular buffer
+AVStream* CircularBuffer::get_nth_stream(int n)
+{
+	return n >= 0 && n < m_nb_streams ? m_streams[n].st : NULL;
+}
+
+// get the number of streams in the circular buffer
+int CircularBuffer::get_nb_streams()
+{
+	return m_nb_streams;
+}
+
+// get the number of packets of specified stream in the circular buffer
+// @param stream_index	the index of the source stream
+// @return				the number of packets, negative when there is no such stream
+int64_t CircularBuffer::get_stream_packets(int stream_index)
+{
+	int n = find_stream(stream_index);
+	return n < 0 ? -1 : m_streams[n].packets.load(std::memory_order_relaxed);
+}
+
+// get the total size of packets of specified stream in the circular buffer
+// @param stream_index	the index of the source stream
+// @return				the size in bytes, negative when there is no such stream
+int64_t CircularBuffer::get_stream_size(int stream_index)
+{
+	int n = find_stream(stream_index);
+	return n < 0 ? -1 : m_streams[n].size.load(std::memory_order_relaxed);
+}
+
+// get the error message of last operation
+std::string CircularBuffer::get_error_message()
+{
+	return m_message;
+}
+
+// reset the main reader to the oldest key frame of the circular buffer
+void CircularBuffer::reset_main_reader()
+{
+	m_err = 0;
+	m_message = "";
+
+	reset_reader(CIRCULAR_BUFFER_MAIN_READER);
+}
+
+// register a named reader
+// @param name			the name of the reader, such as "preview", "snapshot" or "export"
+// @param from_oldest	true to start reading from the oldest packet, false to start from the next new packet
+// @return				the reader id (0 or positive) on success, negative for error code
+int CircularBuffer::add_reader(std::string name, bool from_oldest)
+{
+	if (name.empty())
+	{
+		m_err = -1;
+		m_message = "reader name cannot be empty";
+		return m_err;
+	}
+
+	// the name is checked and the reader is claimed under one lock, so that two threads cannot register the same name
+	std::lock_guard<std::mutex> lock(m_reader_mutex);
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		if (m_readers[i].state.load(std::memory_order_acquire) == 2 && m_readers[i].name == name)
+		{
+			m_err = -2;
+			m_message = "reader " + name + " has been registered";
+			return m_err;
+		}
+	}
+
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		// claim a free reader, it is not visible to others until it is fully set
+		int state = 0;
+		if (!m_readers[i].state.compare_exchange_strong(state, 1))
+		{
+			continue;
+		}
+
+		// the event is kept for the reader id once created
+		if (!m_readers[i].event)
+		{
+			m_readers[i].event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		}
+
+		m_readers[i].name = name;
+		m_readers[i].policy = CIRCULAR_BUFFER_POLICY_DROP;
+		m_readers[i].backpressure = 0;
+		m_readers[i].resync = false;
+		m_readers[i].dropped.store(0);
+		m_readers[i].stalled.store(0);
+		m_readers[i].max_lag.store(0);
+		m_readers[i].flags = 0;
+		m_readers[i].waiting.store(0);
+		m_readers[i].hazard.store(-1);
+		m_readers[i].pos.store(from_oldest ? m_tail.load() : m_head.load());
+		m_readers[i].state.store(2, std::memory_order_release);
+
+		m_err = i;
+		m_message = "reader " + name + " is registered";
+		return i;
+	}
+
+	m_err = -3;
+	m_message = "no more than " + std::to_string(CIRCULAR_BUFFER_MAX_READERS) + " readers are allowed";
+	return m_err;
+}
+
+// unregister a reader
+// @param reader	the reader id
+// @return			0 on success, negative for error code
+int CircularBuffer::remove_reader(int reader)
+{
+	std::lock_guard<std::mutex> lock(m_reader_mutex);
+	int state = 2;
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || !m_readers[reader].state.compare_exchange_strong(state, 1))
+	{
+		m_err = -1;
+		m_message = "invalid reader " + std::to_string(reader);
+		return m_err;
+	}
+
+	// the reader is no longer registered, but its hazard holds until it finishes copying the packet by itself
+	while (m_readers[reader].hazard.load(std::memory_order_acquire) != -1)
+	{
+		std::this_thread::yield();
+	}
+	m_readers[reader].waiting.store(0);
+	m_readers[reader].state.store(0, std::memory_order_release);
+
+	m_err = 0;
+	m_message = "reader " + m_readers[reader].name + " is removed";
+	return m_err;
+}
+
+// get the id of a registered reader by its name
+// @param name	the name of the reader
+// @return		the reader id, negative when no such reader
+int CircularBuffer::get_reader(std::string name)
+{
+	std::lock_guard<std::mutex> lock(m_reader_mutex);
+	for (int i = 0; i < CIRCULAR_BUFFER_MAX_READERS; i++)
+	{
+		if (m_readers[i].state.load(std::memory_order_acquire) == 2 && m_readers[i].name == name)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// read a packet using specified reader
+// @param reader	the reader id
+// @param pkt		the packet that gets a reference of the buffered packet
+// @return			(0 or 1) the number of packet is read, negative for error code
+int CircularBuffer::read_packet(int reader, AVPacket* pkt)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	return read_packet(&m_readers[reader], pkt);
+}
+
+// read the packets available right now using specified reader
+// the reader is validated once for the whole array, a recorder waking up after a stall drains its lag in a few calls
+// @param reader	the reader id
+// @param pkts		the array of packets that get the references of the buffered packets
+// @param max_n		the maximum number of packets to read
+// @return			the number of packets read, negative for error code
+int CircularBuffer::peek_packets(int reader, AVPacket* pkts, int max_n)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	int n = 0;
+	while (n < max_n && read_packet(&m_readers[reader], &pkts[n]) > 0)
+	{
+		n++;
+	}
+	return n;
+}
+
+// read a packet using specified reader, sleep until a new packet is pushed when there is nothing to read
+// @param reader	the reader id
+// @param pkt		the packet that gets a reference of the buffered packet
+// @param timeout	the maximum time to wait in milliseconds, 0 for not waiting
+// @return			(0 or 1) the number of packet is read, negative for error code
+int CircularBuffer::wait_packet(int reader, AVPacket* pkt, int timeout)
+{
+	int ret = read_packet(reader, pkt);
+	if (ret || timeout <= 0)
+	{
+		return ret;
+	}
+
+	int64_t deadline = av_gettime_relative() + static_cast<int64_t>(timeout) * 1000;
+	while (true)
+	{
+		// arm before checking again, so that a packet pushed in between is not missed.
+		// the lag may be made of packets thinned out or skipped to resync only, then it waits on till the timeout
+		ret = arm_reader(reader);
+		if (ret > 0)
+		{
+			ret = read_packet(reader, pkt);
+			if (ret)
+			{
+				m_readers[reader].waiting.store(0, std::memory_order_relaxed);
+				return ret;
+			}
+			continue;
+		}
+
+		int64_t remaining = (deadline - av_gettime_relative()) / 1000;
+		if (ret < 0 || remaining <= 0)
+		{
+			m_readers[reader].waiting.store(0, std::memory_order_relaxed);
+			return ret < 0 ? ret : 0;
+		}
+
+		if (WaitForSingleObject(m_readers[reader].event, static_cast<DWORD>(remaining)) != WAIT_OBJECT_0)
+		{
+			m_readers[reader].waiting.store(0, std::memory_order_relaxed);
+			return read_packet(reader, pkt);
+		}
+
+		// the event may be left signaled by an earlier arming, check again
+		ret = read_packet(reader, pkt);
+		if (ret)
+		{
+			return ret;
+		}
+	}
+}
+
+// request the reader's event to be signaled on the next new packet
+// @param reader	the reader id
+// @return			the number of packets available to read right now, negative for error code
+int CircularBuffer::arm_reader(int reader)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	if (!m_readers[reader].event)
+	{
+		return -2;
+	}
+
+	m_readers[reader].waiting.store(1);
+	return get_lag(reader);
+}
+
+// get the auto reset event HANDLE of specified reader
+// @param reader	the reader id
+// @return			the event HANDLE, NULL for invalid reader
+void* CircularBuffer::get_reader_event(int reader)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return NULL;
+	}
+
+	return m_readers[reader].event;
+}
+
+// set the policy of specified reader when it falls behind the oldest packet
+// @param reader		the reader id
+// @param policy		one of CIRCULAR_BUFFER_POLICY_*
+// @param backpressure	the maximum milliseconds the writer waits for the reader in one push, for CIRCULAR_BUFFER_POLICY_BACKPRESSURE
+// @return				0 on success, negative for error code
+int CircularBuffer::set_reader_policy(int reader, int policy, int backpressure)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	if (policy < CIRCULAR_BUFFER_POLICY_DROP || policy > CIRCULAR_BUFFER_POLICY_BACKPRESSURE || backpressure < 0)
+	{
+		return -2;
+	}
+
+	// the writer reads the backpressure after the policy, so the backpressure is released by the policy
+	m_readers[reader].backpressure.store(backpressure, std::memory_order_relaxed);
+	m_readers[reader].policy.store(policy, std::memory_order_release);
+	return 0;
+}
+
+// get the number of packets specified reader missed or skipped by falling behind
+// @param reader	the reader id
+// @return			the number of packets, negative for error code
+int64_t CircularBuffer::get_reader_dropped(int reader)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	return m_readers[reader].dropped.load(std::memory_order_relaxed);
+}
+
+// get the flags of the last packet read by specified reader
+// @param reader	the reader id
+// @return			AV_PKT_FLAG_* and the CIRCULAR_BUFFER_FLAG_* / CIRCULAR_BUFFER_FRAME_* tags, negative for error code
+int CircularBuffer::get_packet_flags(int reader)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	return m_readers[reader].flags.load(std::memory_order_relaxed);
+}
+
+// get the time the writer waited for specified reader
+// @param reader	the reader id
+// @return			the time in milliseconds, negative for error code
+int64_t CircularBuffer::get_reader_stalled(int reader)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	return m_readers[reader].stalled.load(std::memory_order_relaxed) / 1000;
+}
+
+// get the maximum number of packets specified reader has been behind the newest packet
+// @param reader	the reader id
+// @return			the number of packets, negative for error code
+int64_t CircularBuffer::get_reader_max_lag(int reader)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	return m_readers[reader].max_lag.load(std::memory_order_relaxed);
+}
+
+// reset specified reader to the oldest key frame in the circular buffer
+// the reader is reset to the oldest packet when there is no key frame
+// @param reader	the reader id
+// @return			0 on success, negative for error code
+int CircularBuffer::reset_reader(int reader)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	int64_t seq = find_key_frame(INT64_MIN);
+	m_readers[reader].pos.store(seq < 0 ? m_tail.load(std::memory_order_acquire) : seq, std::memory_order_relaxed);
+	return 0;
+}
+
+// find the sequence number of the last key frame at or before specified time
+// it can be called by any reader while the writer is pushing
+// @param time	the time in microseconds, the oldest key frame is found when all key frames are after it
+// @return		the sequence number of the key frame, negative when there is no key frame in the circular buffer
+int64_t CircularBuffer::find_key_frame(int64_t time)
+{
+	if (!m_keys)
+	{
+		return -1;
+	}
+
+	while (true)
+	{
+		// the entries in [lo, hi) are not overwritten as long as the tail of the index stays at lo
+		int64_t lo = m_key_tail.load(std::memory_order_acquire);
+		int64_t hi = m_key_head.load(std::memory_order_acquire);
+		if (lo >= hi)
+		{
+			return m_spill ? m_spill->find_key_frame(time, m_primary) : -1;
+		}
+
+		// binary search for the first key frame after time, the one before it is the answer
+		int64_t first = lo;
+		int64_t count = hi - lo;
+		while (count > 0)
+		{
+			int64_t step = count / 2;
+			if (m_keys[(first + step) & m_ring_mask].time.load(std::memory_order_relaxed) <= time)
+			{
+				first += step + 1;
+				count -= step + 1;
+			}
+			else
+			{
+				count = step;
+			}
+		}
+		int64_t seq = m_keys[(first > lo ? first - 1 : lo) & m_ring_mask].seq.load(std::memory_order_relaxed);
+
+		// the search read a torn index when the writer dropped an entry meanwhile, search again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_key_tail.load(std::memory_order_relaxed) != lo)
+		{
+			continue;
+		}
+
+		// all key frames in memory are after time, look for the one in the spill file
+		if (first == lo && m_spill)
+		{
+			int64_t spilled = m_spill->find_key_frame(time, m_primary);
+			if (spilled >= 0)
+			{
+				return spilled;
+			}
+		}
+		return seq;
+	}
+}
+
+// position specified reader at the last key frame at or before pts
+// @param reader	the reader id
+// @param pts		the pts in the primary stream time base
+// @return			0 on success, negative for error code
+int CircularBuffer::seek_reader(int reader, int64_t pts)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	int64_t seq = find_key_frame(av_rescale_q(pts, m_time_base, AVRational{ 1, 1000000 }));
+	if (seq < 0)
+	{
+		return -2;
+	}
+
+	m_readers[reader].pos.store(seq, std::memory_order_relaxed);
+	return 0;
+}
+
+// position specified reader at the last key frame at or before the newest packet minus pre_roll milliseconds
+// @param reader	the reader id
+// @param pre_roll	the pre-roll in milliseconds
+// @return			0 on success, negative for error code
+int CircularBuffer::rewind_reader(int reader, int pre_roll)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	int64_t time = m_newest_time.load(std::memory_order_relaxed);
+	int64_t seq = time == AV_NOPTS_VALUE ? -1 : find_key_frame(time - static_cast<int64_t>(pre_roll) * 1000);
+	if (seq < 0)
+	{
+		return -2;
+	}
+
+	m_readers[reader].pos.store(seq, std::memory_order_relaxed);
+	return 0;
+}
+
+// get the number of packets specified reader is behind the newest packet
+// @param reader	the reader id
+// @return			number of packets not read yet, negative for error code
+int CircularBuffer::get_lag(int reader)
+{
+	if (reader < 0 || reader >= CIRCULAR_BUFFER_MAX_READERS || m_readers[reader].state.load(std::memory_order_acquire) != 2)
+	{
+		return -1;
+	}
+
+	// m_head is loaded with sequential consistency to pair with the arming of the reader
+	int64_t tail = m_tail.load(std::memory_order_acquire);
+	if (m_spill)
+	{
+		int64_t spill_tail = m_spill->get_tail();
+		tail = spill_tail < tail && m_spill->get_head() >= tail ? spill_tail : tail;
+	}
+	int64_t pos = m_readers[reader].pos.load(std::memory_order_relaxed);
+	return static_cast<int>(m_head.load() - (pos > tail ? pos : tail));
+}
+
+// spill the packets evicted from memory to a mapped ring in a file
+// as a black box, every packet is written to the file on pushing, at the cost of a copy of the payload.
+// the file of the last run can be recovered by MappedRing::recover before it is overwritten here.
+// @param filename	the file to be created, an existing one is overwritten
+// @param size		the size of the file in bytes
+// @param black_box	true to write every packet on pushing, false to write the packets on evicting
+// @return			0 on success, negative for error code
+int CircularBuffer::open_spill(std::string filename, int64_t size, bool black_box)
+{
+	MappedRing* spill = new MappedRing();
+	m_err = spill->open(filename, size);
+	if (m_err < 0)
+	{
+		m_message = spill->get_error_message();
+		delete spill;
+		return m_err;
+	}
+
+	// the codec parameters are saved in the file together with the packets
+	for (int i = 0; i < m_nb_streams; i++)
+	{
+		spill->set_stream(i, m_streams[i].st);
+	}
+
+	delete m_spill;
+	m_spill = spill;
+	m_black_box = black_box;
+	m_message = (black_box ? "packets are written to " : "evicted packets are spilled to ") + filename;
+	return m_err;
+}
+
+// publish every pushed packet to a mapped ring in the named shared memory
+// it works the same as the black box of open_spill, except that the ring is in the paging file.
+// the readers of other processes attach to the name read only, a crashed reader never affects the writer.
+// @param name	the name of the shared memory, such as "Local\\ipcam_1"
+// @param size	the size of the shared memory in bytes
+// @return		0 on success, negative for error code
+int CircularBuffer::open_shared(std::string name, int64_t size)
+{
+	MappedRing* spill = new MappedRing();
+	m_err = spill->share(name, size);
+	if (m_err < 0)
+	{
+		m_message = spill->get_error_message();
+		delete spill;
+		return m_err;
+	}
+
+	for (int i = 0; i < m_nb_streams; i++)
+	{
+		spill->set_stream(i, m_streams[i].st);
+	}
+
+	delete m_spill;
+	m_spill = spill;
+	m_black_box = true;
+	m_message = "packets are shared in " + name;
+	return m_err;
+}
+
+// keep only the key frames of the primary stream in the packets older than thin_age seconds
+// only the writer calls it, or it is called before pushing packets
+// @param thin_age	the age in seconds, 0 to keep all packets
+void CircularBuffer::set_thinning(int thin_age)
+{
+	m_thin_age = thin_age > 0 ? thin_age : 0;
+}
+
+// get the number of packets thinned out of the circular buffer
+int64_t CircularBuffer::get_thinned_packets()
+{
+	return m_thinned.load(std::memory_order_relaxed);
+}
+
+// get the mapped ring the evicted packets are spilled to
+MappedRing* CircularBuffer::get_spill()
+{
+	return m_spill;
+}
+
+// export the clip between start_time and end_time to a file
+// the packets in the circular buffer are referenced right here, which keeps their payloads alive after eviction.
+// it takes no lock, the references are as cheap as those of the readers.
+// a registered reader follows the packets pushed afterwards, until the first one after end_time.
+// @param filename		the file to be saved
+// @param start_time	the start of the clip in milliseconds of the wall clock
+// @param end_time		the end of the clip in milliseconds of the wall clock
+// @return				the export id, negative for error code
+int CircularBuffer::export_clip(std::string filename, int64_t start_time, int64_t end_time)
+{
+	if (end_time <= start_time || !m_nb_streams)
+	{
+		m_err = -1;
+		m_message = "invalid clip to export";
+		return m_err;
+	}
+
+	int id = 0;
+	int state = 0;
+	while (id < CIRCULAR_BUFFER_MAX_EXPORTS && !m_exports[id].state.compare_exchange_strong(state, 1))
+	{
+		state = 0;
+		id++;
+	}
+
+	if (id >= CIRCULAR_BUFFER_MAX_EXPORTS)
+	{
+		m_err = -2;
+		m_message = "no more than " + std::to_string(CIRCULAR_BUFFER_MAX_EXPORTS) + " exports are allowed";
+		return m_err;
+	}
+
+	CircularBufferExport* ex = &m_exports[id];
+	ex->reader = add_reader("export " + std::to_string(id) + " " + filename);
+	if (ex->reader < 0)
+	{
+		ex->state.store(0);
+		return m_err;
+	}
+
+	// start from the key frame, or from the oldest packet when there is no key frame
+	int64_t seq = find_key_frame(start_time * 1000);
+	if (seq >= 0)
+	{
+		m_readers[ex->reader].pos.store(seq, std::memory_order_relaxed);
+	}
+
+	ex->abort.store(false);
+	ex->packets.store(0);
+	ex->bytes.store(0);
+	ex->time.store(AV_NOPTS_VALUE);
+	ex->finished.store(0);
+	ex->start_time = AV_NOPTS_VALUE;
+	ex->end_time = end_time * 1000;
+	ex->started = av_gettime_relative();
+	ex->filename = filename;
+	ex->message = "";
+
+	// pin the packets in the circular buffer
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = NULL;
+	pkt.size = 0;
+	while (read_packet(ex->reader, &pkt) > 0)
+	{
+		int n = find_stream(pkt.stream_index);
+		int64_t time = n < 0 ? AV_NOPTS_VALUE : av_rescale_q(pkt.pts, m_streams[n].st->time_base, AVRational{ 1, 1000000 });
+		if (ex->start_time == AV_NOPTS_VALUE)
+		{
+			ex->start_time = time;
+		}
+
+		if (time != AV_NOPTS_VALUE && time > ex->end_time)
+		{
+			// the clip is all in the circular buffer, the reader is not needed any more
+			av_packet_unref(&pkt);
+			remove_reader(ex->reader);
+			ex->reader = -1;
+			break;
+		}
+
+		AVPacket* pinned = av_packet_alloc();
+		if (!pinned)
+		{
+			av_packet_unref(&pkt);
+			continue;
+		}
+		av_packet_move_ref(pinned, &pkt);
+		ex->pinned.push_back(pinned);
+	}
+
+	ex->worker = std::thread(&CircularBuffer::export_worker, this, ex);
+
+	m_err = id;
+	m_message = "exporting " + std::to_string(ex->pinned.size()) + " packets pinned to " + filename;
+	return id;
+}
+
+// remux the packets of an export to its file
+// @param ex	the export
+void CircularBuffer::export_worker(CircularBufferExport* ex)
+{
+	Muxer muxer;
+	int err = muxer.add_stream(this);
+	if (err >= 0)
+	{
+		err = muxer.open(ex->filename);
+	}
+
+	if (err < 0)
+	{
+		ex->message = muxer.get_error_message();
+	}
+
+	// the pinned packets first, then the packets pushed after the export started
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = NULL;
+	pkt.size = 0;
+	size_t i = 0;
+	while (err >= 0 && !ex->abort.load(std::memory_order_relaxed))
+	{
+		if (i < ex->pinned.size())
+		{
+			av_packet_move_ref(&pkt, ex->pinned[i]);
+			av_packet_free(&ex->pinned[i++]);
+		}
+		else if (ex->reader < 0)
+		{
+			break;
+		}
+		else
+		{
+			int ret = wait_packet(ex->reader, &pkt, 100);
+			if (ret <= 0)
+			{
+				err = ret;
+				continue;
+			}
+		}
+
+		int n = find_stream(pkt.stream_index);
+		int64_t time = n < 0 ? AV_NOPTS_VALUE : av_rescale_q(pkt.pts, m_streams[n].st->time_base, AVRational{ 1, 1000000 });
+		if (time != AV_NOPTS_VALUE && time > ex->end_time)
+		{
+			av_packet_unref(&pkt);
+			break;
+		}
+
+		if (ex->start_time == AV_NOPTS_VALUE)
+		{
+			ex->start_time = time;
+		}
+
+		int size = pkt.size;
+		if (n < 0 || muxer.record(&pkt, n) < 0)
+		{
+			av_packet_unref(&pkt);
+			continue;
+		}
+
+		ex->bytes.store(ex->bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+		ex->time.store(time, std::memory_order_relaxed);
+		ex->packets.store(ex->packets.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// unpin what is left on abort or error
+	for (; i < ex->pinned.size(); i++)
+	{
+		av_packet_free(&ex->pinned[i]);
+	}
+	ex->pinned.clear();
+
+	if (ex->reader >= 0)
+	{
+		remove_reader(ex->reader);
+		ex->reader = -1;
+	}
+
+	if (ex->packets.load(std::memory_order_relaxed) > 0)
+	{
+		int ret = muxer.close();
+		if (err >= 0 && ret < 0)
+		{
+			err = ret;
+			ex->message = muxer.get_error_message();
+		}
+	}
+	else if (err >= 0)
+	{
+		err = -3;
+		ex->message = "no packet in the clip";
+	}
+
+	ex->finished.store(av_gettime_relative(), std::memory_order_relaxed);
+	ex->state.store(err < 0 ? err : 2, std::memory_order_release);
+}
+
+// get the progress of specified export
+// @param id	the export id
+// @return		0 to 100 in percentage, negative for the error code of a failed export
+int CircularBuffer::get_export_progress(int id)
+{
+	if (id < 0 || id >= CIRCULAR_BUFFER_MAX_EXPORTS || !m_exports[id].state.load(std::memory_order_acquire))
+	{
+		return -1;
+	}
+
+	CircularBufferExport* ex = &m_exports[id];
+	int state = ex->state.load(std::memory_order_acquire);
+	if (state != 1)
+	{
+		return state < 0 ? state : 100;
+	}
+
+	int64_t time = ex->time.load(std::memory_order_relaxed);
+	if (time == AV_NOPTS_VALUE || ex->start_time == AV_NOPTS_VALUE || ex->end_time <= ex->start_time)
+	{
+		return 0;
+	}
+
+	int64_t progress = (time - ex->start_time) * 100 / (ex->end_time - ex->start_time);
+	return static_cast<int>(progress < 0 ? 0 : progress > 99 ? 99 : progress);
+}
+
+// get the throughput of specified export
+// @param id	the export id
+// @return		the payload bytes written per second, 0 for invalid export
+double CircularBuffer::get_export_throughput(int id)
+{
+	if (id < 0 || id >= CIRCULAR_BUFFER_MAX_EXPORTS || !m_exports[id].state.load(std::memory_order_acquire))
+	{
+		return 0;
+	}
+
+	CircularBufferExport* ex = &m_exports[id];
+	int64_t finished = ex->finished.load(std::memory_order_relaxed);
+	int64_t elapsed = (finished ? finished : av_gettime_relative()) - ex->started;
+	return elapsed > 0 ? ex->bytes.load(std::memory_order_relaxed) * 1000000.0 / elapsed : 0;
+}
+
+// wait for specified export to be done and free it
+// @param id		the export id
+// @param abort		true to stop the export before the end of the clip
+// @return			the number of packets exported, negative for error code
+int CircularBuffer::join_export(int id, bool abort)
+{
+	if (id < 0 || id >= CIRCULAR_BUFFER_MAX_EXPORTS || !m_exports[id].worker.joinable())
+	{
+		m_err = -1;
+		m_message = "invalid export " + std::to_string(id);
+		return m_err;
+	}
+
+	CircularBufferExport* ex = &m_exports[id];
+	if (abort)
+	{
+		ex->abort.store(true);
+	}
+	ex->worker.join();
+
+	int state = ex->state.load(std::memory_order_acquire);
+	m_err = state < 0 ? state : static_cast<int>(ex->packets.load(std::memory_order_relaxed));
+	m_message = state < 0 ? ex->message : std::to_string(m_err) + " packets are exported to " + ex->filename;
+	ex->state.store(0, std::memory_order_release);
+	return m_err;
+}
+
+// get the number of packet lists taken from the preallocated pool
+int64_t CircularBuffer::get_pool_hits()
+{
+	return m_pool_hits.load(std::memory_order_relaxed);
+}
+
+// get the number of packet lists allocated from the heap because the pool was exhausted
+// it stays 0 as long as the pool is sized properly
+int64_t CircularBuffer::get_pool_misses()
+{
+	return m_pool_misses.load(std::memory_order_relaxed);
+}
+
+// get the number of packet payloads copied into the arena
+int64_t CircularBuffer::get_arena_hits()
+{
+	return m_arena_hits.load(std::memory_order_relaxed);
+}
+
+// get the number of packet payloads referenced outside the arena because the arena had no room
+// the payloads kept by slow readers or by the muxer interleaving queue hold their regions in the arena
+int64_t CircularBuffer::get_arena_misses()
+{
+	return m_arena_misses.load(std::memory_order_relaxed);
+}
+
+// get the capacity of the ring, that is the maximum number of packets can be held
+int CircularBuffer::get_capacity()
+{
+	return static_cast<int>(m_ring ? m_ring_mask + 1 : 0);
+}
+
+BufferManager::BufferManager()
+{
+	m_budget = 0;
+	m_err = 0;
+	m_message = "";
+}
+
+BufferManager::~BufferManager()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_buffers.size(); i++)
+	{
+		m_buffers[i]->m_manager.store(NULL);
+		m_buffers[i]->set_max_size(m_buffers[i]->m_size_limit);
+	}
+}
+
+// set the global budget shared by the circular buffers
+// @param budget	the budget in bytes
+void BufferManager::open(int64_t budget)
+{
+	m_budget.store(budget > 0 ? budget : 0);
+	rebalance();
+}
+
+// add a circular buffer sharing the budget
+// the buffer shall have been opened, whose max_size on open is the most it can be granted
+// @param cbuf		the circular buffer
+// @param weight	the priority weight, positive
+// @return			0 on success, negative for error code
+int BufferManager::add_buffer(CircularBuffer* cbuf, int weight)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!cbuf || weight <= 0)
+		{
+			m_err = -1;
+			m_message = "invalid circular buffer or weight";
+			return m_err;
+		}
+
+		BufferManager* manager = NULL;
+		if (!cbuf->m_manager.compare_exchange_strong(manager, this))
+		{
+			m_err = -2;
+			m_message = "the circular buffer is shared by a buffer manager already";
+			return m_err;
+		}
+
+		m_buffers.push_back(cbuf);
+		m_weights.push_back(weight);
+	}
+
+	return rebalance();
+}
+
+// remove a circular buffer
+// @param cbuf	the circular buffer
+// @return		0 on success, negative for error code
+int BufferManager::remove_buffer(CircularBuffer* cbuf)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t i = 0;
+		while (i < m_buffers.size() && m_buffers[i] != cbuf)
+		{
+			i++;
+		}
+
+		if (i >= m_buffers.size())
+		{
+			m_err = -1;
+			m_message = "the circular buffer is not managed";
+			return m_err;
+		}
+
+		m_buffers.erase(m_buffers.begin() + i);
+		m_weights.erase(m_weights.begin() + i);
+		cbuf->m_manager.store(NULL);
+		cbuf->set_max_size(cbuf->m_size_limit);
+	}
+
+	return rebalance();
+}
+
+// set the priority weight of a circular buffer
+// @param cbuf		the circular buffer
+// @param weight	the priority weight, positive
+// @return			0 on success, negative for error code
+int BufferManager::set_weight(CircularBuffer* cbuf, int weight)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t i = 0;
+		while (i < m_buffers.size() && m_buffers[i] != cbuf)
+		{
+			i++;
+		}
+
+		if (i >= m_buffers.size() || weight <= 0)
+		{
+			m_err = -1;
+			m_message = "the circular buffer is not managed or the weight is invalid";
+			return m_err;
+		}
+		m_weights[i] = weight;
+	}
+
+	return rebalance();
+}
+
+// hand out the budget again
+// every buffer demands its bitrate over its time span with a quarter more for headroom, no more than its max_size on open.
+// the budget is filled up by the weights, the buffers demanding less than their weighted share get what they demand,
+// and the rest of the budget is split among the others by the weights.
+// a buffer whose bitrate is not known yet demands its max_size on open.
+// @param wait	false to return at once when another thread is rebalancing, as the writers of the buffers do
+// @return		0 on success, 1 when skipped, negative for error code
+int BufferManager::rebalance(bool wait)
+{
+	std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+	if (wait)
+	{
+		lock.lock();
+	}
+	else if (!lock.try_lock())
+	{
+		return 1;
+	}
+
+	if (m_budget.load() <= 0)
+	{
+		m_err = -1;
+		m_message = "the budget is not set";
+		return m_err;
+	}
+
+	size_t n = m_buffers.size();
+	std::vector<int64_t> demands(n);
+	std::vector<int64_t> caps(n, -1);
+	for (size_t i = 0; i < n; i++)
+	{
+		CircularBuffer* cbuf = m_buffers[i];
+		int64_t bitrate = cbuf->m_bitrate.load(std::memory_order_relaxed);
+		int64_t demand = bitrate > 0 && cbuf->m_time_span > 0 ? bitrate * cbuf->m_time_span * 5 / 4 : cbuf->m_size_limit;
+		demands[i] = demand < cbuf->m_size_limit ? demand : cbuf->m_size_limit;
+	}
+
+	// water filling by the weights
+	int64_t remaining = m_budget.load();
+	while (true)
+	{
+		int64_t weights = 0;
+		for (size_t i = 0; i < n; i++)
+		{
+			weights += caps[i] < 0 ? m_weights[i] : 0;
+		}
+
+		if (!weights)
+		{
+			break;
+		}
+
+		bool settled = false;
+		int64_t pool = remaining;
+		for (size_t i = 0; i < n; i++)
+		{
+			if (caps[i] < 0 && demands[i] <= pool * m_weights[i] / weights)
+			{
+				caps[i] = demands[i];
+				remaining -= demands[i];
+				settled = true;
+			}
+		}
+
+		if (!settled)
+		{
+			for (size_t i = 0; i < n; i++)
+			{
+				if (caps[i] < 0)
+				{
+					caps[i] = pool * m_weights[i] / weights;
+				}
+			}
+			break;
+		}
+	}
+
+	// the writers evict the packets over the new sizes on their next push
+	for (size_t i = 0; i < n; i++)
+	{
+		m_buffers[i]->set_max_size(static_cast<int>(caps[i] < INT_MAX ? caps[i] : INT_MAX));
+	}
+
+	m_err = 0;
+	m_message = std::to_string(n) + " circular buffers share the budget of " + std::to_string(m_budget.load()) + " bytes";
+	return m_err;
+}
+
+// get the global budget in bytes
+int64_t BufferManager::get_budget()
+{
+	return m_budget.load();
+}
+
+// get the total size of the circular buffers in bytes
+int64_t BufferManager::get_used()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	int64_t used = 0;
+	for (size_t i = 0; i < m_buffers.size(); i++)
+	{
+		used += m_buffers[i]->m_size.load(std::memory_order_relaxed);
+	}
+	return used;
+}
+
+// get the error message of last operation
+std::string BufferManager::get_error_message()
+{
+	return m_message;
+}
+
+Muxer::Muxer()
+{
+	m_url = "";
+	m_ofmt_Ctx = NULL;
+	m_options = NULL;
+	m_index_video = -1;
+	m_index_audio = -1;
+	m_flag_interleaved = true;
+	m_flag_wclk = true;
+	m_tbf_video = AVRational{ 1,2 };
+	m_tbf_audio = AVRational{ 1,3 };
+	m_time_base_audio = AVRational{ 1,4 };
+	m_time_base_video = AVRational{ 1,5 };
+	m_pts_offset_video = 0;
+	m_pts_offset_audio = 0;
+	m_defalt_duration_audio = 0;
+	m_defalt_duration_video = 0;
+	m_err = 0;
+	m_message = "";
+	m_chunk_time = 0; // chunk indicator
+	m_chunk_interval = 0;
+	m_chunk_prefix = "";
+	m_format = "mp4";
+	m_flag_async = false;
+	m_async_queue = MUXER_ASYNC_QUEUE;
+	m_head = 0;
+	m_tail = 0;
+	m_stop = false;
+	m_queued_event = NULL;
+	m_written_event = NULL;
+	m_skip_to_key = false;
+	m_async_err = 0;
+	m_async_chunked = false;
+	m_chunks = 0;
+	m_max_depth = 0;
+	m_written = 0;
+	m_latency = 0;
+	m_max_latency = 0;
+	m_dropped = 0;
+	m_flag_preopen = true;
+	m_next = MuxerSegment{ NULL, "", 0, false };
+	m_next_time = 0;
+	m_segment_stop = false;
+	m_segment_event = NULL;
+	m_segment_err = 0;
+	m_segment_message = "";
+	m_preopened = 0;
+	m_max_chunk_time = 0;
+	m_chunk_overshoot = MUXER_CHUNK_OVERSHOOT;
+	m_chunk_start = AV_NOPTS_VALUE;
+	m_chunk_end = 0;
+	m_flag_wclk_pts = false;
+	m_clock_offset = AV_NOPTS_VALUE;
+	m_chunk_requested = false;
+	m_chunk_request_time = AV_NOPTS_VALUE;
+	m_chunk_duration = 0;
+	m_max_chunk_duration = 0;
+	m_max_overshoot = 0;
+	m_forced_chunks = 0;
+}
+
+Muxer::~Muxer()
+{
+	stop_writer();
+	stop_segments();
+	for (size_t i = 0; i < m_queue.size(); i++)
+	{
+		av_packet_free(&m_queue[i].pkt);
+	}
+	if (m_queued_event)
+	{
+		CloseHandle(m_queued_event);
+	}
+	if (m_written_event)
+	{
+		CloseHandle(m_written_event);
+	}
+	if (m_segment_event)
+	{
+		CloseHandle(m_segment_event);
+	}
+
+	avformat_free_context(m_ofmt_Ctx);
+	av_dict_free(&m_options);
+}
+
+int Muxer::set_options(std::string option, std::string value)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (option == "wall_clock")
+	{
+		if (value == "false")
+		{
+			m_flag_wclk = false;
+
+			m_err = 0;
+			m_message = "'wall clock alignment' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_wclk = true;
+
+			m_err = 0;
+			m_message = "'wall clock alignment' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'wall clock alignment' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "wall_clock_pts")
+	{
+		if (value == "false")
+		{
+			m_flag_wclk_pts = false;
+
+			m_err = 0;
+			m_message = "'wall clock time stamps' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_wclk_pts = true;
+
+			m_err = 0;
+			m_message = "'wall clock time stamps' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'wall clock time stamps' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "interleaved_write")
+	{
+		if (value == "false")
+		{
+			m_flag_interleaved = false;
+
+			m_err = 0;
+			m_message = "'interleaved writting' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_interleaved = true;
+
+			m_err = 0;
+			m_message = "'interleaved writting' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'interleaved writting' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "async")
+	{
+		if (value == "false")
+		{
+			m_flag_async = false;
+
+			m_err = 0;
+			m_message = "'async' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_async = true;
+
+			m_err = 0;
+			m_message = "'async' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'async' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "preopen")
+	{
+		if (value == "false")
+		{
+			m_flag_preopen = false;
+
+			m_err = 0;
+			m_message = "'preopen' flag is set to false";
+		}
+		else if (value == "true")
+		{
+			m_flag_preopen = true;
+
+			m_err = 0;
+			m_message = "'preopen' flag is set to true";
+		}
+		else
+		{
+			m_message = "unkown value of '" + value + "' for 'preopen' flag setting.";
+			m_err = -1;
+		}
+		return m_err;
+	}
+
+	if (option == "chunk_overshoot")
+	{
+		int overshoot = atoi(value.c_str());
+		if (overshoot < 0 || overshoot > 3600000)
+		{
+			m_err = -1;
+			m_message = "'chunk_overshoot' setting shall be [0-3600000]";
+		}
+		else
+		{
+			m_chunk_overshoot = overshoot;
+			m_message = "'chunk_overshoot' option is set to be " + value + "ms";
+			m_err = 0;
+		}
+		return m_err;
+	}
+
+	if (option == "async_queue")
+	{
+		int queue = atoi(value.c_str());
+		if (queue < 1 || queue > 65536)
+		{
+			m_err = -1;
+			m_message = "'async_queue' setting shall be [1-65536]";
+		}
+		else
+		{
+			m_async_queue = queue;
+			m_message = "'async_queue' option is set to be " + value + " packets";
+			m_err = 0;
+		}
+		return m_err;
+	}
+
+	if (option == "format")
+	{
+		if (value.length() < 1 || value.length() > 10)
+		{
+			m_format = "mp4";
+
+			m_err = -1;
+			m_message = value + " is invalid for 'file format' option setting";
+		}
+		else
+		{
+			m_format = value;
+			m_message = "'file format' option is set to be " + value;
+			m_err = 0;
+		}
+
+		return m_err;
+	}
+	return av_dict_set(&m_options, option.c_str(), value.c_str(), 0);
+}
+
+// add a stream to the muxer
+// @param stream	stream to be added. The time base, codec parameters are used
+// @return			stream id in muxer. 0 or positive on success, negative for error code
+int Muxer::add_stream(AVStream* stream)
+{
+	m_err = 0;
+	m_message = "";
+
+	// return an error code when no stream can be found
+	if (!stream)
+	{
+		m_err = -1;
+		m_message = "Error. Empty stream cannot be added";
+		return m_err;
+	}
+
+	// Create a new format context for the output container format if it is empty
+	if (!m_ofmt_Ctx)
+	{
+		//m_err = avformat_alloc_output_context2(&m_ofmt_Ctx, NULL, "mp4", NULL);
+		m_err = avformat_alloc_output_context2(&m_ofmt_Ctx, NULL, m_format.c_str(), NULL);
+		if (m_err < 0)
+		{
+			//m_message = "Error. Could not allocate output format context.";
+			m_message.assign(av_err(m_err));
+			return m_err;
+		}
+	}
+
+	//m_ifmt_Ctx = ifmt_Ctx;
+	AVStream* out_stream = avformat_new_stream(m_ofmt_Ctx, NULL);
+	if (!out_stream)
+	{
+		m_err = -2;
+		m_message = "Error. Failed allocating output stream.";
+		return m_err;
+	}
+
+	m_err = avcodec_parameters_copy(out_stream->codecpar, stream->codecpar);
+	if (m_err < 0)
+	{
+		m_err = -3;
+		//m_message = "Error. Failed to copy the stream codec parameters.";
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+
+	out_stream->id = m_ofmt_Ctx->nb_streams - 1;
+	out_stream->codecpar->codec_tag = 0;
+
+	if (out_stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+	{
+		m_index_video = out_stream->id;
+		m_time_base_video = stream->time_base;
+		m_video_stream = out_stream;
+	}
+	else if (out_stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+	{
+		m_index_audio = out_stream->id;
+		m_time_base_audio = stream->time_base;
+		m_audio_stream = out_stream;
+	}
+
+	m_message = "stream is added to the recorder";
+	return out_stream->id;
+}
+
+// add streams from the circular buffer
+// @param circular_buffer	the circular buffer whose embedded streams will be added in the order they were added to it.
+// @return					stream id in muxer of the last stream added. 0 or positive on success, negative for error code
+int Muxer::add_stream(CircularBuffer* circular_buffer)
+{
+	m_err = -1;
+	m_message = "Error. No stream in the circular buffer";
+	for (int i = 0; i < circular_buffer->get_nb_streams(); i++)
+	{
+		m_err = add_stream(circular_buffer->get_nth_stream(i));
+		if (m_err < 0)
+		{
+			m_message = "Not able to add stream [" + std::to_string(i) + "]";
+			return m_err;
+		}
+	}
+
+	return m_err;
+}
+
+// add streams from the input format context
+// @param fmt_ctx	the input format context whose embedded streams will be added.
+// @return			stream id in muxer. 0 or positive on success, negative for error code
+int Muxer::add_stream(AVFormatContext* fmt_ctx)
+{
+	unsigned int i;
+	for (i = 0; i < fmt_ctx->nb_streams; i++)
+	{
+		m_err = add_stream(fmt_ctx->streams[i]);
+		if (m_err < 0)
+		{
+			m_message = "Not able to add stream [" + std::to_string(i) + "]";
+			return m_err;
+		}
+	}
+
+	return m_err;
+}
+
+// open a new muxer
+// @param url				can be a filename, rtsp, rtp, or other valid url
+// @param chunk_interval	the muxer (video file) will be automatically chunked every chunk_interval seconds
+// @return					0 on success, negative for error code
+int Muxer::open(std::string url, int chunk_interval)
+{
+	stop_writer();
+	stop_segments();
+
+	if (url.empty())
+	{
+		m_err = -1;
+		m_message = "url cannot be empty";
+		return m_err;
+	}
+
+	// validate the input chunk interval
+	if (chunk_interval < 0 || chunk_interval > 3600)
+	{
+		m_err = -1;
+		m_message = "'chunk interval' setting shall be [0-3600]";
+		return m_err;
+	}
+
+	// positive chunk interval indicates segmentally recording, url is considered to be the file prefix of segmental files
+	if (chunk_interval > 0)
+	{
+		m_chunk_prefix = url;
+		m_chunk_interval = chunk_interval * 1000;  // convert the interval into miliseconds
+		m_message = "chunked recording is set to be " + m_chunk_prefix + "yyyy-MM-dd-hhmmss" + m_chunk_prefix;
+	}
+	else
+	{
+		m_url = url;  // url is the full path of the recording video file
+		m_chunk_interval = 0;
+		m_chunk_prefix = "";
+		m_message = "normal recording";
+	}
+
+	m_chunk_time = 0;
+	m_clock_offset = AV_NOPTS_VALUE;
+	m_err = chunk_interval > 0 ? chunk_file() : open_file();
+	if (m_err)
+	{
+		return m_err;
+	}
+
+	// the segment thread opens the segments from the streams of the first one, which it closes later
+	if (chunk_interval > 0 && m_flag_preopen)
+	{
+		for (unsigned int i = 0; i < m_ofmt_Ctx->nb_streams; i++)
+		{
+			AVCodecParameters* par = avcodec_parameters_alloc();
+			if (par)
+			{
+				m_segment_params.push_back(par);
+			}
+			if (!par || avcodec_parameters_copy(par, m_ofmt_Ctx->streams[i]->codecpar) < 0)
+			{
+				for (size_t j = 0; j < m_segment_params.size(); j++)
+				{
+					avcodec_parameters_free(&m_segment_params[j]);
+				}
+				m_segment_params.clear();
+				m_err = AVERROR(ENOMEM);
+				m_message = "Error. Failed to copy the streams for the segments.";
+				return m_err;
+			}
+		}
+
+		if (!m_segment_event)
+		{
+			m_segment_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		}
+		m_next_time = m_chunk_time;
+		m_segmenter = std::thread(&Muxer::prepare, this);
+	}
+
+	if (!m_flag_async)
+	{
+		return m_err;
+	}
+
+	// the queue is allocated once, its packets are reused by all the recordings
+	size_t size = static_cast<size_t>(m_async_queue) + MUXER_ASYNC_CONTROL;
+	if (m_queue.size() != size)
+	{
+		for (size_t i = 0; i < m_queue.size(); i++)
+		{
+			av_packet_free(&m_queue[i].pkt);
+		}
+		m_queue.resize(size);
+		for (size_t i = 0; i < size; i++)
+		{
+			m_queue[i].pkt = av_packet_alloc();
+			if (!m_queue[i].pkt)
+			{
+				m_err = AVERROR(ENOMEM);
+				m_message = "Error. Failed to allocate the queue of the writer thread.";
+				return m_err;
+			}
+		}
+	}
+
+	if (!m_queued_event)
+	{
+		m_queued_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		m_written_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+
+	m_head = 0;
+	m_tail = 0;
+	m_stop = false;
+	m_skip_to_key = false;
+	m_async_err = 0;
+	m_async_chunked = false;
+	set_async_message();
+	m_writer = std::thread(&Muxer::write, this);
+
+	return m_err;
+}
+
+// make another chunked recording
+// a chunked recording gets chunked at the next video key frame recorded, where record() returns 1
+// an async muxer queues the chunk to its writer thread, whose errors are returned by the next record()
+// @return 0 on success, negative for error code
+int Muxer::chunk()
+{
+	if (m_writer.joinable())
+	{
+		queue_command(MUXER_COMMAND_CHUNK, NULL, 0);
+		return 0;
+	}
+
+	if (m_chunk_time)
+	{
+		m_chunk_requested = true;
+		return 0;
+	}
+
+	return chunk_file();
+}
+
+// make another chunked recording in the calling thread
+// first stop current recording in case there is one. Then start another recording by chunk prefix.
+// @param due	the chunk is made for the chunk time, which the next chunk time follows by the chunk interval
+// @return 0 on success, negative for error code
+int Muxer::chunk_file(bool due)
+{
+	// to check the chunk setting
+	if (m_chunk_prefix.empty() || !m_chunk_interval)
+	{
+		m_err = -1;
+		m_message = "Invalid chunk settings.";
+		return m_err;
+	}
+
+	// with the segment thread running, the recording only switches to another segment
+	if (m_chunk_time && m_segmenter.joinable())
+	{
+		return switch_segment(due);
+	}
+
+	// uses m_chunk_time as an indicateor of first recording
+	if (m_chunk_time)
+	{
+		m_err = close_file();
+
+		if (m_err)
+		{
+			return m_err;
+		}
+	}
+
+	m_chunk_time = get_next_chunk_time(due);
+
+	// file name is set as <prefix><yyyy-MM-dd-hhmmss>.<ext>
+	m_url = m_chunk_prefix + get_date_time() + "." + m_format;
+	m_chunks++;
+
+	return open_file();
+}
+
+// open the recording file specified by m_url and write the header
+// @return 0 on success, negative for error code
+int Muxer::open_file()
+{
+	// try to solve the 
+	AVStream* st;
+	for (int i = 0; static_cast <unsigned int>(i) < m_ofmt_Ctx->nb_streams; i++)
+	{
+		st = m_ofmt_Ctx->streams[i];
+		//m_ofmt_Ctx->streams[i]->start_time = AV_NOPTS_VALUE;
+		//m_ofmt_Ctx->streams[i]->duration = AV_NOPTS_VALUE;
+		//m_ofmt_Ctx->streams[i]->first_dts = AV_NOPTS_VALUE;
+		//m_ofmt_Ctx->streams[i]->cur_dts = AV_NOPTS_VALUE;
+		st->start_time = AV_NOPTS_VALUE;
+		st->duration = static_cast<int64_t>(m_chunk_interval) * 90;
+		st->first_dts = AV_NOPTS_VALUE;
+		st->cur_dts = 0;
+	}
+	m_ofmt_Ctx->output_ts_offset = 0;
+
+	if (!(m_ofmt_Ctx->oformat->flags & AVFMT_NOFILE))
+	{
+		m_err = avio_open(&m_ofmt_Ctx->pb, m_url.c_str(), AVIO_FLAG_WRITE);
+		if (m_err < 0)
+		{
+			m_message.assign(av_err(m_err));
+			m_message = "Could not open " + m_url + " with error " + m_message.str();
+			return m_err;
+		}
+	}
+	else
+	{
+		m_err = -1;
+		m_message = "Error: Previous recording is not closed.";
+		return m_err;
+	}
+
+	// the options are given to every recording, the header takes those it uses out of the dictionary
+	AVDictionary* options = NULL;
+	av_dict_copy(&options, m_options, 0);
+	m_err = avformat_write_header(m_ofmt_Ctx, &options);
+	av_dict_free(&options);
+	if (m_err < 0)
+	{
+		m_message.assign(av_err(m_err));
+		m_message += " Could not open " + m_url;
+		return m_err;
+	}
+
+	m_message = m_url + " is openned with return code " + std::to_string(m_err);
+	m_err = 0;
+
+	reset_time_stamps();
+	return m_err;
+}
+
+// update the time base factors and the offsets of the time stamps to the output streams of a new recording
+void Muxer::reset_time_stamps()
+{
+	// update the time base factors used to rescale the time stamps of input packets to the output stream
+	m_tbf_audio = m_time_base_audio;
+	m_tbf_video = m_time_base_video;
+	m_defalt_duration_audio = 440;
+	m_defalt_duration_video = 3000;
+
+	if (m_index_audio >= 0)
+	{
+		m_tbf_audio.den *= m_ofmt_Ctx->streams[m_index_audio]->time_base.num;
+		m_tbf_audio.num *= m_ofmt_Ctx->streams[m_index_audio]->time_base.den;
+		m_defalt_duration_audio = m_ofmt_Ctx->streams[m_index_audio]->time_base.den / m_ofmt_Ctx->streams[m_index_audio]->time_base.num / 44000;
+	}
+
+	if (m_index_video >= 0)
+	{
+		m_tbf_video.den *= m_ofmt_Ctx->streams[m_index_video]->time_base.num;
+		m_tbf_video.num *= m_ofmt_Ctx->streams[m_index_video]->time_base.den;
+		m_defalt_duration_video = m_ofmt_Ctx->streams[m_index_video]->time_base.den / m_ofmt_Ctx->streams[m_index_video]->time_base.num / 30;
+	}
+	m_pts_offset_audio = 0;
+	m_pts_offset_video = 0;
+	m_chunk_start = AV_NOPTS_VALUE;
+	m_chunk_requested = false;
+	m_chunk_request_time = AV_NOPTS_VALUE;
+}
+
+// write one frame/packet in the muxer
+// an async muxer takes the packet over to its writer thread, or drops it when the queue is full
+// @param pkt			the packet that going to be written
+// @param stream_index	the tream index of the muxer
+// @return				0 on success, negative for error, 1 for chunked, 2 for dropped
+int Muxer::record(AVPacket* pkt, int stream_index)
+{
+	if (!m_writer.joinable())
+	{
+		return write_packet(pkt, stream_index);
+	}
+
+	if (pkt->pts == AV_NOPTS_VALUE || pkt->size == 0)
+	{
+		int err = pkt->size ? -1 : -2;
+		std::lock_guard<std::mutex> lock(m_async_mutex);
+		m_async_message = err == -1 ? "packet unacceptable: has no valid pts" : "packet unacceptable: empty";
+
+		av_packet_unref(pkt);
+		return err;
+	}
+
+	// take the error and the chunk of the writer thread since last call
+	int err = m_async_err.exchange(0);
+	int ret = m_async_chunked.exchange(false) ? 1 : 0;
+
+	// once a packet is dropped, drop the rest of its GOP too rather than record a broken one
+	if (m_skip_to_key && m_index_video >= 0 && (stream_index != m_index_video || !(pkt->flags & AV_PKT_FLAG_KEY)))
+	{
+		ret = 2;
+	}
+	else if (queue_command(MUXER_COMMAND_PACKET, pkt, stream_index) < 0)
+	{
+		m_skip_to_key = true;
+		ret = 2;
+	}
+	else
+	{
+		m_skip_to_key = false;
+	}
+
+	if (ret == 2)
+	{
+		m_dropped++;
+		av_packet_unref(pkt);
+	}
+
+	return err < 0 ? err : ret;
+}
+
+// write one frame/packet in the muxer in the calling thread
+// @param pkt			the packet that going to be written
+// @param stream_index	the tream index of the muxer
+// @return				0 on success, negative for error, 1 for chunked
+int Muxer::write_packet(AVPacket* pkt, int stream_index)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (pkt->pts == AV_NOPTS_VALUE)
+	{
+		m_err = -1;
+		m_message = "packet unacceptable: has no valid pts";
+
+		av_packet_unref(pkt);
+		return m_err;
+	}
+
+	if (pkt->dts == AV_NOPTS_VALUE)
+	{
+		pkt->dts = pkt->pts;
+	}
+
+	if (pkt->size == 0)
+	{
+		m_err = -2;
+		m_message = "packet unacceptable: empty";
+
+		av_packet_unref(pkt);
+		return m_err;
+	}
+
+	// get chunked at the first video key frame at or after the chunk time or the chunk() call, which starts the next chunk,
+	// or at any video packet once the chunk has run over by the chunk overshoot. The chunk time is taken to
+	// the time of the packets by the clock offset of the recording, 0 for the time stamps in the wall clock.
+	int chunked = 0;
+	if (m_chunk_time)
+	{
+		int64_t t = av_rescale_q(pkt->pts, stream_index == m_index_audio ? m_time_base_audio : m_time_base_video, AV_TIME_BASE_Q);
+		bool video = m_index_video < 0 || stream_index == m_index_video;
+		if (video && m_chunk_requested && m_chunk_request_time == AV_NOPTS_VALUE)
+		{
+			m_chunk_request_time = t;
+		}
+
+		int64_t from = m_chunk_request_time != AV_NOPTS_VALUE ? m_chunk_request_time
+			: m_chunk_start != AV_NOPTS_VALUE && t >= m_chunk_end ? m_chunk_end : AV_NOPTS_VALUE;
+		if (video && from != AV_NOPTS_VALUE)
+		{
+			bool key = m_index_video < 0 || (pkt->flags & AV_PKT_FLAG_KEY);
+			if (key || t - from >= static_cast<int64_t>(m_chunk_overshoot) * 1000)
+			{
+				int64_t duration = t - m_chunk_start;
+				m_chunk_duration = duration;
+				if (duration > m_max_chunk_duration)
+				{
+					m_max_chunk_duration = duration;
+				}
+				if (t - from > m_max_overshoot)
+				{
+					m_max_overshoot = t - from;
+				}
+				if (!key)
+				{
+					m_forced_chunks++;
+				}
+
+				// the packet goes to no file when getting chunked failed, the current one may have got its trailer
+				m_err = chunk_file(!m_chunk_requested);
+				if (m_err < 0)
+				{
+					av_packet_unref(pkt);
+					m_message = "Could not get chunked. " + m_message.str();
+					return m_err;
+				}
+				chunked = 1; // indicates get chunked
+			}
+		}
+
+		if (m_chunk_start == AV_NOPTS_VALUE)
+		{
+			if (m_clock_offset == AV_NOPTS_VALUE)
+			{
+				m_clock_offset = m_flag_wclk_pts ? 0 : av_gettime() - t;
+			}
+			m_chunk_start = t;
+			m_chunk_end = m_chunk_time * 1000 - m_clock_offset;
+		}
+	}
+
+	// rescale the time stamp to the output stream
+	if (stream_index == m_index_audio)
+	{
+		pkt->pts *= m_tbf_audio.num / m_tbf_audio.den;
+		pkt->dts *= m_tbf_audio.num / m_tbf_audio.den;
+
+		if (pkt->duration)
+		{
+			pkt->duration *= m_tbf_audio.num / m_tbf_audio.den;
+		}
+		else
+		{
+			pkt->duration = m_defalt_duration_audio;
+		}
+
+		if (m_pts_offset_audio == 0)
+		{
+			m_pts_offset_audio = -pkt->pts;
+		}
+		pkt->pts += m_pts_offset_audio;
+		pkt->dts += m_pts_offset_audio;
+	}
+	else if (stream_index == m_index_video)
+	{
+		pkt->pts *= m_tbf_video.num / m_tbf_video.den;
+		pkt->dts *= m_tbf_video.num / m_tbf_video.den;
+		if (pkt->duration)
+		{
+			pkt->duration *= m_tbf_video.num / m_tbf_video.den;
+		}
+		else
+		{
+			pkt->duration = m_defalt_duration_video;
+		}
+
+		if (m_pts_offset_video == 0)
+		{
+			m_pts_offset_video = -pkt->pts;
+		}
+		pkt->pts += m_pts_offset_video;
+		pkt->dts += m_pts_offset_video;
+	}
+
+	pkt->stream_index = stream_index;
+	pkt->pos = -1;
+
+	// check the interleaved flag
+	if (m_flag_interleaved)
+	{
+		m_err = av_interleaved_write_frame(m_ofmt_Ctx, pkt); // interleaved write will handle the packet unref
+	}
+	else
+	{
+		m_err = av_write_frame(m_ofmt_Ctx, pkt);
+	}
+	av_packet_unref(pkt);
+
+	if (m_err)
+	{
+		m_message.set_error(m_err);
+		return m_err;
+	}
+	m_message = "packet written";
+
+	m_err = chunked;
+	return m_err;
+}
+
+// close the recording
+// an async muxer waits for its writer thread to write all the packets queued before,
+// a chunked recording waits for its segment thread to close the segments before
+// @return 0 on success, negative for error code
+int Muxer::close()
+{
+	// the error of the writer thread is taken once it has written all the packets queued
+	stop_writer();
+	int err = m_async_err.exchange(0);
+	int ret = close_file();
+	if (ret >= 0 && err < 0)
+	{
+		// report the message of the writer thread, not the one of closing the file
+		std::lock_guard<std::mutex> lock(m_async_mutex);
+		m_message = m_async_message;
+	}
+
+	// the segments before are closed by the segment thread
+	stop_segments();
+	if (ret >= 0 && m_segment_err < 0)
+	{
+		std::lock_guard<std::mutex> lock(m_segment_mutex);
+		err = m_segment_err.exchange(0);
+		m_message = m_segment_message;
+	}
+
+	return ret < 0 ? ret : err;
+}
+
+// close the recording in the calling thread
+// @return 0 on success, negative for error code
+int Muxer::close_file()
+{
+	// no close when no file is opened
+	if (m_ofmt_Ctx->oformat->flags & AVFMT_NOFILE)
+		return -1;
+
+	m_err = av_write_trailer(m_ofmt_Ctx);
+	if (m_err < 0)
+	{
+		m_message.assign(av_err(m_err));
+		return m_err;
+	}
+
+	avio_closep(&m_ofmt_Ctx->pb);
+
+	m_message = m_url + " is closed.";
+	return m_err;
+}
+
+// get the stream codec parameter
+AVFormatContext* Muxer::get_output_format_context()
+{
+	// the writer thread switches the context on getting chunked, and the segment thread frees the one before
+	if (m_writer.joinable())
+	{
+		m_err = -1;
+		m_message = "Error. The output format context belongs to the writer thread until the recording is closed.";
+		return NULL;
+	}
+
+	m_err = 0;
+	m_message = "";
+
+	return m_ofmt_Ctx;
+};
+
+// get the stream time base
+AVRational Muxer::get_stream_time_base(int stream_index)
+{
+	m_err = 0;
+	m_message = "";
+
+	if (stream_index >= 0 && static_cast <unsigned int>(stream_index) < m_ofmt_Ctx->nb_streams)
+	{
+		return m_ofmt_Ctx->streams[stream_index]->time_base;
+	}
+
+	return AVRational{ 1,1 };
+};
+
+// get the error message of last operation
+std::string Muxer::get_error_message()
+{
+	if (m_writer.joinable())
+	{
+		std::lock_guard<std::mutex> lock(m_async_mutex);
+		return m_async_message;
+	}
+
+	return m_message;
+}
+
+// get the recording filename or url
+std::string Muxer::get_url()
+{
+	if (m_writer.joinable())
+	{
+		std::lock_guard<std::mutex> lock(m_async_mutex);
+		return m_async_url;
+	}
+
+	return m_url;
+}
+
+// wait until the writer thread has written all the packets queued, and flush the file
+// @return 0 on success, negative for error code of the writer thread
+int Muxer::flush()
+{
+	if (!m_writer.joinable())
+	{
+		if (m_ofmt_Ctx && m_ofmt_Ctx->pb)
+		{
+			avio_flush(m_ofmt_Ctx->pb);
+		}
+		return 0;
+	}
+
+	int64_t seq = queue_command(MUXER_COMMAND_FLUSH, NULL, 0);
+	while (m_head.load(std::memory_order_acquire) <= seq)
+	{
+		WaitForSingleObject(m_written_event, 100);
+	}
+
+	return m_async_err.exchange(0);
+}
+
+// get the number of commands queued to the writer thread
+int Muxer::get_queue_depth()
+{
+	return static_cast<int>(m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire));
+}
+
+// get the most commands ever queued to the writer thread
+int Muxer::get_max_queue_depth()
+{
+	return m_max_depth;
+}
+
+// get the average latency in microseconds from queuing a packet to its being written
+int64_t Muxer::get_write_latency()
+{
+	int64_t written = m_written;
+	return written ? m_latency / written : 0;
+}
+
+// get the maximum latency in microseconds from queuing a packet to its being written
+int64_t Muxer::get_max_write_latency()
+{
+	return m_max_latency;
+}
+
+// get the number of packets dropped by the async muxer for the queue being full
+int64_t Muxer::get_dropped_packets()
+{
+	return m_dropped;
+}
+
+// get the number of chunks switched to a pre-opened segment
+int64_t Muxer::get_preopened_chunks()
+{
+	return m_preopened;
+}
+
+// get the longest time in microseconds the recording was held by getting chunked
+int64_t Muxer::get_max_chunk_time()
+{
+	return m_max_chunk_time;
+}
+
+// get the duration in microseconds of the last chunk, by the time stamps of its packets
+int64_t Muxer::get_chunk_duration()
+{
+	return m_chunk_duration;
+}
+
+// get the longest duration in microseconds of the chunks
+int64_t Muxer::get_max_chunk_duration()
+{
+	return m_max_chunk_duration;
+}
+
+// get the longest time in microseconds a chunk was made after its chunk time, waiting for a key frame
+int64_t Muxer::get_max_overshoot()
+{
+	return m_max_overshoot;
+}
+
+// get the number of chunks made at a packet other than a key frame, for running over by the chunk overshoot
+int64_t Muxer::get_forced_chunks()
+{
+	return m_forced_chunks;
+}
+
+// get the chunk time in milliseconds of the chunk after the one starting now
+// it is at x:xx:00 if wall clock alignment is set
+// @param due	the chunk starting now is made for the chunk time, the next one is a chunk interval later unless it is past
+int64_t Muxer::get_next_chunk_time(bool due)
 {
-	// to check the chunk setting
-	if (m_chunk_prefix.empty() || !m_chunk_interval)
+	int64_t now = av_gettime();
+	if (due && m_chunk_time + m_chunk_interval > now / 1000)
 	{
-		m_err = -1;
-		m_message = "Invalid chunk settings.";
-		return m_err;
+		return m_chunk_time + m_chunk_interval;
 	}
 
-	// uses m_chunk_time as an indicateor of first recording
-	if (m_chunk_time)
-	{
-		m_err = close();
+	return m_flag_wclk ?
+		(now / 1000 / m_chunk_interval + 1) * m_chunk_interval
+		: ((now + 500000) / 1000000) * 1000 + m_chunk_interval; // align to 1s
+}
 
-		if (m_err)
+// switch the recording to the next segment
+// the segment pre-opened for this chunk is taken, otherwise a new one is opened here. The current segment is handed
+// to the segment thread to be closed, which also pre-opens the segment for the chunk after.
+// @param due	the chunk is made for the chunk time
+// @return 0 on success, negative for error code, also for the segment thread failing to close a segment before
+int Muxer::switch_segment(bool due)
+{
+	int64_t start = av_gettime_relative();
+	int64_t now = av_gettime() / 1000;
+	MuxerSegment next = { NULL, "", now, false };
+	{
+		std::lock_guard<std::mutex> lock(m_segment_mutex);
+		if (m_next.ctx && now >= m_next.time - MUXER_PREOPEN_EARLY)
 		{
-			return m_err;
+			next = m_next;
+		}
+		else if (m_next.ctx)
+		{
+			// the pre-opened segment is named after a later time
+			m_next.discard = true;
+			m_closing.push_back(m_next);
 		}
+		m_next.ctx = NULL;
 	}
 
-	// set next chunk time, at x:xx:00 if wall clock alignment is set
-	m_chunk_time = m_flag_wclk ?
-		(av_gettime() / 1000 / m_chunk_interval + 1) * m_chunk_interval
-		: ((av_gettime() + 500000) / 1000000) * 1000 + m_chunk_interval; // align to 1s
-
-	// file name is set as <prefix><yyyy-MM-dd-hhmmss>.<ext>
-	m_url = m_chunk_prefix + get_date_time() + "." + m_format;
+	if (next.ctx)
+	{
+		m_preopened++;
+	}
+	else
+	{
+		next.url = m_chunk_prefix + get_date_time() + "." + m_format;
+		m_err = open_segment(&next.ctx, next.url);
+	}
 
-	// try to solve the 
-	AVStream* st;
-	for (int i = 0; static_cast <unsigned int>(i) < m_ofmt_Ctx->nb_streams; i++)
+	// the current segment keeps recording when the next one cannot be opened, till the chunk after
+	MuxerSegment current = { m_ofmt_Ctx, m_url, m_chunk_time, false };
+	if (!m_err)
 	{
-		st = m_ofmt_Ctx->streams[i];
-		//m_ofmt_Ctx->streams[i]->start_time = AV_NOPTS_VALUE;
-		//m_ofmt_Ctx->streams[i]->duration = AV_NOPTS_VALUE;
-		//m_ofmt_Ctx->streams[i]->first_dts = AV_NOPTS_VALUE;
-		//m_ofmt_Ctx->streams[i]->cur_dts = AV_NOPTS_VALUE;
-		st->start_time = AV_NOPTS_VALUE;
-		st->duration = static_cast<int64_t>(m_chunk_interval) * 90;
-		st->first_dts = AV_NOPTS_VALUE;
-		st->cur_dts = 0;
+		m_ofmt_Ctx = next.ctx;
+		m_url = next.url;
+		m_chunks++;
+		reset_time_stamps();
 	}
-	m_ofmt_Ctx->output_ts_offset = 0;
+	m_chunk_time = get_next_chunk_time(due);
+	m_chunk_start = AV_NOPTS_VALUE;
+	m_chunk_requested = false;
+	m_chunk_request_time = AV_NOPTS_VALUE;
 
-	if (!(m_ofmt_Ctx->oformat->flags & AVFMT_NOFILE))
 	{
-		m_err = avio_open(&m_ofmt_Ctx->pb, m_url.c_str(), AVIO_FLAG_WRITE);
-		if (m_err < 0)
+		std::lock_guard<std::mutex> lock(m_segment_mutex);
+		if (!m_err)
 		{
-			m_message.assign(av_err(m_err));
-			m_message = "Could not open " + m_url + " with error " + m_message;
-			return m_err;
+			m_closing.push_back(current);
 		}
+		m_next_time = m_chunk_time;
 	}
-	else
+	SetEvent(m_segment_event);
+
+	int64_t elapsed = av_gettime_relative() - start;
+	if (elapsed > m_max_chunk_time)
 	{
-		m_err = -1;
-		m_message = "Error: Previous recording is not closed.";
-		return m_err;
+		m_max_chunk_time = elapsed;
 	}
 
-	//m_err = avformat_write_header(m_ofmt_Ctx, &dictionary);
-	m_err = avformat_write_header(m_ofmt_Ctx, &m_options);
-	if (m_err < 0)
+	if (m_err)
 	{
 		m_message.assign(av_err(m_err));
-		m_message += " Could not open " + m_url;
+		m_message = "Could not open " + next.url + " with error " + m_message.str();
 		return m_err;
 	}
 
-	m_message = m_url + " is openned with return code " + std::to_string(m_err);
-	m_err = 0;
-
-	// update the time base factors used to rescale the time stamps of input packets to the output stream
-	m_tbf_audio = m_time_base_audio;
-	m_tbf_video = m_time_base_video;
-	m_defalt_duration_audio = 440;
-	m_defalt_duration_video = 3000;
-
-	if (m_index_audio >= 0)
-	{
-		m_tbf_audio.den *= m_ofmt_Ctx->streams[m_index_audio]->time_base.num;
-		m_tbf_audio.num *= m_ofmt_Ctx->streams[m_index_audio]->time_base.den;
-		m_defalt_duration_audio = m_ofmt_Ctx->streams[m_index_audio]->time_base.den / m_ofmt_Ctx->streams[m_index_audio]->time_base.num / 44000;
-	}
-
-	if (m_index_video >= 0)
+	if (m_segment_err < 0)
 	{
-		m_tbf_video.den *= m_ofmt_Ctx->streams[m_index_video]->time_base.num;
-		m_tbf_video.num *= m_ofmt_Ctx->streams[m_index_video]->time_base.den;
-		m_defalt_duration_video = m_ofmt_Ctx->streams[m_index_video]->time_base.den / m_ofmt_Ctx->streams[m_index_video]->time_base.num / 30;
+		std::lock_guard<std::mutex> lock(m_segment_mutex);
+		m_err = m_segment_err.exchange(0);
+		m_message = m_segment_message;
+		return m_err;
 	}
-	m_pts_offset_audio = 0;
-	m_pts_offset_video = 0;
 
+	m_message = m_url + " is openned";
 	return m_err;
 }
 
-// write one frame/packet in the muxer
-// @param pkt			the packet that going to be written
-// @param stream_index	the tream index of the muxer
-// @return				0 on success, negative for error, 1 for chunked
-int Muxer::record(AVPacket* pkt, int stream_index)
+// allocate an output format context of the streams of the muxer, open url and write the header
+// @param ctx	the output format context allocated, NULL on error
+// @param url	the file of the segment
+// @return		0 on success, negative for error code
+int Muxer::open_segment(AVFormatContext** ctx, std::string url)
 {
-	m_err = 0;
-	m_message = "";
+	*ctx = NULL;
+	int err = avformat_alloc_output_context2(ctx, NULL, m_format.c_str(), NULL);
+	if (err < 0)
+	{
+		return err;
+	}
 
-	if (pkt->pts == AV_NOPTS_VALUE)
+	for (size_t i = 0; i < m_segment_params.size() && err >= 0; i++)
 	{
-		m_err = -1;
-		m_message = "packet unacceptable: has no valid pts";
+		AVStream* st = avformat_new_stream(*ctx, NULL);
+		if (!st)
+		{
+			err = AVERROR(ENOMEM);
+			break;
+		}
 
-		av_packet_unref(pkt);
-		return m_err;
+		err = avcodec_parameters_copy(st->codecpar, m_segment_params[i]);
+		st->id = static_cast<int>(i);
+		st->codecpar->codec_tag = 0;
+		st->duration = static_cast<int64_t>(m_chunk_interval) * 90;
 	}
 
-	if (pkt->dts == AV_NOPTS_VALUE)
+	if (err >= 0)
 	{
-		pkt->dts = pkt->pts;
+		err = avio_open(&(*ctx)->pb, url.c_str(), AVIO_FLAG_WRITE);
 	}
 
-	if (pkt->size == 0)
+	if (err >= 0)
 	{
-		m_err = -2;
-		m_message = "packet unacceptable: empty";
-
-		av_packet_unref(pkt);
-		return m_err;
+		AVDictionary* options = NULL;
+		av_dict_copy(&options, m_options, 0);
+		err = avformat_write_header(*ctx, &options);
+		av_dict_free(&options);
 	}
 
-	// rescale the time stamp to the output stream
-	if (stream_index == m_index_audio)
+	if (err < 0)
 	{
-		pkt->pts *= m_tbf_audio.num / m_tbf_audio.den;
-		pkt->dts *= m_tbf_audio.num / m_tbf_audio.den;
-
-		if (pkt->duration)
+		if ((*ctx)->pb)
 		{
-			pkt->duration *= m_tbf_audio.num / m_tbf_audio.den;
+			avio_closep(&(*ctx)->pb);
 		}
-		else
+		avformat_free_context(*ctx);
+		*ctx = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+// write the trailer of a segment, close it and free its context
+// the file of a segment to be discarded is removed
+// @return 0 on success, negative for error code
+int Muxer::close_segment(MuxerSegment* segment)
+{
+	int err = av_write_trailer(segment->ctx);
+	avio_closep(&segment->ctx->pb);
+	avformat_free_context(segment->ctx);
+	segment->ctx = NULL;
+
+	if (segment->discard)
+	{
+		remove(segment->url.c_str());
+		return 0;
+	}
+	return err;
+}
+
+// the segment thread, closing the segments handed to it and pre-opening the next one until it is stopped
+void Muxer::prepare()
+{
+	while (true)
+	{
+		std::vector<MuxerSegment> closing;
+		int64_t time = 0;
 		{
-			pkt->duration = m_defalt_duration_audio;
+			std::lock_guard<std::mutex> lock(m_segment_mutex);
+			closing.swap(m_closing);
+			if (!m_next.ctx && !m_segment_stop)
+			{
+				time = m_next_time;
+			}
+			if (closing.empty() && !time && m_segment_stop)
+			{
+				break;
+			}
 		}
 
-		if (m_pts_offset_audio == 0)
+		for (size_t i = 0; i < closing.size(); i++)
 		{
-			m_pts_offset_audio = -pkt->pts;
+			std::string url = closing[i].url;
+			int err = close_segment(&closing[i]);
+			if (err < 0)
+			{
+				std::lock_guard<std::mutex> lock(m_segment_mutex);
+				m_segment_message = "Could not close " + url + " with error " + av_err(err);
+				m_segment_err = err;
+			}
 		}
-		pkt->pts += m_pts_offset_audio;
-		pkt->dts += m_pts_offset_audio;
-	}
-	else if (stream_index == m_index_video)
-	{
-		pkt->pts *= m_tbf_video.num / m_tbf_video.den;
-		pkt->dts *= m_tbf_video.num / m_tbf_video.den;
-		if (pkt->duration)
+
+		if (time)
 		{
-			pkt->duration *= m_tbf_video.num / m_tbf_video.den;
+			MuxerSegment next = { NULL, m_chunk_prefix + get_date_time(time) + "." + m_format, time, false };
+			int err = open_segment(&next.ctx, next.url);
+
+			// the chunk may have come, or the muxer been stopped, while it was opening
+			std::lock_guard<std::mutex> lock(m_segment_mutex);
+			if (err < 0)
+			{
+				m_segment_message = "Could not pre-open " + next.url + " with error " + av_err(err);
+			}
+			else if (m_next_time == time && !m_segment_stop)
+			{
+				m_next = next;
+			}
+			else
+			{
+				next.discard = true;
+				m_closing.push_back(next);
+				continue;
+			}
 		}
-		else
+
+		if (!closing.empty())
 		{
-			pkt->duration = m_defalt_duration_video;
+			continue; // more may have been handed over while closing
 		}
+		WaitForSingleObject(m_segment_event, INFINITE);
+	}
+}
 
-		if (m_pts_offset_video == 0)
+// stop the segment thread after it has closed the segments handed to it, and remove the pre-opened one
+void Muxer::stop_segments()
+{
+	if (!m_segmenter.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_segment_mutex);
+		m_segment_stop = true;
+		if (m_next.ctx)
 		{
-			m_pts_offset_video = -pkt->pts;
+			m_next.discard = true;
+			m_closing.push_back(m_next);
+			m_next.ctx = NULL;
 		}
-		pkt->pts += m_pts_offset_video;
-		pkt->dts += m_pts_offset_video;
 	}
+	SetEvent(m_segment_event);
+	m_segmenter.join();
+	m_segment_stop = false;
 
-	pkt->stream_index = stream_index;
-	pkt->pos = -1;
+	for (size_t i = 0; i < m_segment_params.size(); i++)
+	{
+		avcodec_parameters_free(&m_segment_params[i]);
+	}
+	m_segment_params.clear();
+}
 
-	// check the interleaved flag
-	if (m_flag_interleaved)
+// queue a command to the writer thread
+// the commands are queued by one thread, so only the writer thread races with it, on the head of the queue
+// @param type			MUXER_COMMAND_*
+// @param pkt			the packet taken over by MUXER_COMMAND_PACKET, NULL for the others
+// @param stream_index	the stream index of the muxer of the packet
+// @return				the sequence of the command, negative when the packet does not fit in the queue
+int64_t Muxer::queue_command(int type, AVPacket* pkt, int stream_index)
+{
+	int64_t tail = m_tail.load(std::memory_order_relaxed);
+	int64_t size = static_cast<int64_t>(m_queue.size());
+	if (type == MUXER_COMMAND_PACKET)
 	{
-		m_err = av_interleaved_write_frame(m_ofmt_Ctx, pkt); // interleaved write will handle the packet unref
+		if (tail - m_head.load(std::memory_order_acquire) >= m_async_queue)
+		{
+			return -1;
+		}
 	}
 	else
 	{
-		m_err = av_write_frame(m_ofmt_Ctx, pkt);
+		// the chunk and flush commands have the slots beyond the packets, and wait for the writer when those are taken too
+		while (tail - m_head.load(std::memory_order_acquire) >= size)
+		{
+			WaitForSingleObject(m_written_event, 100);
+		}
 	}
-	av_packet_unref(pkt);
 
-	if (m_err)
+	MuxerCommand* cmd = &m_queue[tail % size];
+	cmd->type = type;
+	cmd->stream_index = stream_index;
+	cmd->time = av_gettime_relative();
+	if (pkt)
 	{
-		m_message.assign(av_err(m_err));
-		return m_err;
+		av_packet_move_ref(cmd->pkt, pkt);
 	}
-	m_message = "packet written";
+	m_tail.store(tail + 1, std::memory_order_release);
 
-	m_err = 0;
-	int64_t t = av_gettime() / 1000;
-	if (m_chunk_time && t >= m_chunk_time)
+	int depth = static_cast<int>(tail + 1 - m_head.load(std::memory_order_acquire));
+	if (depth > m_max_depth)
 	{
-		m_err = chunk();
-		if (!m_err)
-		{
-			m_err = 1; // indicates get chunked
-		}
+		m_max_depth = depth;
 	}
-	//m_err = m_chunk_time && av_gettime() / 1000 >= m_chunk_time ? re_open() : 0;
 
-	return m_err;
+	SetEvent(m_queued_event);
+	return tail;
 }
 
-int Muxer::close()
+// the writer thread, writing the commands queued until the muxer is stopped and the queue is empty
+void Muxer::write()
 {
-	// no close when no file is opened
-	if (m_ofmt_Ctx->oformat->flags & AVFMT_NOFILE)
-		return -1;
-
-	m_err = av_write_trailer(m_ofmt_Ctx);
-	if (m_err < 0)
+	while (true)
 	{
-		m_message.assign(av_err(m_err));
-		return m_err;
-	}
+		int64_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+		{
+			if (m_stop)
+			{
+				break;
+			}
+			WaitForSingleObject(m_queued_event, INFINITE);
+			continue;
+		}
 
-	avio_closep(&m_ofmt_Ctx->pb);
+		MuxerCommand* cmd = &m_queue[head % m_queue.size()];
+		int64_t chunks = m_chunks;
+		int err = 0;
+		if (cmd->type == MUXER_COMMAND_PACKET)
+		{
+			err = write_packet(cmd->pkt, cmd->stream_index);
 
-	m_message = m_url + " is closed.";
-	return m_err;
-}
+			int64_t latency = av_gettime_relative() - cmd->time;
+			m_latency += latency;
+			m_written++;
+			if (latency > m_max_latency)
+			{
+				m_max_latency = latency;
+			}
 
-// get the stream codec parameter
-AVFormatContext* Muxer::get_output_format_context()
-{
-	m_err = 0;
-	m_message = "";
+			if (err == 1)
+			{
+				m_async_chunked = true;
+			}
+		}
+		else if (cmd->type == MUXER_COMMAND_CHUNK)
+		{
+			if (m_chunk_time)
+			{
+				m_chunk_requested = true;
+			}
+			else
+			{
+				err = chunk_file();
+			}
+		}
+		else if (m_ofmt_Ctx->pb)
+		{
+			avio_flush(m_ofmt_Ctx->pb);
+		}
 
-	return m_ofmt_Ctx;
-};
+		if (err < 0)
+		{
+			m_async_err = err;
+		}
+		if (err < 0 || m_chunks != chunks)
+		{
+			set_async_message();
+		}
 
-// get the stream time base
-AVRational Muxer::get_stream_time_base(int stream_index)
-{
-	m_err = 0;
-	m_message = "";
+		m_head.store(head + 1, std::memory_order_release);
+		SetEvent(m_written_event);
+	}
+}
 
-	if (stream_index >= 0 && static_cast <unsigned int>(stream_index) < m_ofmt_Ctx->nb_streams)
+// stop the writer thread after it has written all the commands queued
+void Muxer::stop_writer()
+{
+	if (!m_writer.joinable())
 	{
-		return m_ofmt_Ctx->streams[stream_index]->time_base;
+		return;
 	}
 
-	return AVRational{ 1,1 };
-};
-
-// get the error message of last operation
-std::string Muxer::get_error_message()
-{
-	return m_message;
+	m_stop = true;
+	SetEvent(m_queued_event);
+	m_writer.join();
+	m_stop = false;
 }
 
-// get the recording filename or url
-std::string Muxer::get_url()
+// keep the error message and the url of the writer thread for the other thread
+void Muxer::set_async_message()
 {
-	return m_url;
+	std::lock_guard<std::mutex> lock(m_async_mutex);
+	m_async_message = m_message.str();
+	m_async_url = m_url;
 }
 
 }
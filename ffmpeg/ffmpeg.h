@@ -1,7 +1,44 @@
 #pragma once
 #include <string>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <mutex>
 
 #define ALIGN_TO_WALL_CLOCK 1
+#define CIRCULAR_BUFFER_PACKET_RATE 128 // the maximum packets per second the circular buffer ring is sized for
+#define CIRCULAR_BUFFER_MIN_SLOTS 1024 // the minimum number of packet slots in the circular buffer ring
+#define CIRCULAR_BUFFER_MAX_READERS 16 // the maximum number of readers of a circular buffer
+#define CIRCULAR_BUFFER_ARENA_HEADROOM 4 // the arena has 1/4 of max_size more for the packet staged before eviction, the payloads held by readers and the wrap around
+#define CIRCULAR_BUFFER_BACKGROUND_READER 0 // the reader registered as "background" on open
+#define CIRCULAR_BUFFER_MAIN_READER 1 // the reader registered as "main" on open
+// the flags of a buffered packet, kept in its packet info and the spill records, never in AVPacket.flags:
+// the AV_PKT_FLAG_* of the packet in the low bits, and the tags of the circular buffer above them
+#define CIRCULAR_BUFFER_PACKET_FLAGS 0xFFFF // the AV_PKT_FLAG_* part of the flags of a buffered packet
+#define CIRCULAR_BUFFER_FLAG_THINNED 0x10000 // the packet is thinned out of the circular buffer
+#define CIRCULAR_BUFFER_FLAG_IDR 0x20000 // the H.264/H.265 packet has an IDR picture, AV_PKT_FLAG_KEY is set in the packet too
+#define CIRCULAR_BUFFER_FLAG_RECOVERY 0x40000 // the H.264/H.265 packet is a random access point other than IDR, by a recovery point SEI or a CRA/BLA picture
+#define CIRCULAR_BUFFER_FLAG_PARAM_SETS 0x80000 // the H.264/H.265 packet carries parameter sets, VPS/SPS/PPS
+#define CIRCULAR_BUFFER_FLAG_PARAM_CHANGE 0x100000 // the parameter sets of the packet differ from those before in the stream
+#define CIRCULAR_BUFFER_FRAME_MASK 0x600000 // the frame type by the first slice of the packet, 0 for unknown
+#define CIRCULAR_BUFFER_FRAME_I 0x200000
+#define CIRCULAR_BUFFER_FRAME_P 0x400000
+#define CIRCULAR_BUFFER_FRAME_B 0x600000
+#define CIRCULAR_BUFFER_POLICY_DROP 0 // a reader behind the oldest packet jumps to it, the packets in between are dropped
+#define CIRCULAR_BUFFER_POLICY_SKIP_TO_KEY 1 // a reader behind the oldest packet jumps to the next key frame of the primary stream
+#define CIRCULAR_BUFFER_POLICY_BACKPRESSURE 2 // the writer waits a bounded time for the reader before evicting, then skips to key frame
+#define CIRCULAR_BUFFER_MAX_STREAMS 8 // the maximum number of streams in a circular buffer
+#define CIRCULAR_BUFFER_MAX_EXPORTS 4 // the maximum number of clips exported from a circular buffer at the same time
+#define MAPPED_RING_HEADER_SIZE 65536 // the size of the header at the beginning of a mapped ring, including the codec extradata
+#define MAPPED_RING_BYTES_PER_RECORD 2048 // the mapped ring has a record for every so many bytes of payload
+#define DEMUXER_PROBE_CACHE_VERSION 2 // the version of the probe cache files
+#define DEMUXER_REPLAY_OFF 0 // read the camera
+#define DEMUXER_REPLAY_REALTIME 1 // replay a recorded file in a loop, paced to the timestamps of its packets
+#define DEMUXER_REPLAY_FAST 2 // replay a recorded file in a loop as fast as possible
+#define DEMUXER_BACKOFF_MIN 250 // the milliseconds before the first reconnect attempt, doubled after every failed attempt
+#define DEMUXER_BACKOFF_MAX 8000 // the maximum milliseconds between reconnect attempts
+#define CAPTURE_ENGINE_MAX_THREADS 16 // the maximum number of I/O threads of a capture engine
+#define CAPTURE_ENGINE_BURST 8 // the maximum packets read from one camera before polling the next one
 
 // A demo instance of Camera module using circular buffer
 // 1. Test the circular buffer 
@@ -26,6 +63,7 @@ namespace ffmpeg
 #include <libavutil/audio_fifo.h>
 #include <libavutil/frame.h>
 #include <libavutil/samplefmt.h>
+#include <libavutil/random_seed.h>
 
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
@@ -34,6 +72,7 @@ namespace ffmpeg
 
 	char* av_err(int ret);
 	const std::string get_date_time();
+	const std::string get_date_time(int64_t time); // time in milliseconds since the epoch
 	
 	static enum AVPixelFormat get_hw_format(AVCodecContext* ctx, const enum AVPixelFormat* pix_fmts);
 	static enum AVPixelFormat m_hw_pix_fmt;
@@ -41,6 +80,291 @@ namespace ffmpeg
 	char* av_err(int ret);
 	const std::string get_date_time();
 
+	// the message of last operation, formatted only when it is asked for.
+	// a string literal is kept by its address and an FFmpeg error code by its value, neither allocates nor copies,
+	// so that the per-packet paths can report without string work. other strings are copied as usual.
+	class ErrorMessage
+	{
+	public:
+		ErrorMessage();
+
+		// keep a string literal by its address
+		template <size_t N>
+		ErrorMessage& operator=(const char(&literal)[N])
+		{
+			m_literal = literal;
+			m_code = 0;
+			return *this;
+		}
+
+		// copy a string
+		ErrorMessage& operator=(const std::string& text);
+		ErrorMessage& assign(const char* text);
+		ErrorMessage& append(const std::string& text);
+		ErrorMessage& operator+=(const std::string& text);
+
+		// keep an FFmpeg error code, the message is av_err(code) after the prefix, which has to be a string literal
+		void set_error(int code, const char* prefix = "");
+
+		// format the message
+		std::string str() const;
+		operator std::string() const;
+
+	protected:
+		const char* m_literal; // the string literal, NULL when m_text is the message
+		int m_code; // the FFmpeg error code formatted after m_literal, 0 for none
+		std::string m_text;
+	};
+
+	// a reader of the circular buffer
+	// pos is the sequence number of the next packet to read, it is only moved by the reader itself
+	// hazard is the sequence number of the packet being copied by the reader, -1 when idle.
+	// the writer defers releasing a packet as long as a reader holds it as hazard
+	// state is 0 for a free reader, 1 while it is being registered, 2 for a registered reader
+	// waiting is set by a reader that is going to sleep on its event, the writer signals the event on the next packet
+	// policy decides what happens when the reader falls behind the oldest packet, one of CIRCULAR_BUFFER_POLICY_*.
+	// it is set by any thread at any time, after the backpressure it goes with, and read by the writer
+	struct CircularBufferReader
+	{
+		std::atomic<int64_t> pos;
+		std::atomic<int64_t> hazard;
+		std::atomic<int> state;
+		std::atomic<int> waiting;
+		void* event; // the auto reset event HANDLE of the reader
+		std::string name;
+		std::atomic<int> policy;
+		std::atomic<int> backpressure; // the maximum milliseconds the writer waits for the reader in one push
+		bool resync; // the reader is skipping packets until the next key frame of the primary stream
+		std::atomic<int64_t> dropped; // the number of packets the reader missed or skipped
+		std::atomic<int64_t> stalled; // the microseconds the writer waited for the reader
+		std::atomic<int64_t> max_lag; // the maximum number of packets the reader has been behind the newest packet
+		std::atomic<int> flags; // the flags of the last packet read, AV_PKT_FLAG_* and CIRCULAR_BUFFER_FLAG_* / CIRCULAR_BUFFER_FRAME_*
+	};
+
+	// a region of the payload arena, released by the last reference of the packet payload stored in it
+	struct CircularBufferRegion
+	{
+		int64_t end; // the arena position right after the region
+		std::atomic<int> released;
+	};
+
+	// an entry of the key frame index, written by the writer on pushing a key frame of the primary stream
+	struct CircularBufferKey
+	{
+		std::atomic<int64_t> seq; // sequence number of the key frame
+		std::atomic<int64_t> time; // pts of the key frame in microseconds
+	};
+
+	// the information of a packet in the ring, kept aside the packet list in a slot of the same index
+	// flags get CIRCULAR_BUFFER_FLAG_THINNED when the packet is thinned out, readers check it under their hazard
+	struct CircularBufferPacketInfo
+	{
+		int64_t time; // pts in microseconds, the common clock of all streams
+		int stream; // the order of the stream in the circular buffer
+		std::atomic<int> flags; // the packet flags
+	};
+
+	// a clip being exported from the circular buffer on a worker thread
+	// the packets already in the circular buffer are pinned by references on export, the later ones are read by its reader
+	// state is 0 for a free export, 1 while it is running, 2 when it is done, negative for error code
+	struct CircularBufferExport
+	{
+		std::thread worker;
+		std::atomic<int> state;
+		std::atomic<bool> abort; // set to stop the worker before the end of the clip
+		std::atomic<int64_t> packets; // the number of packets written
+		std::atomic<int64_t> bytes; // the number of payload bytes written
+		std::atomic<int64_t> time; // the time in microseconds of the last packet written
+		int64_t start_time; // the time in microseconds of the key frame the clip starts from
+		int64_t end_time; // the time in microseconds the clip ends at
+		int64_t started; // the relative clock in microseconds the export started
+		std::atomic<int64_t> finished; // the relative clock in microseconds the export finished, 0 while running
+		int reader; // the reader id for the packets pushed after the export started, negative when all are pinned
+		std::vector<AVPacket*> pinned; // the packets pinned on export
+		std::string filename;
+		std::string message; // the error message of the worker
+	};
+
+	// a stream in the circular buffer
+	// st is a local copy of the source stream, with codecpar, time_base and index of the source
+	// packets and size are the number of packets and the total size of the stream in the circular buffer
+	struct CircularBufferStream
+	{
+		AVStream* st;
+		AVCodecParameters* codecpar;
+		int64_t first_pts; // the first valid pts, packets before it are rejected
+		std::atomic<int64_t> packets;
+		std::atomic<int64_t> size;
+		int nal_length_size; // the bytes of the NAL unit lengths of AVCC/HVCC packets, 0 for Annex-B, -1 for neither H.264 nor H.265
+		uint32_t param_sets[3]; // the hashes of the last VPS, SPS and PPS of the stream, 0 for none yet
+		int extra_slice_header_bits; // num_extra_slice_header_bits of the last H.265 PPS
+	};
+
+	// the codec parameters of a stream in a mapped ring, for the packets to be decoded or muxed after a restart
+	struct MappedRingStream
+	{
+		int32_t index; // the index of the source stream
+		int32_t codec_type;
+		int32_t codec_id;
+		int32_t format;
+		int32_t time_base_num;
+		int32_t time_base_den;
+		int32_t width;
+		int32_t height;
+		int32_t sample_rate;
+		int32_t channels;
+		int64_t channel_layout;
+		int64_t bit_rate;
+		int32_t profile;
+		int32_t level;
+		int32_t extradata_offset; // the offset of the extradata in the header
+		int32_t extradata_size;
+	};
+
+	// the header at the beginning of a mapped ring
+	// records in [tail, head) are readable, data_head is the position where the next payload is written
+	// the extradata of the streams follows the header
+	struct MappedRingHeader
+	{
+		char magic[8]; // "PKTRING"
+		int32_t version;
+		int32_t header_size;
+		int64_t file_size;
+		int64_t nb_records; // the number of records, power of 2
+		int64_t data_offset; // the offset of the payload area in the mapping
+		int64_t data_size; // the size of the payload area
+		std::atomic<int64_t> head; // sequence number of the next record
+		std::atomic<int64_t> tail; // sequence number of the oldest record
+		std::atomic<int64_t> data_head; // the payload position after the newest record, offset is data_head % data_size
+		int32_t nb_streams;
+		int32_t extradata_end; // the offset in the header after the extradata of the streams
+		MappedRingStream streams[CIRCULAR_BUFFER_MAX_STREAMS];
+	};
+
+	// a packet record in a mapped ring, the record of sequence number seq is the (seq % nb_records)-th one
+	struct MappedRingRecord
+	{
+		int64_t seq; // the sequence number of the packet
+		int64_t pts;
+		int64_t dts;
+		int64_t duration;
+		int64_t time; // pts in microseconds
+		int64_t pos; // the payload position, offset is pos % data_size
+		int32_t size;
+		int32_t flags; // AV_PKT_FLAG_* and the tags of the circular buffer, as CircularBufferPacketInfo::flags
+		int32_t stream_index; // the index of the source stream
+		int32_t stream; // the order of the stream in the circular buffer
+	};
+
+	// A ring of packet records in a memory mapped file, preallocated on open.
+	// Single writer appends packets of increasing sequence numbers, overwriting the oldest when the ring is full.
+	// Readers copy the payloads out without lock, and confirm afterwards the records were not overwritten in between.
+	// The file is self contained with the codec parameters of the streams. What has been appended survives
+	// a crash of the process, and can be recovered when it restarts.
+	// The ring can be in the named shared memory instead, where the readers of other processes attach read only.
+	class MappedRing
+	{
+	public:
+		MappedRing();
+		~MappedRing();
+
+		// create a mapped ring in the file, which is preallocated to size bytes
+		// return 0 on success, negative for error code
+		int open(std::string filename, int64_t size);
+
+		// map an existing mapped ring file read only, to recover the packets written before a crash or restart
+		// return 0 on success, negative for error code
+		int recover(std::string filename);
+
+		// create a mapped ring in the named shared memory of size bytes, to be attached by other processes
+		// return 0 on success, negative for error code
+		int share(std::string name, int64_t size);
+
+		// attach to the named shared memory of a mapped ring read only
+		// return 0 on success, negative for error code
+		int attach(std::string name);
+
+		// unmap and close the file
+		void close();
+
+		// save the codec parameters of the n-th stream, only the writer calls it
+		// return 0 on success, negative for error code
+		int set_stream(int n, AVStream* stream);
+
+		// get the n-th stream saved in the mapped ring, NULL when there is no such stream
+		AVStream* get_stream(int n);
+
+		// get the number of streams saved in the mapped ring
+		int get_nb_streams();
+
+		// save the packets of the last seconds, starting from a key frame, to a file by Muxer
+		// return the number of packets saved, negative for error code
+		int dump(std::string filename, int seconds);
+
+		// append a packet of sequence number seq with the flags of the circular buffer, only the writer calls it
+		// a sequence number not following the newest record drops all the records
+		// return 0 on success, negative for error code
+		int append(int64_t seq, const AVPacket* pkt, int64_t time, int stream, int flags);
+
+		// read the packet of sequence number seq, flags gets the flags of the record when it is not NULL
+		// return 1 when the packet is read, 0 when it is not appended yet, negative when it has been overwritten
+		int read(int64_t seq, AVPacket* pkt, int* flags = NULL);
+
+		// get the packet of sequence number seq referring to the payload in the mapping, without copying it
+		// the payload is valid only if get_tail() is still not beyond seq after it has been used
+		// return 1 when the packet is got, 0 when it is not appended yet, negative when it has been overwritten
+		int peek(int64_t seq, AVPacket* pkt);
+
+		// find the sequence number of the last key frame of specified stream order at or before time in microseconds
+		// negative return indicates no such key frame
+		int64_t find_key_frame(int64_t time, int stream);
+
+		// get the sequence number of the next record
+		int64_t get_head();
+
+		// get the sequence number of the oldest record
+		int64_t get_tail();
+
+		// get the time in microseconds of the newest record, AV_NOPTS_VALUE when there is no record
+		int64_t get_newest_time();
+
+		// get the error message of last operation
+		std::string get_error_message();
+
+	protected:
+		// create a mapped ring in a file or the named shared memory
+		int create(std::string name, int64_t size, bool shared);
+
+		// map an existing mapped ring in a file or the named shared memory read only
+		int attach(std::string name, bool shared);
+
+		// map the view of the file or the named shared memory
+		int map(std::string name, int64_t size, bool readonly, bool shared);
+
+		AVStream* m_streams[CIRCULAR_BUFFER_MAX_STREAMS]; // the streams built from the header on request
+		void* m_file; // the file HANDLE
+		void* m_mapping; // the file mapping HANDLE
+		uint8_t* m_view; // the mapped view of the whole file
+		MappedRingHeader* m_header;
+		MappedRingRecord* m_records;
+		uint8_t* m_data;
+		int64_t m_records_mask; // the number of records minus 1
+
+		int m_err; // the error code of last operation
+		std::string m_message; // the error message of last operation
+	};
+
+	class BufferManager;
+
+	// The circular buffer is a lock free ring of packets with single writer and multiple readers.
+	// Every pushed packet gets a sequence number. Packets in [m_tail, m_head) are readable.
+	// The writer publishes new packets by m_head with release order, and evicts old packets by m_tail.
+	// The writer waits for the readers in two cases only:
+	//  - a ring slot to be reused is still held by a reader copying the packet evicted from it a whole ring ago.
+	//    The writer yields until that copy is done, which is bounded by the copy of one packet.
+	//  - a reader of CIRCULAR_BUFFER_POLICY_BACKPRESSURE lags behind the packet to be evicted. The writer sleeps
+	//    in 1ms steps until the reader moves on, up to the backpressure milliseconds of the reader per push call.
+	// Otherwise the readers never block the writer.
 	class CircularBuffer
 	{
 	public:
@@ -49,18 +373,31 @@ namespace ffmpeg
 
 		// Add the stream into the circular buffer
 		//int add_stream(AVFormatContext* ifmt_Ctx, int stream_index = 0);
-		void open(int time_span, int max_size);
+		// arena is true to copy the packet payloads into one preallocated arena instead of referencing them,
+		// the arena is max_size bytes with the headroom and the padding of every slot
+		void open(int time_span, int max_size, bool arena = false);
 
 		// set the stream info
 		// stream id is to indentify the stream index when push packet
 		// stream time base is used to calculate the time span
 		// stream codec parameters are also saved for furture usage
+		// many streams can be added, packets of them are interleaved in the circular buffer
+		// the first video stream, or the first stream when there is no video, is the primary stream
 		int add_stream(AVStream* stream);
 
+		// add all the video and audio streams of the input format context
+		int add_stream(AVFormatContext* fmt_ctx);
+
 		// push a video or audio packet to the circular buffer
 		// 0 or positive return indicates the packet is added successfully. The number returned is the number of packets disposed from the circular buffer.
 		// negative return indicates no packet is added due to an error. 
-		int push_packet(AVPacket* pkt);
+		// move is true to take over the packet, which is left blank, instead of referencing it. A packet not added is left alone.
+		int push_packet(AVPacket* pkt, bool move = false);
+
+		// push many video or audio packets in an array, which are published to the readers together
+		// move is true to take over the packets added instead of referencing them
+		// return the number of packets added, negative for error code when none is added
+		int push_packets(AVPacket* pkts, int nb_pkts, bool move = false);
 
 		// read a packet out of the circular buffer.
 		// read a packet using the background reader when isBackground is true
@@ -68,21 +405,179 @@ namespace ffmpeg
 		// return (0 or 1) indicates the number of packet is read. 
 		int peek_packet(AVPacket* pkt, bool isBackground = true);
 
-		// reset the main reader to very beginning
+		// reset the main reader to the oldest key frame
 		void reset_main_reader();
 
+		// register a named reader, which reads at its own pace independent of other readers
+		// the reader starts from the oldest packet when from_oldest is true, otherwise from the next new packet
+		// return the reader id (0 or positive) on success, negative for error code
+		int add_reader(std::string name, bool from_oldest = true);
+
+		// unregister a reader, the reader id may be reused by later registering
+		// it waits for the reader to finish copying a packet, which the writer may no longer release under it
+		int remove_reader(int reader);
+
+		// get the id of a registered reader by its name
+		// negative return indicates no such reader
+		int get_reader(std::string name);
+
+		// read a packet using specified reader
+		// return (0 or 1) indicates the number of packet is read, negative for error code
+		int read_packet(int reader, AVPacket* pkt);
+
+		// read up to max_n packets available right now into an array using specified reader
+		// return the number of packets read, negative for error code
+		int peek_packets(int reader, AVPacket* pkts, int max_n);
+
+		// read a packet using specified reader, wait up to timeout milliseconds when there is no packet to read
+		// return (0 or 1) indicates the number of packet is read, negative for error code
+		int wait_packet(int reader, AVPacket* pkt, int timeout);
+
+		// request the reader's event to be signaled on the next new packet
+		// used to wait for many circular buffers together by WaitForMultipleObjects on their reader events
+		// return the number of packets available to read right now, the event may not be signaled when it is positive
+		int arm_reader(int reader);
+
+		// get the auto reset event HANDLE of specified reader, NULL for invalid reader
+		void* get_reader_event(int reader);
+
+		// set the policy of specified reader when it falls behind the oldest packet, one of CIRCULAR_BUFFER_POLICY_*
+		// backpressure is the maximum milliseconds the writer waits for the reader in one push, for CIRCULAR_BUFFER_POLICY_BACKPRESSURE
+		// return 0 on success, negative for error code
+		int set_reader_policy(int reader, int policy, int backpressure = 0);
+
+		// get the number of packets specified reader missed or skipped by falling behind, negative for error code
+		int64_t get_reader_dropped(int reader);
+
+		// get the flags of the last packet read by specified reader, the AV_PKT_FLAG_* of the packet and
+		// the CIRCULAR_BUFFER_FLAG_* and CIRCULAR_BUFFER_FRAME_* tags found on pushing it, negative for error code
+		int get_packet_flags(int reader);
+
+		// get the milliseconds the writer waited for specified reader, negative for error code
+		int64_t get_reader_stalled(int reader);
+
+		// get the maximum number of packets specified reader has been behind the newest packet, negative for error code
+		int64_t get_reader_max_lag(int reader);
+
+		// reset specified reader to the oldest key frame in the circular buffer
+		int reset_reader(int reader);
+
+		// position specified reader at the last key frame at or before pts, in the stream time base
+		// the reader is positioned at the oldest key frame when all key frames are after pts
+		// return 0 on success, negative for error code
+		int seek_reader(int reader, int64_t pts);
+
+		// position specified reader at the last key frame at or before the newest packet minus pre_roll milliseconds
+		// return 0 on success, negative for error code
+		int rewind_reader(int reader, int pre_roll);
+
+		// get the number of packets specified reader is behind the newest packet
+		int get_lag(int reader);
+
+		// spill the packets evicted from memory to a mapped ring in the file preallocated to size bytes
+		// readers read transparently from the file when they are behind the oldest packet in memory
+		// black_box is true to write every packet to the file on pushing, so that they can be recovered after a crash
+		// it shall be called after open and before pushing packets
+		// return 0 on success, negative for error code
+		int open_spill(std::string filename, int64_t size, bool black_box = false);
+
+		// publish every pushed packet to a mapped ring in the named shared memory of size bytes
+		// the processes attaching to it by MappedRing::attach read the packets without reconnecting to the camera
+		// it shall be called after open and before pushing packets
+		// return 0 on success, negative for error code
+		int open_shared(std::string name, int64_t size);
+
+		// get the mapped ring the evicted packets are spilled to, NULL when there is no spilling
+		MappedRing* get_spill();
+
+		// export the clip between start_time and end_time to a file, in milliseconds of the wall clock
+		// the clip starts from the last key frame at or before start_time, and may end in the future
+		// the packets are pinned against eviction and remuxed on a worker thread, pushing and reading are not blocked
+		// return the export id (0 or positive) on success, negative for error code
+		int export_clip(std::string filename, int64_t start_time, int64_t end_time);
+
+		// get the progress in percentage of specified export
+		// return 0 to 100, negative for the error code of a failed export
+		int get_export_progress(int id);
+
+		// get the throughput of specified export in bytes per second
+		double get_export_throughput(int id);
+
+		// wait for specified export to be done and free it, the export is stopped first when abort is true
+		// return the number of packets exported, negative for error code
+		int join_export(int id, bool abort = false);
+
+		// get the number of packet lists taken from the preallocated pool
+		int64_t get_pool_hits();
+
+		// get the number of packet lists allocated from the heap because the pool was exhausted
+		int64_t get_pool_misses();
+
+		// get the number of packet payloads copied into the arena
+		int64_t get_arena_hits();
+
+		// get the number of packet payloads referenced outside the arena because the arena had no room
+		int64_t get_arena_misses();
+
+		// get the capacity of the ring, that is the maximum number of packets can be held
+		int get_capacity();
+
+		// keep only the key frames of the primary stream in the packets older than thin_age seconds, 0 to keep all packets
+		// the size budget then holds a longer history, at a lower frame rate beyond thin_age
+		void set_thinning(int thin_age);
+
+		// get the number of packets thinned out of the circular buffer
+		int64_t get_thinned_packets();
+
+		// set up the NAL unit parsing of an H.264/H.265 stream, the parameter sets of Annex-B extradata are taken as
+		// the ones before the packets, so the first parameter sets in the packets that differ get CIRCULAR_BUFFER_FLAG_PARAM_CHANGE
+		static void init_nal_stream(CircularBufferStream* stream, AVCodecParameters* par);
+
+		// parse the NAL units of an H.264/H.265 packet up to its first slice, without decoding
+		// return the CIRCULAR_BUFFER_FLAG_* and CIRCULAR_BUFFER_FRAME_* tags of the packet, and AV_PKT_FLAG_KEY for an IDR
+		static int inspect_packet(const AVPacket* pkt, CircularBufferStream* stream);
+
+		// get the parameter sets of an Annex-B packet with their start codes, as the extradata of the stream
+		// return the number of bytes of the parameter sets, negative for error code
+		static int get_parameter_sets(const AVPacket* pkt, CircularBufferStream* stream, std::vector<uint8_t>& sets);
+
 		// get the stream codec parameters that defines the packet in the circular buffer
-		AVCodecParameters* get_stream_codecpar();
+		// stream_index is the index of the source stream, -1 for the primary stream
+		AVCodecParameters* get_stream_codecpar(int stream_index = -1);
 
 		// get the stream associated to the circular buffer
-		AVStream* get_stream();
+		// stream_index is the index of the source stream, -1 for the primary stream
+		AVStream* get_stream(int stream_index = -1);
+
+		// get the n-th stream added to the circular buffer
+		AVStream* get_nth_stream(int n);
+
+		// get the number of streams in the circular buffer
+		int get_nb_streams();
 
 		// get the stream time base
-		AVRational get_time_base();
+		// stream_index is the index of the source stream, -1 for the primary stream
+		AVRational get_time_base(int stream_index = -1);
+
+		// get the number of packets of specified stream in the circular buffer
+		int64_t get_stream_packets(int stream_index);
+
+		// get the total size of packets of specified stream in the circular buffer
+		int64_t get_stream_size(int stream_index);
 
 		// get the circular buffer size
 		int get_size();
 
+		// set the maximum size of the circular buffer, no more than the max_size on open
+		// it can be called by any thread, the writer evicts the packets over the size on next push
+		void set_max_size(int max_size);
+
+		// get the maximum size of the circular buffer currently allowed
+		int get_max_size();
+
+		// get the bytes per second of the packets in the circular buffer, 0 before it is known
+		int64_t get_bitrate();
+
 		// get the number of packets in the circular buffer
 		int get_total_packets();
 
@@ -90,29 +585,220 @@ namespace ffmpeg
 		std::string get_error_message();
 
 	protected:
-		AVPacketList* first_pkt; // pointer to the first added packet in the circular buffer
-		AVPacketList* last_pkt; // pointer to the new added packet in the circular buffer
-		AVPacketList* bg_pkt; // the background reading pointer
-		AVPacketList* mn_pkt; // the main reading pointer
-		AVCodecParameters* m_codecpar; // The codec parameters of the bind stream
-		AVStream* m_st; // The assigned stream
-
-		int m_total_packets; // counter of total packets in the circular buffer
-		int m_size;  // total size of the packets in the buffer
+		// read a packet using specified reader, skipping to the key frame when it is resynchronizing
+		int read_packet(CircularBufferReader* reader, AVPacket* pkt);
+
+		// read the next packet using specified reader
+		int fetch_packet(CircularBufferReader* reader, AVPacket* pkt);
+
+		// wait for the readers applying backpressure to read the packet of seq, before it is evicted
+		void hold_back(int64_t seq);
+
+		// stage a packet in the slot of sequence number seq, not visible to the readers until published
+		int stage_packet(AVPacket* pkt, int64_t seq, bool move);
+
+		// publish the staged packets in [head, new_head) to the readers, and maintain the circular buffer
+		void publish_packets(int64_t head, int64_t new_head);
+
+		// evict the oldest packet from the circular buffer
+		void evict_packet();
+
+		// thin the packet of sequence number seq out of the circular buffer, which stays as a hole to be skipped by readers
+		void thin_packet(int64_t seq);
+
+		// release the packet of sequence number seq, or defer it when it is being read
+		void dispose_packet(int64_t seq);
+
+		// release the packet list of specified sequence number unless it is being read
+		// return true when released, false when deferred
+		bool release_packet(int64_t seq);
+
+		// retry to release those packets that were deferred
+		void release_pending_packets();
+
+		// signal the events of those readers waiting for new packets
+		void notify_readers();
+
+		// release all the packets in the circular buffer
+		void clear();
+
+		// take a packet list from the pool, fall back to the heap when the pool is exhausted
+		AVPacketList* alloc_node();
+
+		// return a packet list to the pool, or to the heap when it was not from the pool
+		void free_node(AVPacketList* pktl);
+
+		// find the sequence number of the last key frame at or before time in microseconds in O(log n)
+		// negative return indicates no key frame in the circular buffer
+		int64_t find_key_frame(int64_t time);
+
+		// get the order of the stream in the circular buffer by the source stream index, -1 for the primary stream
+		// negative return indicates no such stream
+		int find_stream(int stream_index);
+
+		// store a packet in the packet list, the payload is copied into the arena when there is room
+		// the packet is taken over when move is true
+		int store_packet(AVPacketList* pktl, AVPacket* pkt, bool move);
+
+		// remux the packets of an export to its file, running on the worker thread of the export
+		void export_worker(CircularBufferExport* ex);
+
+		// called by the last reference of a payload in the arena
+		static void release_region(void* opaque, uint8_t*);
+
+		AVPacketList** m_ring; // the ring of packet slots, packet of sequence number seq is at m_ring[seq & m_ring_mask]
+		int64_t m_ring_mask; // the number of slots minus 1, the number of slots is power of 2
+		std::atomic<int64_t> m_head; // sequence number of the next packet to be pushed
+		std::atomic<int64_t> m_tail; // sequence number of the oldest packet in the circular buffer
+		CircularBufferReader m_readers[CIRCULAR_BUFFER_MAX_READERS]; // the readers, background reader and main reader are registered on open
+		std::mutex m_reader_mutex; // guards registering, removing and looking up the readers by name
+		int64_t m_pending[CIRCULAR_BUFFER_MAX_READERS]; // sequence numbers of evicted packets whose release are deferred by readers
+		int m_nb_pending; // number of deferred packets
+
+		AVPacketList* m_nodes; // the pool of packet lists, preallocated on open for every slot and every deferred packet
+		AVPacketList* m_free_nodes; // the free packet lists in the pool, linked by next
+		int64_t m_nb_nodes; // the number of packet lists in the pool
+		std::atomic<int64_t> m_pool_hits; // counter of packet lists taken from the pool
+		std::atomic<int64_t> m_pool_misses; // counter of packet lists allocated from the heap
+
+		uint8_t* m_arena; // the payload arena, NULL when packet payloads are referenced
+		int64_t m_arena_size; // the size of the arena in bytes
+		int64_t m_arena_head; // the arena position where the next payload is written, offset is m_arena_head % m_arena_size
+		int64_t m_arena_tail; // the arena position of the oldest payload still referenced
+		CircularBufferRegion* m_regions; // the regions in the arena, in the same order as the payloads written
+		int64_t m_regions_mask; // the number of regions minus 1, the number of regions is power of 2
+		int64_t m_region_head; // the index of the next region
+		int64_t m_region_tail; // the index of the oldest region still referenced
+		std::atomic<int64_t> m_arena_hits; // counter of payloads copied into the arena
+		std::atomic<int64_t> m_arena_misses; // counter of payloads referenced outside the arena
+
+		CircularBufferKey* m_keys; // the key frame index in the order of pts, it has as many entries as the ring slots
+		std::atomic<int64_t> m_key_head; // index of the next key frame entry
+		std::atomic<int64_t> m_key_tail; // index of the oldest key frame entry still in the circular buffer
+		std::atomic<int64_t> m_newest_time; // pts of the newest packet in microseconds
+		MappedRing* m_spill; // the second tier of packets evicted from memory, NULL when there is no spilling
+		bool m_black_box; // packets are written to the spill file on pushing instead of on evicting
+		int64_t m_hold_start; // the relative clock in microseconds the writer started to wait for the readers in current push, 0 for not waiting
+		int m_thin_age; // the age in seconds beyond which only key frames of the primary stream are kept, 0 for no thinning
+		int64_t m_thin_pos; // sequence number of the next packet to be considered for thinning
+		std::atomic<int64_t> m_thinned; // counter of packets thinned out
+
+		CircularBufferExport m_exports[CIRCULAR_BUFFER_MAX_EXPORTS];
+
+		CircularBufferPacketInfo* m_info; // the information of the packets, m_info[seq & m_ring_mask] is for packet of sequence number seq
+		CircularBufferStream m_streams[CIRCULAR_BUFFER_MAX_STREAMS]; // the streams in the order they were added
+		int m_nb_streams; // the number of streams
+		int m_primary; // the order of the primary stream, -1 when there is no stream
+
+		std::atomic<int> m_total_packets; // counter of total packets in the circular buffer
+		std::atomic<int> m_size;  // total size of the packets in the buffer
 		int m_time_span;  // max time span in seconds
-		int64_t m_pts_span; // pts span
-		int64_t m_last_pts;  // last valid pts
-		AVRational m_time_base; // the time base of the bind stream
-		int m_stream_index; // the desired stream index
-		int m_MaxSize; // the maximum size allowed for the circular buffer 
+		AVRational m_time_base; // the time base of the primary stream
+		std::atomic<int> m_MaxSize; // the maximum size allowed for the circular buffer 
+		int m_size_limit; // the maximum size on open, the ceiling of m_MaxSize
+		std::atomic<int64_t> m_bitrate; // bytes per second of the packets in the circular buffer
+
+		std::atomic<BufferManager*> m_manager; // the buffer manager sharing the global budget, NULL when there is none
+		int64_t m_rebalance_time; // the time in microseconds of the newest packet when the buffer manager was asked to rebalance
+
+		int m_err; // the error code of last operation
+		ErrorMessage m_message; // the error message of last operation
+
+		friend class BufferManager;
+	};
+
+	// The buffer manager shares one global budget in bytes among many circular buffers.
+	// The budget is handed out by the bitrate each buffer observes over its time span, weighted by priority.
+	// The sizes are only changed by lowering or raising the maximum size of the buffers, whose writers evict
+	// the packets over it on next push. The writers are never blocked.
+	class BufferManager
+	{
+	public:
+		BufferManager();
+		~BufferManager();
+
+		// set the global budget in bytes
+		void open(int64_t budget);
+
+		// add a circular buffer sharing the budget, with a priority weight
+		// return 0 on success, negative for error code
+		int add_buffer(CircularBuffer* cbuf, int weight = 1);
+
+		// remove a circular buffer, whose maximum size is restored to that on open
+		// return 0 on success, negative for error code
+		int remove_buffer(CircularBuffer* cbuf);
+
+		// set the priority weight of a circular buffer, for example higher for a camera with an active event
+		// return 0 on success, negative for error code
+		int set_weight(CircularBuffer* cbuf, int weight);
+
+		// hand out the budget again by the bitrates and the weights of the buffers
+		// it returns 1 without doing anything when another thread is rebalancing and wait is false
+		// return 0 on success, negative for error code
+		int rebalance(bool wait = true);
+
+		// get the global budget in bytes
+		int64_t get_budget();
+
+		// get the total size of the circular buffers in bytes
+		int64_t get_used();
+
+		// get the error message of last operation
+		std::string get_error_message();
+
+	protected:
+		std::mutex m_mutex; // guards the buffers and the weights
+		std::vector<CircularBuffer*> m_buffers;
+		std::vector<int> m_weights;
+		std::atomic<int64_t> m_budget;
 
 		int m_err; // the error code of last operation
 		std::string m_message; // the error message of last operation
+	};
+
+#define MUXER_ASYNC_QUEUE 512 // the default number of packets queued to the writer thread of an async muxer
+#define MUXER_ASYNC_CONTROL 8 // the queue slots kept beyond the packets for the chunk and flush commands
+#define MUXER_COMMAND_PACKET 0
+#define MUXER_COMMAND_CHUNK 1
+#define MUXER_COMMAND_FLUSH 2
 
-		bool flag_writing; // flag indicates adding new packet to the circular buffer
-		bool flag_reading; // flag indicates reading from the circular buffer
+	// a command queued to the writer thread of an async muxer
+	struct MuxerCommand
+	{
+		int type; // MUXER_COMMAND_*
+		AVPacket* pkt; // the packet of MUXER_COMMAND_PACKET, allocated once per slot
+		int stream_index;
+		int64_t time; // the relative clock in microseconds the command is queued
 	};
 
+#define MUXER_CHUNK_OVERSHOOT 10000 // the default milliseconds a chunk may run over its chunk time waiting for a key frame
+#define MUXER_PREOPEN_EARLY 1000 // a pre-opened segment is taken by a chunk up to this many milliseconds before its chunk time
+
+	// a segment of a chunked recording, opened with its header written
+	struct MuxerSegment
+	{
+		AVFormatContext* ctx;
+		std::string url;
+		int64_t time; // the chunk time in milliseconds the segment is opened for
+		bool discard; // remove the file on close, for a pre-opened segment never recorded
+	};
+
+	// The muxer writes the packets in the calling thread by default. With the "async" option set to true,
+	// record() and chunk() queue the packet or the chunk to a writer thread of the muxer and return at once,
+	// so a slow disk stalls the writer thread only. The queue is bounded by the "async_queue" option,
+	// a packet not fitting in is dropped, and so are the following ones until the next video key frame.
+	// The errors of the writer thread are returned by the next record(). record(), chunk(), flush() and close()
+	// shall be called from one thread.
+	// A chunked recording has a segment thread, unless the "preopen" option is false, which opens the file of the next
+	// chunk and writes its header ahead of the chunk time, and writes the trailer of a chunk and closes it after.
+	// A chunk is made at the first video key frame at or after the chunk time by the time stamps of the packets,
+	// so each chunk but the first starts with a key frame, or at any video packet after the "chunk_overshoot" milliseconds.
+	// A chunk() during a recording is made at the next key frame likewise.
+	// The chunk time is compared to the time stamps of the packets directly when the "wall_clock_pts" option is true,
+	// for the packets of a demuxer with its "wall_clock" option. Otherwise the time stamps are taken to the wall clock
+	// by the offset at the first packet of the recording, so a late packet does not move the chunks after.
+	// Getting chunked then only switches the output format context. A chunk() well before the chunk time opens its file
+	// in place of the pre-opened one, which is removed.
 	class Muxer
 	{
 	public:
@@ -122,7 +808,7 @@ namespace ffmpeg
 		// add a stream to the muxer
 		int add_stream(AVStream* stream);
 
-		// add a stream from the circular buffer
+		// add the streams from the circular buffer
 		int add_stream(CircularBuffer* circular_buffer);
 
 		// add streams from the input format context
@@ -134,6 +820,7 @@ namespace ffmpeg
 
 		// make another chunked recording
 		// first stop current recording in case there is one. Then start another recording by chunk prefix.
+		// a recording going on gets chunked at its next video key frame
 		// return 0 on success
 		int chunk();
 
@@ -142,12 +829,45 @@ namespace ffmpeg
 
 		// save the packet to the video recorder
 		// the stream index specify the audio or video
+		// return 0 on success, 1 when get chunked, 2 when dropped by an async muxer, negative for error code
 		int record(AVPacket* pkt, int stream_index = 0);
 
+		// wait until the writer thread has written all the packets queued, 0 on success, negative for error code
+		int flush();
+
+		// get the number of commands queued to the writer thread
+		int get_queue_depth();
+
+		// get the most commands ever queued to the writer thread
+		int get_max_queue_depth();
+
+		// get the average and the maximum latency in microseconds from queuing a packet to its being written
+		int64_t get_write_latency();
+		int64_t get_max_write_latency();
+
+		// get the number of packets dropped by the async muxer for the queue being full
+		int64_t get_dropped_packets();
+
+		// get the number of chunks switched to a pre-opened segment
+		int64_t get_preopened_chunks();
+
+		// get the longest time in microseconds the recording was held by getting chunked
+		int64_t get_max_chunk_time();
+
+		// get the duration of the last chunk and the longest one in microseconds, by the time stamps of their packets
+		int64_t get_chunk_duration();
+		int64_t get_max_chunk_duration();
+
+		// get the longest time in microseconds a chunk was made after its chunk time, waiting for a key frame
+		int64_t get_max_overshoot();
+
+		// get the number of chunks made at a packet other than a key frame, for running over by the chunk overshoot
+		int64_t get_forced_chunks();
+
 		// set the options for video recorder, has to be called before open
 		int set_options(std::string option, std::string value);
 
-		// get the output format context
+		// get the output format context, NULL for an async muxer recording, whose writer thread switches the context
 		AVFormatContext* get_output_format_context();
 
 		// get the stream time base
@@ -160,6 +880,50 @@ namespace ffmpeg
 		std::string get_url();
 
 	protected:
+		// open the recording file specified by m_url and write the header
+		int open_file();
+
+		// write a packet, make another chunk and close the recording in the calling thread
+		int write_packet(AVPacket* pkt, int stream_index);
+		int chunk_file(bool due = false);
+		int close_file();
+
+		// get the chunk time in milliseconds of the chunk after the one starting now
+		// the one after a chunk due is a chunk interval after the chunk time
+		int64_t get_next_chunk_time(bool due);
+
+		// update the time base factors and the offsets of the time stamps to the output streams of a new recording
+		void reset_time_stamps();
+
+		// switch the recording to the next segment, and hand the current one to the segment thread to be closed
+		int switch_segment(bool due);
+
+		// allocate an output format context of the streams of the muxer, open url and write the header
+		// it changes nothing of the muxer, so the segment thread calls it too
+		int open_segment(AVFormatContext** ctx, std::string url);
+
+		// write the trailer of a segment, close it and free its context
+		int close_segment(MuxerSegment* segment);
+
+		// open the next segment ahead of its chunk time and close the previous ones until the segment thread is stopped
+		void prepare();
+
+		// stop the segment thread after it has closed the segments handed to it, and remove the pre-opened one
+		void stop_segments();
+
+		// queue a command to the writer thread, which waits for room unless it is a packet
+		// return the sequence of the command, negative when the packet is dropped
+		int64_t queue_command(int type, AVPacket* pkt, int stream_index);
+
+		// write the commands queued until the muxer is stopped and the queue is empty
+		void write();
+
+		// stop the writer thread after it has written all the commands queued
+		void stop_writer();
+
+		// keep the error message and the url of the writer thread for the other thread
+		void set_async_message();
+
 		std::string m_url;
 		AVFormatContext* m_ofmt_Ctx;
 		AVDictionary* m_options;
@@ -171,6 +935,7 @@ namespace ffmpeg
 		int64_t m_chunk_time;
 		bool m_flag_interleaved;
 		bool m_flag_wclk;
+		bool m_flag_wclk_pts; // the time stamps of the packets are in the wall clock, as by the "wall_clock" option of the demuxer
 
 		AVRational m_tbf_video; // the factor to rescale the packet time stamp to fit output video stream
 		AVRational m_tbf_audio; // the factor to rescale the packet time stamp to fit output audio stream
@@ -183,9 +948,80 @@ namespace ffmpeg
 		int64_t m_defalt_duration_video;
 
 		int m_err; // the error code of last operation
-		std::string m_message; // the error message of last operation
+		ErrorMessage m_message; // the error message of last operation
 		std::string m_chunk_prefix;
 		std::string m_format;
+
+		bool m_flag_async; // record in the writer thread
+		int m_async_queue; // the most packets queued
+		std::thread m_writer;
+		std::vector<MuxerCommand> m_queue; // the ring of m_async_queue + MUXER_ASYNC_CONTROL commands
+		std::atomic<int64_t> m_head; // the sequence of the next command to be written, advanced by the writer thread
+		std::atomic<int64_t> m_tail; // the sequence of the next command to be queued
+		std::atomic<bool> m_stop; // stop the writer thread once the queue is empty
+		void* m_queued_event; // the auto reset event HANDLE set on queuing a command
+		void* m_written_event; // the auto reset event HANDLE set on writing a command
+		bool m_skip_to_key; // drop the packets until the next video key frame after a packet dropped
+		std::atomic<int> m_async_err; // the last error code of the writer thread, taken by record()
+		std::atomic<bool> m_async_chunked; // the writer thread made another chunk, taken by record()
+		int64_t m_chunks; // the number of chunk files switched to, the writer thread keeps the url when it changes
+		std::atomic<int> m_max_depth;
+		std::atomic<int64_t> m_written; // the number of packets written by the writer thread
+		std::atomic<int64_t> m_latency; // the total latency in microseconds of the packets written
+		std::atomic<int64_t> m_max_latency;
+		std::atomic<int64_t> m_dropped;
+		std::mutex m_async_mutex; // guards the message and the url kept for the other thread
+		std::string m_async_message;
+		std::string m_async_url;
+
+		bool m_flag_preopen; // pre-open the segments of a chunked recording in the segment thread
+		std::thread m_segmenter;
+		std::vector<AVCodecParameters*> m_segment_params; // the codec parameters of the streams of the segments
+		std::mutex m_segment_mutex; // guards the segments and the message of the segment thread
+		MuxerSegment m_next; // the segment pre-opened, ctx is NULL for none
+		int64_t m_next_time; // the chunk time the next segment is to be opened for
+		std::vector<MuxerSegment> m_closing; // the segments to be closed by the segment thread
+		bool m_segment_stop;
+		void* m_segment_event; // the auto reset event HANDLE set on handing a segment to the segment thread
+		std::atomic<int> m_segment_err; // the last error code of the segment thread, taken by the next chunk
+		std::string m_segment_message;
+		std::atomic<int64_t> m_preopened;
+		std::atomic<int64_t> m_max_chunk_time;
+
+		int m_chunk_overshoot; // the milliseconds a chunk may run over its chunk time waiting for a key frame
+		int64_t m_chunk_start; // the time in microseconds of the first packet of the chunk, AV_NOPTS_VALUE before it
+		int64_t m_chunk_end; // the chunk time in the time of the packets, in microseconds
+		int64_t m_clock_offset; // the wall clock minus the time of the packets in microseconds, taken once a recording
+		bool m_chunk_requested; // chunk() is called during the chunk
+		int64_t m_chunk_request_time; // the time in microseconds of the first video packet after chunk() is called
+		std::atomic<int64_t> m_chunk_duration;
+		std::atomic<int64_t> m_max_chunk_duration;
+		std::atomic<int64_t> m_max_overshoot;
+		std::atomic<int64_t> m_forced_chunks;
+	};
+
+	// the header of the probe cache file of a camera, followed by the streams and their extradata
+	// the offsets of the extradata are from the beginning of the file
+	struct ProbeCacheHeader
+	{
+		char magic[8]; // "PRBCACHE"
+		int32_t version;
+		int32_t nb_streams;
+		int64_t probe_time; // the microseconds the probing took, 0 for a cache rewritten with the parameter sets of the packets
+	};
+
+	// a stream in the probe cache file, the parameters of the mapped ring and those the muxer takes besides
+	struct ProbeCacheStream
+	{
+		MappedRingStream stream;
+		int32_t avg_frame_rate_num;
+		int32_t avg_frame_rate_den;
+		int32_t r_frame_rate_num;
+		int32_t r_frame_rate_den;
+		int32_t sample_aspect_ratio_num;
+		int32_t sample_aspect_ratio_den;
+		uint32_t codec_tag;
+		int32_t reserved;
 	};
 
 	class Demuxer
@@ -201,8 +1037,27 @@ namespace ffmpeg
 		int open(std::string url = "");
 
 		// read a packet from the camera
+		// a failed read reconnects to the camera when the "reconnect" option is on, the timestamps continue from before
 		int read_packet(AVPacket* pkt);
 
+		// close the camera and open it again, retrying with jittered exponential backoff up to the reconnect timeout
+		// the streams got before are invalid after it, the circular buffers hold their own copies of the streams
+		// a camera opened with the "nonblock" option makes one attempt a call, and waits for the backoff by AVERROR(EAGAIN)
+		// return 0 on success, AVERROR(EAGAIN) for a non-blocking reconnect going on, negative for error code
+		int reconnect();
+
+		// get the number of successful reconnects
+		int get_reconnects();
+
+		// get the milliseconds the last successful reconnect took, from the last packet read to the camera opened again
+		int64_t get_reconnect_time();
+
+		// get the maximum milliseconds a successful reconnect took
+		int64_t get_max_reconnect_time();
+
+		// get whether the last open or reconnect skipped probing the streams by the probe cache
+		bool get_probe_cached();
+
 		// get the input format context
 		AVFormatContext* get_input_format_context();
 
@@ -225,6 +1080,35 @@ namespace ffmpeg
 		std::string get_error_message();
 
 	protected:
+		// open the input format context by m_url and m_options, and find the streams
+		int open_input();
+
+		// make a reconnect attempt once its backoff has expired, AVERROR(EAGAIN) until then or for another attempt to come
+		int reconnect_attempt();
+
+		// the interrupt callback of the input, interrupting a blocking operation past the deadline
+		static int interrupt(void* opaque);
+
+		// align the timestamps of the stream to the wall clock of opening the camera
+		void align_stream(AVStream* st);
+
+		// get the probe cache file of the url
+		std::string get_probe_cache_file();
+
+		// fill the streams just opened from the probe cache of the url
+		// return 0 on success, negative when there is no valid cache
+		int load_probe_cache();
+
+		// save the probed streams into the probe cache of the url
+		// return 0 on success, negative for error code
+		int save_probe_cache(int64_t probe_time);
+
+		// check the parameter sets of a packet against the probe cache, the cache is rewritten when they changed
+		void check_probe_cache(AVPacket* pkt);
+
+		// read a frame from the input, or from the recorded file in replay
+		int read_frame(AVPacket* pkt);
+
 		std::string m_url;
 		AVFormatContext* m_ifmt_Ctx;
 		AVDictionary* m_options;
@@ -232,12 +1116,123 @@ namespace ffmpeg
 		int m_index_video;
 		int m_index_audio;
 		bool m_wclk_align;
+		bool m_nonblock; // read packets without blocking
+
+		std::atomic<int64_t> m_deadline; // the relative time in microseconds a blocking operation is interrupted at, 0 for none
+		int m_read_timeout; // the deadline of a read in milliseconds, 0 for none
+		int m_open_timeout; // the deadline of an open in milliseconds, 0 for none
+		bool m_reconnect; // reconnect to the camera on a failed read
+		int m_reconnect_timeout; // the maximum milliseconds of one reconnect
+		int m_reconnects; // the number of successful reconnects
+		int64_t m_reconnect_time; // the microseconds of the last reconnect
+		int64_t m_reconnect_start; // the relative time in microseconds the reconnect going on started, 0 for none
+		int64_t m_reconnect_next; // the relative time in microseconds of the next reconnect attempt
+		int64_t m_backoff; // the microseconds of the backoff after the next failed attempt, randomized by +/-50%
+		int m_attempts; // the attempts of the reconnect going on
+		int64_t m_max_reconnect_time; // the maximum microseconds of a reconnect
+		int64_t m_last_read_time; // the relative time in microseconds of the last packet read
+		std::vector<AVRational> m_time_bases; // the time bases of the streams on first open, the packets keep them after reconnects
+		std::vector<int64_t> m_last_dts; // the last dts of the streams in their time bases
+		std::vector<int64_t> m_ts_offsets; // the offsets added to the timestamps to continue them after reconnects
+		std::vector<bool> m_stitch; // the offset of the stream is found on its next packet
+		std::vector<bool> m_align_pending; // the stream opened without probing is aligned to the wall clock on its first packet
+		std::string m_probe_cache; // the path prefix of the probe cache files, empty for no probe cache
+		bool m_probe_cached; // the streams of the last open are from the probe cache
+		CircularBufferStream m_cache_streams[CIRCULAR_BUFFER_MAX_STREAMS]; // the parameter sets of the cached streams, checked against the packets
+
+		int m_replay; // one of DEMUXER_REPLAY_*
+		AVPacket m_replay_pkt; // the next packet of the replay, held until its time in non-blocking realtime replay
+		bool m_replay_held; // m_replay_pkt holds a packet
+		int64_t m_replay_offset; // the microseconds added to the timestamps of the file, a span for every loop
+		int64_t m_replay_begin; // the earliest time of the packets of the file in microseconds
+		int64_t m_replay_end; // the latest end time of the packets of the file in microseconds
+		int64_t m_replay_start; // the relative time in microseconds the realtime replay started
+		int64_t m_replay_first; // the time of the first packet of the realtime replay in microseconds
 
 		int m_err; // the error code of last operation
-		std::string m_message; // the error message of last operation
+		ErrorMessage m_message; // the error message of last operation
 		std::string m_format; // the camera format, can be rtsp, rtp, v4l2, dshow, file
 	};
 
+	// a camera serviced by a capture engine
+	struct CaptureCamera
+	{
+		Demuxer* demuxer;
+		CircularBuffer* cbuf;
+		int thread; // the I/O thread the camera is assigned to
+		int index_video; // the stream index of the video pushed into the circular buffer, -1 for none
+		int index_audio; // the stream index of the audio pushed into the circular buffer, -1 for none
+		std::atomic<int64_t> packets; // the number of packets pushed
+		std::atomic<int64_t> errors; // the number of failed reads other than no packet ready
+	};
+
+	// an I/O thread of a capture engine and the cameras it polls
+	struct CaptureThread
+	{
+		std::thread worker;
+		std::mutex mutex; // held by the worker through a poll of its cameras
+		std::vector<CaptureCamera*> cameras;
+	};
+
+	// The capture engine services many cameras from a small fixed pool of I/O threads instead of one thread per camera.
+	// Each camera is assigned to the thread with the fewest cameras. A thread reads its cameras in turn without blocking,
+	// up to CAPTURE_ENGINE_BURST packets each, pushes them into the circular buffers of the cameras,
+	// and sleeps for the poll interval only when none of its cameras has a packet ready.
+	// The cameras shall be opened with the "nonblock" option. A source that blocks anyway, like rtsp over tcp,
+	// still works but holds up the other cameras of its thread while it blocks. A camera reconnecting holds them up
+	// for one open attempt at a time, up to the open timeout, and waits for its backoff without blocking.
+	class CaptureEngine
+	{
+	public:
+		CaptureEngine();
+		~CaptureEngine();
+
+		// start nb_threads I/O threads, an idle thread sleeps poll_interval microseconds before polling its cameras again
+		// return 0 on success, negative for error code
+		int open(int nb_threads = 2, int poll_interval = 1000);
+
+		// add an opened camera whose video and audio packets are pushed into the circular buffer
+		// the streams of the camera shall have been added to the circular buffer, the camera shall not be read by others
+		// return the camera id (0 or positive) on success, negative for error code
+		int add_camera(Demuxer* camera, CircularBuffer* cbuf);
+
+		// remove a camera, which is not read any more once it returns
+		// return 0 on success, negative for error code
+		int remove_camera(int camera);
+
+		// stop the I/O threads, the cameras stay open and added
+		void close();
+
+		// get the number of packets pushed of specified camera, negative for error code
+		int64_t get_packets(int camera);
+
+		// get the number of failed reads of specified camera, negative for error code
+		int64_t get_errors(int camera);
+
+		// get the number of polls that found no packet ready and slept
+		int64_t get_idle_polls();
+
+		// get the number of I/O threads
+		int get_nb_threads();
+
+		// get the error message of last operation
+		std::string get_error_message();
+
+	protected:
+		// poll the cameras of specified I/O thread until the engine is closed
+		void poll(int thread);
+
+		std::mutex m_mutex; // guards the cameras and the threads
+		std::vector<CaptureCamera*> m_cameras; // indexed by camera id, NULL for a removed camera
+		std::vector<CaptureThread*> m_threads;
+		std::atomic<bool> m_abort;
+		std::atomic<int64_t> m_idle_polls;
+		int m_poll_interval; // in microseconds
+
+		int m_err; // the error code of last operation
+		std::string m_message; // the error message of last operation
+	};
+
 	class HWDecoder
 	{
 	public:
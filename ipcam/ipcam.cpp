@@ -23,6 +23,8 @@ DWORD WINAPI videoCapture(LPVOID myPtr)
 	AVRational tb = ipCam->get_stream_time_base();
 	tb.num *= 1000; // change the time base to be ms based
 	int index_video = ipCam->get_video_index();
+	int index_audio = ipCam->get_audio_index();
+	int reconnects = 0;
 
 	// read packets from IP camera and save it into circular buffer
 	while (true)
@@ -37,15 +39,25 @@ DWORD WINAPI videoCapture(LPVOID myPtr)
 			continue;
 		}
 
-		if (pkt.stream_index == index_video)
+		// the circular buffer and its readers go on through the reconnect, the timestamps continue
+		if (ipCam->get_reconnects() != reconnects)
 		{
-			ret = cbuf->push_packet(&pkt);  // add the packet to the circular buffer
+			reconnects = ipCam->get_reconnects();
+			fprintf(stderr, "Reconnected to the camera %d times, this time in %lldms, at most %lldms.\n",
+				reconnects, ipCam->get_reconnect_time(), ipCam->get_max_reconnect_time());
+		}
+
+		if (pkt.stream_index == index_video || (pkt.stream_index == index_audio && cbuf->get_stream(index_audio)))
+		{
+			int64_t pts = pkt.pts;
+			int size = pkt.size;
+			ret = cbuf->push_packet(&pkt, true);  // hand the video or audio packet over to the circular buffer
 			if (ret >= 0)
 			{
 				if (Debug > 2)
 				{
 					fprintf(stderr, "Added a new packet (%lldms, %d). Poped %d packets. The circular buffer has %d packets with size %d now.\n",
-						pkt.pts * tb.num / tb.den, pkt.size, ret, cbuf->get_total_packets(), cbuf->get_size());
+						pts * tb.num / tb.den, size, ret, cbuf->get_total_packets(), cbuf->get_size());
 				}
 			}
 			else
@@ -83,7 +95,14 @@ int main(int argc, char** argv)
 	// ip camera options
 	ipCam->set_options("buffer_size", "200000");
 	ipCam->set_options("rtsp_transport", "tcp");
-	ipCam->set_options("stimeout", "100000");
+	ipCam->set_options("stimeout", "2000000");
+
+	// reconnect to the camera when no packet is read in 5s, within 30s per reconnect
+	ipCam->set_options("read_timeout", "5000");
+	ipCam->set_options("open_timeout", "10000");
+	ipCam->set_options("reconnect", "true");
+	ipCam->set_options("reconnect_timeout", "30000");
+	ipCam->set_options("probe_cache", prefix_videofile); // open and reconnect without probing the streams of a known camera
 
 	// USB camera options
 	//ipCam->set_options("video_size", "1280x720");
@@ -96,7 +115,18 @@ int main(int argc, char** argv)
 		fprintf(stderr, "Could not open IP camera at %s with error %s.\n", CameraPath.c_str(), ipCam->get_error_message().c_str());
 		exit(1);
 	}
-	AVStream* input_stream = ipCam->get_stream(ipCam->get_video_index());
+	fprintf(stderr, "%s.\n", ipCam->get_error_message().c_str());
+	int index_video = ipCam->get_video_index();
+	int index_audio = ipCam->get_audio_index();
+	AVStream* input_stream = ipCam->get_stream(index_video);
+	AVStream* audio_stream = index_audio >= 0 ? ipCam->get_stream(index_audio) : NULL;
+
+	// mp4 recordings take aac audio only
+	if (audio_stream && audio_stream->codecpar->codec_id != AV_CODEC_ID_AAC)
+	{
+		fprintf(stderr, "Audio codec %d of the camera is not recorded.\n", audio_stream->codecpar->codec_id);
+		audio_stream = NULL;
+	}
 
 	// Debug only, output the camera information
 	if (Debug > 0)
@@ -107,13 +137,21 @@ int main(int argc, char** argv)
 	// Open a circular buffer
 	cbuf = new CircularBuffer();
 	cbuf->open(30, 100 * 1000 * 1000); // set the circular buffer to be hold packets for 30s and maximum size 100M
+	cbuf->set_reader_policy(CIRCULAR_BUFFER_BACKGROUND_READER, CIRCULAR_BUFFER_POLICY_SKIP_TO_KEY); // never resume recording mid-GOP
+	cbuf->set_reader_policy(CIRCULAR_BUFFER_MAIN_READER, CIRCULAR_BUFFER_POLICY_BACKPRESSURE, 100); // hold the capture up to 100ms per packet for the main recording
 	cbuf->add_stream(input_stream);
+	if (audio_stream)
+	{
+		cbuf->add_stream(audio_stream); // audio packets are interleaved with video packets in the same circular buffer
+	}
 
 	Muxer* bg_recorder = new Muxer();
 	int bg_video_muxer_index = bg_recorder->add_stream(input_stream);
+	int bg_audio_muxer_index = audio_stream ? bg_recorder->add_stream(audio_stream) : -1;
 
 	Muxer* mn_recorder = new Muxer();
 	int mn_video_muxer_index = mn_recorder->add_stream(input_stream);
+	int mn_audio_muxer_index = audio_stream ? mn_recorder->add_stream(audio_stream) : -1;
 
 	// Start a seperate thread to capture video stream from the IP camera
 	//pthread_t thread;
@@ -131,29 +169,32 @@ int main(int argc, char** argv)
 	AVRational timebase = cbuf->get_time_base();
 	int64_t pts0 = 0;
 	int64_t last_pts = 0;
-	bool no_data = true;
 	bool main_recorder_recording = false;
 
 	bg_recorder->set_options("movflags", "frag_keyframe");
 	bg_recorder->set_options("format", "mp4"); // self defined option
+	bg_recorder->set_options("async", "true"); // write in a thread of the recorder, not to stall this loop on disk
+	bg_recorder->set_options("wall_clock_pts", "true"); // the camera aligns its time stamps to the wall clock
 
 	mn_recorder->set_options("movflags", "frag_keyframe");
+	mn_recorder->set_options("async", "true");
+	mn_recorder->set_options("wall_clock_pts", "true");
 
 	// Open a chunked recording for background recording, where chunk time is 60s
 	ret = bg_recorder->open(prefix_videofile + "background-", 60);
-	//av_dump_format(bg_recorder->get_output_format_context(), 0, bg_recorder->get_url().c_str(), 1);
 
 	int64_t MainStartTime = av_gettime() / 1000 + 15000;
+	int PreRoll = 10000; // pre-roll of the main recording in milliseconds
 	int64_t ChunkTime_bg = 0;  // Chunk time for background recording
 	int64_t ChunkTime_mn = 0;  // Chunk time for main recording
 	int64_t CurrentTime = MainStartTime - 100;
 	while (true)
 	{
 		CurrentTime = av_gettime() / 1000;  // read current time in miliseconds
-		no_data = true;
 
-		// read a background packet from the queue
-		ret = cbuf->peek_packet(&pkt);
+		// read a background packet from the queue, wait up to 20ms for it unless the main recording has packets to catch up
+		ret = cbuf->wait_packet(CIRCULAR_BUFFER_BACKGROUND_READER, &pkt,
+			main_recorder_recording && cbuf->get_lag(CIRCULAR_BUFFER_MAIN_READER) > 0 ? 0 : 20);
 		if (ret > 0)
 		{
 			if (pts0 == 0)
@@ -174,15 +215,18 @@ int main(int argc, char** argv)
 					1000 * (pkt.pts - pts0) * timebase.num / timebase.den, pkt.size, cbuf->get_total_packets());
 			}
 
-			if (pkt.pts == AV_NOPTS_VALUE || pkt.size == 0 || pkt.pts < last_pts)
+			if (pkt.stream_index == index_video && (pkt.pts == AV_NOPTS_VALUE || pkt.size == 0 || pkt.pts < last_pts))
 			{
 				fprintf(stderr, "Read a wrong background packet pts time: %lldms, dt: %lldms, packet size %d, total size: %d.\n",
 					1000 * pkt.pts * timebase.num / timebase.den,
 					1000 * (pkt.pts - pts0) * timebase.num / timebase.den, pkt.size, cbuf->get_total_packets());
 			}
 
-			last_pts = pkt.pts;
-			ret = bg_recorder->record(&pkt);
+			if (pkt.stream_index == index_video)
+			{
+				last_pts = pkt.pts;
+			}
+			ret = bg_recorder->record(&pkt, pkt.stream_index == index_audio ? bg_audio_muxer_index : bg_video_muxer_index);
 			
 			// check for error
 			if (ret < 0)
@@ -194,29 +238,24 @@ int main(int argc, char** argv)
 				break;
 			}
 
-			// check for chunk
-			if (ret > 0)
+			// check for chunk, the output format context of an async recorder belongs to its writer thread
+			if (ret == 1)
 			{
-				av_dump_format(bg_recorder->get_output_format_context(), 0,
-					bg_recorder->get_url().c_str(), 1);
+				fprintf(stderr, "Background recording get chunked to %s.\n", bg_recorder->get_url().c_str());
 			}
-			no_data = false;
 		}
 
 		// arbitrary set main recording starts 15s later
 		if (CurrentTime <= MainStartTime)
 		{
-			if (no_data)
-			{
-				av_usleep(1000 * 20); //sleep for 20ms
-			}
 			continue;
 		}
 
 		if (!main_recorder_recording)
 		{
 			ret = mn_recorder->open(prefix_videofile + "main-", 3600);
-			av_dump_format(mn_recorder->get_output_format_context(), 0, mn_recorder->get_url().c_str(), 1);
+			cbuf->rewind_reader(CIRCULAR_BUFFER_MAIN_READER, PreRoll); // start the main recording from a key frame PreRoll ms ago
+			fprintf(stderr, "Main recording started in %s.\n", mn_recorder->get_url().c_str());
 			main_recorder_recording = true;
 			ChunkTime_mn = CurrentTime + 60000;
 		}
@@ -226,7 +265,18 @@ int main(int argc, char** argv)
 		{
 			ChunkTime_mn += 120000;
 			mn_recorder->chunk();
-			av_dump_format(mn_recorder->get_output_format_context(), 0, mn_recorder->get_url().c_str(), 1);
+			fprintf(stderr, "Readers dropped %lld (background) and %lld (main) packets, the main recording stalled the capture %lldms.\n",
+				cbuf->get_reader_dropped(CIRCULAR_BUFFER_BACKGROUND_READER), cbuf->get_reader_dropped(CIRCULAR_BUFFER_MAIN_READER),
+				cbuf->get_reader_stalled(CIRCULAR_BUFFER_MAIN_READER));
+			fprintf(stderr, "Recorders dropped %lld (background) and %lld (main) packets, queued up to %d and %d, written in %lldus and %lldus at most.\n",
+				bg_recorder->get_dropped_packets(), mn_recorder->get_dropped_packets(),
+				bg_recorder->get_max_queue_depth(), mn_recorder->get_max_queue_depth(),
+				bg_recorder->get_max_write_latency(), mn_recorder->get_max_write_latency());
+			fprintf(stderr, "Background recording switched %lld chunks to pre-opened files, getting chunked took %lldus at most.\n",
+				bg_recorder->get_preopened_chunks(), bg_recorder->get_max_chunk_time());
+			fprintf(stderr, "Background chunks lasted %lldms, %lldms at most, made up to %lldms after the chunk time, %lld not at a key frame.\n",
+				bg_recorder->get_chunk_duration() / 1000, bg_recorder->get_max_chunk_duration() / 1000,
+				bg_recorder->get_max_overshoot() / 1000, bg_recorder->get_forced_chunks());
 			fprintf(stderr, "Main recording get chunked.\n");
 		}
 
@@ -241,7 +291,7 @@ int main(int argc, char** argv)
 					1000 * (pkt.pts - pts0) * timebase.num / timebase.den, pkt.size, ret);
 			}
 
-			if (mn_recorder->record(&pkt) < 0)
+			if (mn_recorder->record(&pkt, pkt.stream_index == index_audio ? mn_audio_muxer_index : mn_video_muxer_index) < 0)
 			{
 				fprintf(stderr, "%s muxing packet in %s.\n",
 					mn_recorder->get_error_message().c_str(),
@@ -249,18 +299,6 @@ int main(int argc, char** argv)
 				break;
 			}
 			//av_packet_unref(&pkt);
-
-			no_data = false;
-		}
-
-		// sleep to reduce the cpu usage
-		if (no_data)
-		{
-			av_usleep(1000 * 20); // sleep for extra 20ms when there is no more background reading
-		}
-		else
-		{
-			av_usleep(1000 * 5); // sleep for 5ms}
 		}
 	}
 